@@ -19,11 +19,13 @@ HObject * cacheAlloc(ExecEnv *ee, struct methodtable *mptr, long size)
   JHandle  *_h;
   uint     *obj;
   int      bin;
+  ALLOCLIST *allocList;
  
   uint nbytes = sizeof(GCHandle) + size;
 
   if (nbytes <= MAX_CHUNK_ALLOC) {
     bin = chkconv.szToBinIdx[ nbytes ];
+    chkProfileSize( nbytes );
 
     chkAllocSmallInlined( ee, bin, _h );
 
@@ -35,7 +37,8 @@ HObject * cacheAlloc(ExecEnv *ee, struct methodtable *mptr, long size)
 
     h = (GCHandle*)_h;
     obj = (uint *)(h + 1);
-    if (size > 0) 
+    allocList = &ee->gcblk.allocLists[ bin ];
+    if (size > 0 && !(allocList->lastBumped && allocList->bumpZero)) 
       memset( obj, 0, size );
 
 #ifdef RCDEBUG
@@ -44,7 +47,12 @@ HObject * cacheAlloc(ExecEnv *ee, struct methodtable *mptr, long size)
     h->methods = mptr;
     h->obj     = obj;
 
-    gcBuffLogNewHandle(ee, h);
+    if (allocList->lastBumped)
+      gcBuffLogBumpedHandle(ee, allocList, h);
+    else
+      gcBuffLogNewHandle(ee, h);
+
+    gcSampleAlloc(ee, h, nbytes, bin);
 
 #ifdef RCDEBUG
     delta = GetTickCount() - delta;
@@ -60,8 +68,8 @@ HObject * cacheAlloc(ExecEnv *ee, struct methodtable *mptr, long size)
     for(i=0; i<3; i++) {
       ph = blkAllocRegion( nbytes, ee  );
       if (ph) goto __good;
-      gcvar.memStress = true;
-      gcRequestSyncGC();
+      if (!gcStallForMemory( ee, (nbytes + BLOCKSIZE-1) >> BLOCKBITS ))
+        break;
     }
     
     return NULL;
@@ -74,8 +82,8 @@ HObject * cacheAlloc(ExecEnv *ee, struct methodtable *mptr, long size)
 #endif
 
 
+    /* blkAllocRegion() hands the region out zeroed */
     obj = (uint *)(h+1);
-    ZeroMemory( obj, size );
 #ifdef RCDEBUG
     h->status = Im_used;
 #endif
@@ -86,6 +94,8 @@ HObject * cacheAlloc(ExecEnv *ee, struct methodtable *mptr, long size)
     
     ph->allocInProgress = 0;
 
+    gcSampleAlloc(ee, h, nbytes, -1);
+
 #ifdef RCDEBUG
     delta = GetTickCount() - delta;
     if (delta > deltaMax) {
@@ -118,7 +128,7 @@ TotalObjectMemory(void)
 int64_t
 FreeObjectMemory(void)
 {
-  int freePartialBytes[N_BINS], freePartialBlocks[N_BINS];
+  int freePartialBytes[MAX_BINS], freePartialBlocks[MAX_BINS];
 
   int nBlockBlocks = blkvar.nWildernessBlocks + blkvar.nListsBlocks;
   int nBlockBytes, nPartialBytes, nPartialBlocks, nBytes, i;
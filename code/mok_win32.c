@@ -3,6 +3,14 @@
  * Purpose:   Win32 abstraction layer
  */
 
+#ifdef RCLP64
+/* 
+ * mokThreadSuspendForGC() saves the 32-bit registers into the HPI's
+ * sys_thread_t, which has room for those only.
+ */
+#error "mok_win32.c not ported to LP64: the GC register capture is x86 only"
+#endif
+
 /*
  * Memory 
  *
@@ -11,7 +19,7 @@
 
 #define WIN32PGGRANULE (64*1024)
 
-void* mokMemReserve(void *starting_at_hint, unsigned sz )
+void* mokMemReserve(void *starting_at_hint, size_t sz )
 {
   void *p = VirtualAlloc( starting_at_hint, sz, MEM_RESERVE, PAGE_READWRITE );
   sysAssert( sz );
@@ -19,7 +27,7 @@ void* mokMemReserve(void *starting_at_hint, unsigned sz )
   return p;
 }
 
-void mokMemUnreserve( void *start, unsigned sz )
+void mokMemUnreserve( void *start, size_t sz )
 {
   BOOL res;
   mokMemDecommit( start, sz );
@@ -28,24 +36,137 @@ void mokMemUnreserve( void *start, unsigned sz )
   
 }
 
-void* mokMemCommit( void *start, unsigned sz, bool zero_out )
+/*
+ * Large pages.
+ *
+ * Large page memory is reserved and committed in one go and can't be
+ * decommitted, so the regions handed out are remembered: decommitting
+ * them does nothing and committing them again only zeroes them when
+ * asked to.
+ */
+#define MOK_MAX_LARGE_REGIONS 16
+
+static unsigned mokLargePageSize;
+static size_t   mokLargeBytesWanted;
+static size_t   mokLargeBytesObtained;
+static int      mokNLargeRegions;
+static struct { byte *start; byte *end; } mokLargeRegions[ MOK_MAX_LARGE_REGIONS ];
+
+static bool _mokIsLarge( void *start )
+{
+  int i;
+  for (i=0; i<mokNLargeRegions; i++)
+    if ((byte*)start >= mokLargeRegions[i].start && 
+        (byte*)start <  mokLargeRegions[i].end)
+      return true;
+  return false;
+}
+
+/* Returns NULL if the commit charge can't be had */
+void* mokMemTryCommit( void *start, size_t sz, bool zero_out )
 {
-  void *p = VirtualAlloc( start, sz, MEM_COMMIT, PAGE_READWRITE );
   sysAssert( start );
   sysAssert( sz );
+  if (_mokIsLarge( start )) {
+    if (zero_out)
+      memset( start, 0, sz );
+    return start;
+  }
+  return VirtualAlloc( start, sz, MEM_COMMIT, PAGE_READWRITE );
+}
+
+void* mokMemCommit( void *start, size_t sz, bool zero_out )
+{
+  void *p = mokMemTryCommit( start, sz, zero_out );
   sysAssert( p );
   return p;
 }
 
-void mokMemDecommit( void *start, unsigned sz )
+void mokMemDecommit( void *start, size_t sz )
 {
   BOOL res;
   sysAssert( start );
   sysAssert( sz );
+  if (_mokIsLarge( start ))
+    return;
   res = VirtualFree( start, sz, MEM_DECOMMIT );
   sysAssert( res );
 }
 
+/*
+ * Enable the lock memory privilege, which large pages require, and
+ * find the large page size.  Returns 0 if large pages can't be had.
+ */
+unsigned mokMemEnableLargePages( void )
+{
+  HANDLE           token;
+  TOKEN_PRIVILEGES tp;
+  bool             ok;
+
+  if (!OpenProcessToken( GetCurrentProcess(), 
+                         TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, 
+                         &token ))
+    return 0;
+  tp.PrivilegeCount = 1;
+  tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  ok = LookupPrivilegeValue( NULL, SE_LOCK_MEMORY_NAME, 
+                             &tp.Privileges[0].Luid ) &&
+       AdjustTokenPrivileges( token, FALSE, &tp, 0, NULL, NULL ) &&
+       GetLastError() == ERROR_SUCCESS;
+  CloseHandle( token );
+  if (ok)
+    mokLargePageSize = GetLargePageMinimum();
+  return mokLargePageSize;
+}
+
+/*
+ * Reserve and commit "sz" bytes, rounded up to a large page, backed by
+ * large pages.  Returns NULL if large pages are not enabled, the region
+ * is smaller than a large page or the OS can't find enough of them.
+ */
+void* mokMemReserveLarge( size_t sz )
+{
+  void *p;
+
+  if (!mokLargePageSize || sz < mokLargePageSize ||
+      mokNLargeRegions == MOK_MAX_LARGE_REGIONS)
+    return NULL;
+  sz = (sz + mokLargePageSize - 1) & ~(mokLargePageSize - 1);
+  mokLargeBytesWanted += sz;
+  p = VirtualAlloc( NULL, sz, 
+                    MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, 
+                    PAGE_READWRITE );
+  if (!p)
+    return NULL;
+  mokLargeBytesObtained += sz;
+  mokLargeRegions[ mokNLargeRegions ].start = (byte*)p;
+  mokLargeRegions[ mokNLargeRegions ].end = (byte*)p + sz;
+  mokNLargeRegions++;
+  return p;
+}
+
+/*
+ * Reserve and commit zeroed memory, on large pages if possible.
+ */
+void* mokMemReserveCommitted( size_t sz )
+{
+  void *p = mokMemReserveLarge( sz );
+  if (p)
+    return p;
+  p = mokMemReserve( NULL, sz );
+  mokMemCommit( p, sz, true );
+  return p;
+}
+
+/*
+ * How many bytes were asked for, and obtained, on large pages.
+ */
+void mokMemLargeStats( size_t *pWanted, size_t *pObtained )
+{
+  *pWanted = mokLargeBytesWanted;
+  *pObtained = mokLargeBytesObtained;
+}
+
 /* C style */
 void* mokMalloc( unsigned sz, bool zero_out )
 {
@@ -65,13 +186,66 @@ void mokFree( void * p)
 }
 
 /* zero out */
-void mokMemZero( void *start, unsigned sz )
+void mokMemZero( void *start, size_t sz )
 {
   mokMemDecommit( start, sz );
   mokMemCommit( start, sz, TRUE );
 }
 
 
+/*
+ * NUMA
+ *
+ * On a machine without NUMA support everything is node 0.
+ */
+int mokNumaNodeCount( void )
+{
+  ULONG highest;
+  if (!GetNumaHighestNodeNumber( &highest ))
+    return 1;
+  return (int)highest + 1;
+}
+
+int mokCurrentNumaNode( void )
+{
+  UCHAR node;
+  if (!GetNumaProcessorNode( (UCHAR)GetCurrentProcessorNumber(), &node ))
+    return 0;
+  return node;
+}
+
+/* Returns NULL if the commit charge can't be had */
+void* mokMemTryCommitOnNode( void *start, size_t sz, int node )
+{
+  sysAssert( start );
+  sysAssert( sz );
+  return VirtualAllocExNuma( GetCurrentProcess(), start, sz, 
+                             MEM_COMMIT, PAGE_READWRITE, (DWORD)node );
+}
+
+void* mokMemCommitOnNode( void *start, size_t sz, int node )
+{
+  void *p = mokMemTryCommitOnNode( start, sz, node );
+  sysAssert( p );
+  return p;
+}
+
+
+/*
+ * Threads
+ *
+ * These are plain win32 threads which the JVM knows nothing about.
+ * They must not touch JVM state: no ExecEnv, no sys monitors.
+ */
+HANDLE mokThreadCreate( DWORD (WINAPI *f)(void*), void *param )
+{
+  DWORD  tid;
+  HANDLE h = CreateThread( NULL, 0, f, param, 0, &tid );
+  sysAssert( h );
+  return h;
+}
+
+
 /*
  * YLRC --
  * 
@@ -89,7 +263,7 @@ void mokThreadSuspendForGC(sys_thread_t *tid)
 
   if (SuspendThread(tid->handle) == 0xffffffffUL) {
     jio_printf( "sysThreadSuspendForGC: SuspendThread failed" );
-    __asm { int 3 }
+    __debugbreak();
   }
   {
     CONTEXT context;
@@ -98,7 +272,7 @@ void mokThreadSuspendForGC(sys_thread_t *tid)
     context.ContextFlags = CONTEXT_INTEGER | CONTEXT_CONTROL;
     if (!GetThreadContext(tid->handle, &context)) {
       jio_printf( "sysThreadSuspendForGC: GetThreadContext failed" );
-      __asm { int 3 }
+      __debugbreak();
     }
     *esp++ = context.Eax;
     *esp++ = context.Ebx;
@@ -116,7 +290,7 @@ void mokThreadResumeForGC(sys_thread_t *tid)
 
   if (ResumeThread(tid->handle) == 0xffffffffUL) {
     printf( "sysThreadResumeForGC: ResumeThread failed" );
-    __asm { int 3 }
+    __debugbreak();
   }
 }
 
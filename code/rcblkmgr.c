@@ -4,6 +4,26 @@
  * Author:  Mr. Yossi Levanoni
  * Purpose: implementation of the block manager
  */
+/*
+ * Index of the lowest bit set in a non-zero word.
+ */
+static int _lowestBit( uint m )
+{
+  unsigned long res;
+  _BitScanForward( &res, m );
+  return (int)res;
+}
+
+/*
+ * Index of the highest bit set in a non-zero word.
+ */
+static int _highestBit( uint m )
+{
+  unsigned long res;
+  _BitScanReverse( &res, m );
+  return (int)res;
+}
+
 /******************* Initialization ********************************/
 GCFUNC void blkInit(unsigned nMB)
 {
@@ -13,11 +33,37 @@ GCFUNC void blkInit(unsigned nMB)
   memset( &blkvar, 0, sizeof(blkvar) );
 
   /* Allocate the heap */
-  mokAssert( nMB < (1<<BLOCKBITS) && nMB>0);
-  blkvar.heapSz = nMB << 20;
-  blkvar.heapStart = (byte*)mokMemReserve( NULL, blkvar.heapSz );
+  mokAssert( nMB <= MAX_HEAP_MB && nMB>0);
+  blkvar.heapSz = (size_t)nMB << 20;
+  blkvar.heapStart = (byte*)mokMemReserveLarge( blkvar.heapSz );
+  blkvar.largePages = blkvar.heapStart != NULL;
+  if (!blkvar.largePages)
+    blkvar.heapStart = (byte*)mokMemReserve( NULL, blkvar.heapSz );
   blkvar.heapTop = blkvar.heapStart + blkvar.heapSz;
-  mokMemCommit( blkvar.heapStart, blkvar.heapSz, false );
+
+  /* 
+   * A stripe per NUMA node.  Nothing is committed yet, see 
+   * _commitHeap().
+   */
+  blkvar.nNodes = 1;
+  if (gcvar.opt.numaAware) {
+    blkvar.nNodes = mokNumaNodeCount();
+    if (blkvar.nNodes > MAX_NUMA_NODES)
+      blkvar.nNodes = MAX_NUMA_NODES;
+  }
+  blkvar.nBlocks = blkvar.heapSz >> BLOCKBITS;
+  blkvar.blocksPerNode = 
+    (blkvar.nBlocks + blkvar.nNodes - 1) / blkvar.nNodes;
+  blkvar.commitTop = blkvar.heapStart;
+
+  /* 
+   * A large page heap comes committed in one piece, it is neither 
+   * striped over the nodes nor trimmed.
+   */
+  if (blkvar.largePages) {
+    blkvar.commitTop = blkvar.heapTop;
+    blkvar.nCommittedBlocks = blkvar.nBlocks;
+  }
 
 #ifdef RCVERBOSE
   jio_printf(
@@ -28,16 +74,11 @@ GCFUNC void blkInit(unsigned nMB)
 #endif 
 
   /* Allocate block headers table */
-  blkvar.nWildernessBlocks = blkvar.nBlocks = blkvar.heapSz >> BLOCKBITS;
+  blkvar.nWildernessBlocks = blkvar.nBlocks;
   sz = sizeof( BlkAllocHdr ) * (blkvar.nBlocks + 3);
-  blkvar.allocatedBlockHeaders  = (BlkAllocHdr*)mokMemReserve( NULL, sz );
-  mokMemCommit( blkvar.allocatedBlockHeaders, sz, true );
+  blkvar.allocatedBlockHeaders  = (BlkAllocHdr*)mokMemReserveCommitted( sz );
 
   blkvar.allocatedBlockHeaders ++;
-	
-  blkvar.pRegionLists = 
-    (BlkListHdr*)blkvar.allocatedBlockHeaders + blkvar.nBlocks + 1;
-
 
   bhSet_status( (blkvar.allocatedBlockHeaders-1) , DUMMYBLK );
   bhSet_status( (blkvar.allocatedBlockHeaders+blkvar.nBlocks) , DUMMYBLK );
@@ -47,6 +88,32 @@ GCFUNC void blkInit(unsigned nMB)
 	
   blkvar.heapTopRegion = (BlkRegionHdr*)OBJBLOCKHDR( blkvar.heapTop );
   blkvar.wildernessRegion = (BlkRegionHdr*)OBJBLOCKHDR( blkvar.heapStart );
+
+  /* Decommitted flags, one per block below commitTop */
+  blkvar.decommitted = (byte*)mokMemReserve( NULL, blkvar.nBlocks );
+  mokMemCommit( blkvar.decommitted, blkvar.nBlocks, true );
+
+  /* Zero flags, the heap is all zero to begin with */
+  blkvar.zeroed = (byte*)mokMemReserve( NULL, blkvar.nBlocks );
+  mokMemCommit( blkvar.zeroed, blkvar.nBlocks, false );
+  memset( blkvar.zeroed, 1, blkvar.nBlocks );
+
+#ifdef RCFREEBMP
+  /* Free bitmaps, one per block */
+  sz = sizeof(uint) * FREEBMP_WORDS * blkvar.nBlocks;
+  blkvar.freeBmps = (uint*)mokMemReserve( NULL, sz );
+  mokMemCommit( blkvar.freeBmps, sz, true );
+#endif
+
+  /* Parallel sweeping state, one record per block at most */
+  blkvar.sweepRanges = 
+    (SWEEPWORKER*)mokMalloc( sizeof(SWEEPWORKER) * 
+                             MAX_GC_WORKERS * SWEEP_RANGES_PER_WORKER, true );
+  if (GC_POOL_SIZE() > 1) {
+    sz = sizeof(word) * blkvar.nBlocks;
+    blkvar.sweepRecords = (word*)mokMemReserve( NULL, sz );
+    mokMemCommit( blkvar.sweepRecords, sz, false );
+  }
 	
   /* Allocate mutex */
   blkvar.blkMgrMon = sysMalloc(sysMonitorSizeof());
@@ -78,7 +145,189 @@ static void _UnlockBlkMgr(sys_thread_t* thrd )
   sysMonitorExit( thrd, blkvar.blkMgrMon );
 }
 
-  
+
+/*******************************************************
+*                   NODE CACHES                        *
+********************************************************/
+
+/*******************************************************
+* Keep a free block in a node's cache.  Fails if the
+* cache is full, the block is then returned to the
+* block manager.
+********************************************************/
+static bool _cachePush( BLKCACHE *c, BlkAllocHdr *ph, unsigned id )
+{
+  bool res = false;
+
+  gcSpinLockEnter( &c->lock, id );
+  if (c->n < BLK_CACHE_SIZE) {
+    bhSet_status( ph, BLKCACHED );
+    c->blocks[ c->n++ ] = ph;
+    InterlockedIncrement( (long*)&blkvar.nCachedBlocks );
+    res = true;
+  }
+  gcSpinLockExit( &c->lock, id );
+  return res;
+}
+
+/*******************************************************
+* Move up to "max" blocks out of a node's cache into
+* "pph".  They stay BLKCACHED but are no longer
+* counted as cached.  Returns the number of blocks
+* moved.
+********************************************************/
+static int _cachePopSome( BLKCACHE *c, BlkAllocHdr **pph, int max, 
+                          unsigned id )
+{
+  int n = 0;
+
+  if (!c->n)
+    return 0;
+  gcSpinLockEnter( &c->lock, id );
+  while (c->n && n < max) {
+    pph[ n ] = c->blocks[ --c->n ];
+    mokAssert( bhGet_status(pph[n]) == BLKCACHED );
+    n++;
+  }
+  gcSpinLockExit( &c->lock, id );
+  if (n)
+    InterlockedExchangeAdd( (long*)&blkvar.nCachedBlocks, -n );
+  return n;
+}
+
+
+/*******************************************************
+* Commit heap memory in [start, end), each part on the
+* NUMA node whose stripe it belongs to.  If the OS
+* can't back all of it nothing is left committed and
+* false is returned.
+********************************************************/
+static bool _commitHeap( byte *start, byte *end )
+{
+  byte *from = start;
+
+  if (blkvar.nNodes == 1)
+    return mokMemTryCommit( start, end - start, false ) != NULL;
+  while (start < end) {
+    int   node = BLKNODE( OBJBLOCKHDR( start ) );
+    byte *stripeEnd = blkvar.heapStart + 
+      (((node+1) * blkvar.blocksPerNode) << BLOCKBITS);
+    if (stripeEnd > end)
+      stripeEnd = end;
+    if (!mokMemTryCommitOnNode( start, stripeEnd - start, node )) {
+      if (start > from)
+        mokMemDecommit( from, start - from );
+      return false;
+    }
+    start = stripeEnd;
+  }
+  return true;
+}
+
+#define REGIONADDR(brh)   ((byte*)BLOCKHDROBJ( (BlkAllocHdr*)(brh) ))
+#define REGIONIDX(brh)    ((BlkAllocHdr*)(brh) - blkvar.allocatedBlockHeaders)
+
+/*******************************************************
+* Make sure the "nBlocks" blocks starting at "brh" are
+* committed.  Blocks below commitTop are committed
+* unless the trimmer flagged them, blocks above it are
+* committed a grain at a time.  Returns false if the
+* OS is out of commit charge; the blocks committed
+* before that stay committed and accounted for.
+********************************************************/
+static bool _commitRegion( BlkRegionHdr *brh, int nBlocks )
+{
+  byte *end = REGIONADDR( brh + nBlocks );
+
+  if (blkvar.nDecommittedBlocks) {
+    byte *flag = blkvar.decommitted + REGIONIDX( brh );
+    byte *last = flag + nBlocks;
+    if (end > blkvar.commitTop)
+      last = blkvar.decommitted + REGIONIDX( OBJBLOCKHDR(blkvar.commitTop) );
+
+    while (flag < last) {
+      byte *run = flag;
+      if (!*flag) {
+        flag++;
+        continue;
+      }
+      while (flag < last && *flag)
+        flag++;
+      if (!_commitHeap( blkvar.heapStart + ((run - blkvar.decommitted) << BLOCKBITS),
+                        blkvar.heapStart + ((flag - blkvar.decommitted) << BLOCKBITS) ))
+        return false;
+      memset( run, 0, flag - run );
+      blkvar.nDecommittedBlocks -= flag - run;
+      blkvar.nCommittedBlocks += flag - run;
+    }
+  }
+
+  if (end > blkvar.commitTop) {
+    byte *newTop = blkvar.heapStart + 
+      ((end - blkvar.heapStart + HEAP_COMMIT_GRAIN - 1) & ~(HEAP_COMMIT_GRAIN-1));
+    if (newTop > blkvar.heapTop)
+      newTop = blkvar.heapTop;
+    if (!_commitHeap( blkvar.commitTop, newTop ))
+      return false;
+    blkvar.nCommittedBlocks += (newTop - blkvar.commitTop) >> BLOCKBITS;
+    blkvar.commitTop = newTop;
+  }
+  return true;
+}
+
+/*******************************************************
+* Decommit the "nBlocks" free blocks starting at "brh",
+* all of which are below commitTop.  Returns the number
+* of blocks which were committed before.  The blocks
+* will be zero when they are committed again.
+********************************************************/
+static int _decommitRegion( BlkRegionHdr *brh, int nBlocks )
+{
+  byte *flag = blkvar.decommitted + REGIONIDX( brh );
+  int   i, n = 0;
+
+  mokAssert( REGIONADDR( brh + nBlocks ) <= blkvar.commitTop );
+  memset( blkvar.zeroed + REGIONIDX( brh ), 1, nBlocks );
+  for (i=0; i<nBlocks; i++) {
+    if (!flag[i]) {
+      flag[i] = 1;
+      n++;
+    }
+  }
+  if (n) {
+    mokMemDecommit( REGIONADDR( brh ), nBlocks << BLOCKBITS );
+    blkvar.nDecommittedBlocks += n;
+    blkvar.nCommittedBlocks -= n;
+  }
+  return n;
+}
+
+/*******************************************************
+* Zero the blocks of the "nBlocks" starting at "brh"
+* which are not known to be zero.  If "keep" is set
+* they are all flagged zero afterwards, otherwise they
+* are being handed out and their flags are cleared.
+* Returns the number of blocks zeroed.
+********************************************************/
+static int _zeroRegion( BlkRegionHdr *brh, int nBlocks, bool keep )
+{
+  byte *flag = blkvar.zeroed + REGIONIDX( brh );
+  int   i = 0, n = 0;
+
+  while (i < nBlocks) {
+    int run = i;
+    if (flag[i]) {
+      flag[i++] = (byte)keep;
+      continue;
+    }
+    while (i < nBlocks && !flag[i])
+      flag[i++] = (byte)keep;
+    memset( REGIONADDR( brh + run ), 0, (i - run) << BLOCKBITS );
+    n += i - run;
+  }
+  return n;
+}
+
 /*******************************************************
 * Allocate nBlocks from the part of the heap that
 * hasn't been touched thus far.
@@ -124,118 +373,77 @@ static void _insertRegionIntoQuickLists( BlkRegionHdr *brh, int sz )
 }
 
 /*****************************************************************
-* Insert a region into the list of lists of regions.  If a list
-* for the region size exists then it is added to it.  Otherwise,
-* a new list is inserted to the list of lists for holding regions
-* of "sz" blocks.
-* 
-* If the region becomes an element in a list of regions than its
-* "regionSize" field is updated to "sz".  The last block in the
-* region has its size updated to "-sz" at any rate.
+* Map a region size to its class in the region index.  Sizes
+* below REGION_SL_COUNT are all in first level 0, one class per
+* size.  Above that, the first level is given by the highest bit
+* and the second level by the REGION_SL_BITS bits below it.
 ******************************************************************/
-static void _insertRegionIntoRegionLists( BlkRegionHdr *brh, int sz )
+static void _regionClass( unsigned sz, int *pFl, int *pSl )
 {
-  int regionSize = -1;
-  BlkListHdr *pPrevList, *pList;
-  BlkListHdr *blh = (BlkListHdr *)brh;
-
-  BlkRegionHdr *lastBlk = brh + (sz-1);
+  int hb;
 
-  lastBlk->StatusUnused = BLK << 24;
-  lastBlk->regionSize = -sz;
-
-  mokAssert( sz > 1 );
-
-  pList = blkvar.pRegionLists->nextList;
-  pPrevList = blkvar.pRegionLists;
-  for (; pList; pPrevList = pList, pList = pList->nextList) {
-    regionSize = pList->listRegionSize;
-    if (sz <= regionSize)
-      break;
+  if (sz < REGION_SL_COUNT) {
+    *pFl = 0;
+    *pSl = sz;
+    return;
   }
+  hb = _highestBit( sz );
+  *pFl = hb - REGION_SL_BITS + 1;
+  *pSl = (sz >> (hb - REGION_SL_BITS)) - REGION_SL_COUNT;
+}
 
+/*****************************************************************
+* Insert a region into the region index.  The first and last
+* blocks of the region are marked as BLK, the first carries the
+* size and the last carries -sz.
+******************************************************************/
+static void _insertRegionIntoRegionLists( BlkRegionHdr *brh, int sz )
+{
+  BlkRegionHdr *lastBlk = brh + (sz-1);
+  BlkRegionHdr **pList;
+  int fl, sl;
 
-  /**
-   * Perfect match
-   */
-  if (regionSize == sz ) {
-
-    brh->StatusUnused = BLK<<24;
-    brh->regionSize = sz;
+  mokAssert( sz >= N_QUICK_BLK_MGR_LISTS );
 
-    brh->nextRegion = pList->nextRegion;
-    brh->prevRegion = (BlkRegionHdr *)pList;
-    if (pList->nextRegion)
-      pList->nextRegion->prevRegion = brh;
-    pList->nextRegion = brh;
+  brh->StatusUnused = BLK << 24;
+  brh->regionSize = sz;
+  lastBlk->StatusUnused = BLK << 24;
+  lastBlk->regionSize = -sz;
 
-    return;
-  }
+  _regionClass( sz, &fl, &sl );
+  pList = &blkvar.regionLists[fl][sl];
 
-  /**
-   * Create new empty list.
-   */
-  blh->nextRegion = NULL;
-
-  blh->StatusPrevListID = BLKLIST << 24;
-  blh->listRegionSize = sz;
+  brh->nextRegion = *pList;
+  if (brh->nextRegion)
+    brh->nextRegion->prevRegion = brh;
+  brh->prevRegion = (BlkRegionHdr *)pList;
+  *pList = brh;
 
-  /** 
-   * we want to insert after pPrevList and before
-   * pList.
-   */
-  bhSet_prev_region_list( blh, pPrevList );
-  blh->nextList = pList;
-  pPrevList->nextList = blh;
-  if (pList) {
-    bhSet_prev_region_list( pList, blh);
-  }
+  blkvar.regionSlBits[fl] |= 1 << sl;
+  blkvar.regionFlBits |= 1 << fl;
 }
 
 /*****************************************************
 * Extract the argument region from the list it's
-* in.  Assumes that the region is not a list header.
+* in.  If it was the last region of its class in the
+* region index, the class bits are cleared.
 ******************************************************/
 static void _extractFromRegionList( BlkRegionHdr *ph )
 {
+  int fl, sl;
+
   ph->prevRegion->nextRegion = ph->nextRegion;
   if (ph->nextRegion)
     ph->nextRegion->prevRegion = ph->prevRegion;
-}
 
-/*****************************************************
-* Extract the argument region, which is a list header,
-* from the list of lists.
-******************************************************/
-static void _extractFromListOfLists( BlkListHdr *ph )
-{
-  BlkListHdr *newHeader = (BlkListHdr *)ph->nextRegion;
-  BlkListHdr *prevList = bhGet_prev_region_list( ph );
-
-  /**
-   * Change list header to the next element in the
-   * list
-   */
-  if (newHeader) {
-    int sz = ((BlkRegionHdr *)newHeader)->regionSize;
-    bhSet_prev_region_list( newHeader, prevList );
-    newHeader->nextList = ph->nextList;
-
-    prevList->nextList = newHeader;
-    if (newHeader->nextList) {
-      bhSet_prev_region_list( newHeader->nextList, newHeader );
-    }		
-    bhSet_status( newHeader, BLKLIST );
-    newHeader->listRegionSize = sz;
+  if (ph->regionSize < N_QUICK_BLK_MGR_LISTS)
     return;
-  }
-  /**
-   * Eliminate the list.
-   */
-  prevList->nextList = ph->nextList;
-  if (ph->nextList) {
-    BlkListHdr *prevList = bhGet_prev_region_list( ph );
-    bhSet_prev_region_list( ph->nextList, prevList );
+
+  _regionClass( ph->regionSize, &fl, &sl );
+  if (blkvar.regionLists[fl][sl] == NULL) {
+    blkvar.regionSlBits[fl] &= ~(1 << sl);
+    if (blkvar.regionSlBits[fl] == 0)
+      blkvar.regionFlBits &= ~(1 << fl);
   }
 }
 
@@ -250,10 +458,10 @@ static void _tryExtractRightNbr( BlkRegionHdr **pph, int *pSz)
 {
   BlkRegionHdr *nbr = *pph + *pSz;
   int status = bhGet_status( nbr );
-  int size = nbr->regionSize; // conicides with the size field of BLKLIST
+  int size = nbr->regionSize;
 
 #ifdef RCDEBUG
-  if (status==BLK || status==BLKLIST) {
+  if (status==BLK) {
     BlkRegionHdr *lastBlock = nbr + size - 1;
     mokAssert( size > 0 );
     mokAssert( bhGet_status( lastBlock ) == BLK );
@@ -266,12 +474,6 @@ static void _tryExtractRightNbr( BlkRegionHdr **pph, int *pSz)
     blkvar.nListsBlocks -= size;
     *pSz += size;
   }
-  else if (status == BLKLIST) {
-    BlkListHdr *blh = (BlkListHdr *)nbr;
-    _extractFromListOfLists( blh );
-    blkvar.nListsBlocks -= size;
-    *pSz += size;
-  }
 }
 
 /*****************************************************
@@ -287,27 +489,14 @@ static void _tryExtractLeftNbr( BlkRegionHdr **pph, int *pSz)
   int status = bhGet_status( nbr );
   int size = nbr->regionSize==1 ? 1 : -nbr->regionSize;
 
-  /** 
-   * That's because items in the list are
-   * bigger than a single block and their
-   * final block is marked with BLK.
-   */
-  mokAssert( status != BLKLIST );
-	
   if (status == BLK) {
     mokAssert( size > 0 );
     nbr = nbr + 1 - size;
 
-    status = bhGet_status( nbr );
+    mokAssert( bhGet_status( nbr ) == BLK );
     mokAssert( nbr->regionSize == size );
 
-    if (status == BLK) {
-      _extractFromRegionList( nbr );
-    }
-    else {
-      mokAssert( status == BLKLIST );
-      _extractFromListOfLists( (BlkListHdr *)nbr );
-    }
+    _extractFromRegionList( nbr );
 
     blkvar.nListsBlocks -= size;
 
@@ -322,7 +511,7 @@ static void _tryExtractLeftNbr( BlkRegionHdr **pph, int *pSz)
 * 1. see if it can be added to the wilderness.
 * 2. if not, try coalescing from the left and right.
 * 3. finally, add the resulting block to either the
-*    quick lists or the list of lists, depending on its
+*    quick lists or the region index, depending on its
 *    size.
 *************************************************************/
 static void _blkFreeRegion_locked( BlkRegionHdr *ph, int sz )
@@ -382,59 +571,55 @@ static BlkAllocHdr* _allocFromQuickLists( unsigned sz )
 
 /*************************************************
 * 
-* Allocates "sz" blocks from the lists of regions.
-* Try finding a list with elements at list of size
-* "sz".
-*
-* If the found list contains additional elements
-* besides the header, then the element after the
-* header is extracted from the list.
+* Allocates "sz" blocks from the region index.
 *
-* Otherwise, the list header itself is extracted 
-* from the list of lists.
+* The size is first rounded up to the next class
+* boundary so that any region in a class found by
+* the bit scans fits.  If there is none, the class
+* of "sz" itself may still hold a region which is
+* big enough, so it is searched as a last resort.
 *
-* Finally, if the list is not an exact match, the
-* leftover is returned to the system.
+* The found region is extracted and, if it is not
+* an exact match, the leftover is returned to the
+* system.
 **************************************************/                     
 static BlkAllocHdr* _allocFromRegionLists( int sz )
 {
   BlkRegionHdr *brh;
-  BlkListHdr *pList = blkvar.pRegionLists->nextList;
-  int regionSize, leftover;
-
-  for (; pList; pList = (BlkListHdr *)pList->nextList) {
-    regionSize = pList->listRegionSize;
-    if (sz <= regionSize)
-      goto __found_list;
+  unsigned bits, roundSz = sz;
+  int fl, sl, leftover;
+
+  if (roundSz >= REGION_SL_COUNT)
+    roundSz += (1 << (_highestBit( roundSz ) - REGION_SL_BITS)) - 1;
+  _regionClass( roundSz, &fl, &sl );
+
+  bits = blkvar.regionSlBits[fl] & (~0u << sl);
+  if (bits == 0) {
+    bits = blkvar.regionFlBits & (~0u << (fl+1));
+    if (bits) {
+      fl = _lowestBit( bits );
+      bits = blkvar.regionSlBits[fl];
+    }
   }
-  return NULL;
-
- __found_list:
 
-  brh = pList->nextRegion;
-  if (brh) { // extract next element in the list
-    BlkRegionHdr *nextB = brh->nextRegion;
-    if (nextB)
-      nextB->prevRegion = (BlkRegionHdr*)pList;
-    pList->nextRegion = nextB;
-  }
-  else { // extract list header itself
-    BlkListHdr *prevList = bhGet_prev_region_list( pList );
-    if (pList->nextList) {
-      bhSet_prev_region_list( pList->nextList, prevList);
-    }
-    /**
-     * the next assignment may update *blkvar.pRegionLists
-     * itself since the first element in the list
-     * has its prevList pointer pointing at this
-     * variable.
-     */
-    prevList->nextList = pList->nextList;
-    brh = (BlkRegionHdr*)pList;
+  if (bits) {
+    sl = _lowestBit( bits );
+    brh = blkvar.regionLists[fl][sl];
+    mokAssert( brh && brh->regionSize >= sz );
+  }
+  else {
+    _regionClass( sz, &fl, &sl );
+    for (brh = blkvar.regionLists[fl][sl]; brh; brh = brh->nextRegion)
+      if (brh->regionSize >= sz)
+        break;
+    if (!brh)
+      return NULL;
   }
 
+  _extractFromRegionList( brh );
+
   // do we have leftover
-  leftover = regionSize - sz;
+  leftover = brh->regionSize - sz;
 
   if (leftover >= N_QUICK_BLK_MGR_LISTS) {
     _insertRegionIntoRegionLists( brh + sz, leftover );
@@ -445,25 +630,31 @@ static BlkAllocHdr* _allocFromRegionLists( int sz )
   return (BlkAllocHdr*)brh;
 }
 
-static void _sweepBig(BlkAllocBigHdr *ph)
+static bool _isBigGarbage(BlkAllocBigHdr *ph)
 {
   GCHandle *h;
   uint *p;
 
-  if (ph->allocInProgress) return;
+  if (ph->allocInProgress) return false;
 
   h = (GCHandle*)BLOCKHDROBJ( (BlkAllocHdr*)ph );
   
-  if (gcGetHandleRC(h)>0) return;
+  if (gcGetHandleRC(h)>0) return false;
 
   p = h->logPos;
  
   if (p) {
-    mokAssert( ((*p)&~3) == (uint)h );
+    mokAssert( LOG_TO_HANDLE(*p) == h );
     mokAssert( ((*p)&3) == 0 || ((*p)&3) == BUFF_HANDLE_MARK);
     /* leave it for next cycle */
-    return;
+    return false;
   }
+  return true;
+}
+
+static void _sweepBig(BlkAllocBigHdr *ph)
+{
+  if (!_isBigGarbage( ph )) return;
 #ifdef RCDEBUG
   gcvar.dbg.nFreedInCycle++;
   gcvar.dbg.nBytesFreedInCycle += ph->blobSize * BLOCKSIZE;
@@ -500,6 +691,11 @@ static BlkAllocHdr* _blkAllocRegion_locked( int nBlocks )
   blkvar.nWildernessBlocks -= nBlocks;
 
  __checkout:
+  if (!_commitRegion( (BlkRegionHdr*)res, nBlocks )) {
+    /* out of commit charge: give it back, the caller stalls or fails */
+    _blkFreeRegion_locked( (BlkRegionHdr*)res, nBlocks );
+    return NULL;
+  }
   return res;
 }
 
@@ -513,23 +709,186 @@ static int _calcAllocSize(int nBytes)
 }
 
 
+/*******************************************************
+* Return all the cached blocks to the block manager so
+* they can be coalesced and serve big allocations.
+* Called by the collector before sweeping.
+*
+* Locks taken: each cache lock, then the block manager.
+********************************************************/
+static void _flushNodeCaches( void )
+{
+  int i;
+
+  for (i=0; i<blkvar.nNodes; i++) {
+    BLKCACHE *c = &blkvar.nodeCaches[ i ];
+
+    if (!c->n)
+      continue;
+    gcSpinLockEnter( &c->lock, (unsigned)gcvar.ee );
+    _LockBlkMgr( gcvar.sys_thread );
+    while (c->n) {
+      BlkAllocHdr *ph = c->blocks[ --c->n ];
+      mokAssert( bhGet_status(ph) == BLKCACHED );
+      InterlockedDecrement( (long*)&blkvar.nCachedBlocks );
+      _blkFreeRegion_locked( (BlkRegionHdr*)ph, 1 );
+    }
+    _UnlockBlkMgr( gcvar.sys_thread );
+    gcSpinLockExit( &c->lock, (unsigned)gcvar.ee );
+  }
+}
+
 /**** Exported Functions ***************/
+
+/*******************************************************
+* Refill a thread's block cache with up to
+* THREAD_BLK_BATCH blocks: from the cache of the node
+* we run on, else from the block manager, under a
+* single lock acquisition, else stolen from another
+* node's cache.
+*
+* The blocks are BLKCACHED while the thread holds them
+* and count in nThreadBlocks, which is free for the GC
+* trigger since HS1 takes them back.  The trigger is
+* checked once per refill rather than once per block.
+********************************************************/
+static void _refillThreadCache( ExecEnv *ee )
+{
+  BlkAllocHdr **cache = ee->gcblk.blkCache;
+  sys_thread_t *self = EE2SysThread( ee );
+  int node = BLKCURRENTNODE();
+  int n, i;
+
+  mokAssert( ee->gcblk.nBlkCache == 0 );
+
+  n = _cachePopSome( &blkvar.nodeCaches[ node ], 
+                     cache, THREAD_BLK_BATCH, (unsigned)ee );
+  if (n < THREAD_BLK_BATCH) {
+    _LockBlkMgr( self );
+    while (n < THREAD_BLK_BATCH) {
+      BlkAllocHdr *ph = (BlkAllocHdr *)_blkAllocRegion_locked( 1 );
+      if (!ph)
+        break;
+      bhSet_status( ph, BLKCACHED );
+      cache[ n++ ] = ph;
+    }
+    _UnlockBlkMgr( self );
+  }
+  for (i=1; !n && i<blkvar.nNodes; i++)
+    n = _cachePopSome( &blkvar.nodeCaches[ (node+i) % blkvar.nNodes ], 
+                       cache, THREAD_BLK_BATCH, (unsigned)ee );
+  ee->gcblk.nBlkCache = n;
+  InterlockedExchangeAdd( (long*)&blkvar.nBlocksHandedOut, n );
+  InterlockedExchangeAdd( (long*)&blkvar.nThreadBlocks, n );
+
+  gcCheckGC();
+}
+
+/*******************************************************
+* Allocate a single block, out of the thread's own
+* block cache.  No lock is taken unless the cache has
+* to be refilled.
+********************************************************/
 GCFUNC BlkAllocHdr* blkAllocBlock( ExecEnv *ee )
 {
   BlkAllocHdr *ph;
+
+  for (;;) {
+    /* HS1 may drain the cache, so the count is tested and taken at once */
+    ee->gcblk.cantCoop = true;
+    ph = NULL;
+    if (ee->gcblk.nBlkCache)
+      ph = ee->gcblk.blkCache[ --ee->gcblk.nBlkCache ];
+    ee->gcblk.cantCoop = false;
+    if (ph)
+      break;
+    _refillThreadCache( ee );
+    if (!ee->gcblk.nBlkCache)
+      return NULL;
+  }
+  mokAssert( bhGet_status(ph) == BLKCACHED );
+  bhSet_status( ph, CHUNKING );
+  InterlockedDecrement( (long*)&blkvar.nThreadBlocks );
+
+  return ph;
+}
+
+/*******************************************************
+* Give the blocks cached by a thread back to the block
+* manager.  Called when the thread detaches.
+********************************************************/
+GCFUNC void blkReleaseThreadCache( ExecEnv *ee )
+{
   sys_thread_t *self = EE2SysThread( ee );
+  int n, i;
+
+  /* take them out of HS1's reach first */
+  ee->gcblk.cantCoop = true;
+  n = ee->gcblk.nBlkCache;
+  ee->gcblk.nBlkCache = 0;
+  ee->gcblk.cantCoop = false;
+  if (!n)
+    return;
 
   _LockBlkMgr( self );
-
-  ph = (BlkAllocHdr *)_blkAllocRegion_locked( 1 );
-  if (ph) {
-    bhSet_status( ph, CHUNKING );
+  for (i=0; i<n; i++) {
+    BlkAllocHdr *ph = ee->gcblk.blkCache[ i ];
+    mokAssert( bhGet_status(ph) == BLKCACHED );
+    _blkFreeRegion_locked( (BlkRegionHdr*)ph, 1 );
   }
   _UnlockBlkMgr( self );
+  InterlockedExchangeAdd( (long*)&blkvar.nThreadBlocks, -n );
+}
 
-  gcCheckGC();
+/*******************************************************
+* Take back the blocks cached by a thread which HS1
+* has suspended.  No lock is taken, the thread may
+* hold any; the blocks are chained through nextPartial
+* until blkFreeDrainedBlocks() returns them, once the
+* threads run again.  They no longer count as handed
+* out, they were never used.
+********************************************************/
+GCFUNC void blkDrainThreadCache( ExecEnv *ee )
+{
+  int n = ee->gcblk.nBlkCache;
 
-  return ph;
+  mokAssert( !ee->gcblk.cantCoop );
+  if (!n)
+    return;
+  ee->gcblk.nBlkCache = 0;
+  while (n) {
+    BlkAllocHdr *ph = ee->gcblk.blkCache[ --n ];
+    mokAssert( bhGet_status(ph) == BLKCACHED );
+    ph->nextPartial = blkvar.drainedBlocks;
+    blkvar.drainedBlocks = ph;
+  }
+}
+
+/*******************************************************
+* Give the blocks drained at HS1 back to the block
+* manager.  Called by the collector.
+*
+* Locks taken: the block manager.
+********************************************************/
+GCFUNC void blkFreeDrainedBlocks( void )
+{
+  BlkAllocHdr *ph = blkvar.drainedBlocks;
+  int n = 0;
+
+  if (!ph)
+    return;
+  blkvar.drainedBlocks = NULL;
+  _LockBlkMgr( gcvar.sys_thread );
+  while (ph) {
+    BlkAllocHdr *next = ph->nextPartial;
+    mokAssert( bhGet_status(ph) == BLKCACHED );
+    _blkFreeRegion_locked( (BlkRegionHdr*)ph, 1 );
+    ph = next;
+    n++;
+  }
+  _UnlockBlkMgr( gcvar.sys_thread );
+  InterlockedExchangeAdd( (long*)&blkvar.nThreadBlocks, -n );
+  InterlockedExchangeAdd( (long*)&blkvar.nBlocksHandedOut, -n );
 }
 
 GCEXPORT BlkAllocBigHdr* blkAllocRegion( unsigned nBytes, ExecEnv *ee )
@@ -566,6 +925,10 @@ GCEXPORT BlkAllocBigHdr* blkAllocRegion( unsigned nBytes, ExecEnv *ee )
 
   _UnlockBlkMgr( self );
 
+  /* the region is handed out zeroed, only its dirty blocks need it */
+  _zeroRegion( (BlkRegionHdr*)ph, nBlocks, false );
+  InterlockedExchangeAdd( (long*)&blkvar.nBlocksHandedOut, nBlocks );
+
 #ifdef RCDEBUG
   inter = (BlkAllocInternalHdr *)(ph+1);
   for (; inter < (BlkAllocInternalHdr *)lastBlk; inter++) {
@@ -579,21 +942,35 @@ GCEXPORT BlkAllocBigHdr* blkAllocRegion( unsigned nBytes, ExecEnv *ee )
   return ph;
 }
 
+/*******************************************************
+* Free chunked blocks.  Each goes to the cache of its
+* node if there is room, the rest to the block manager.
+* With zeroAheadMB set they are zeroed first, while
+* they are still warm from the sweep.
+********************************************************/
 GCFUNC void blkFreeSomeChunkedBlocks( BlkAllocHdr **pph, int n )
 {
-  int i, status;
+  int i, j, status;
   BlkAllocHdr *ph;
 
-  _LockBlkMgr( gcvar.sys_thread );
-
-  for (i=0; i<n; i++) {
+  for (i=j=0; i<n; i++) {
     ph = pph[i];
     status = bhGet_status(ph);
     mokAssert( status == DUMMYBLK );
-    _blkFreeRegion_locked( (BlkRegionHdr*)ph, 1 );
+    if (gcvar.opt.zeroAheadMB > 0)
+      _zeroRegion( (BlkRegionHdr*)ph, 1, true );
+    if (!_cachePush( &blkvar.nodeCaches[ BLKNODE(ph) ], 
+                     ph, 
+                     (unsigned)gcvar.ee ))
+      pph[j++] = ph;
   }
-
-  _UnlockBlkMgr( gcvar.sys_thread );
+  if (j) {
+    _LockBlkMgr( gcvar.sys_thread );
+    for (i=0; i<j; i++)
+      _blkFreeRegion_locked( (BlkRegionHdr*)pph[i], 1 );
+    _UnlockBlkMgr( gcvar.sys_thread );
+  }
+  gcNoteFreedBlocks( n );
 }
 
 GCFUNC void blkFreeChunkedBlock( BlkAllocHdr *ph )
@@ -603,9 +980,15 @@ GCFUNC void blkFreeChunkedBlock( BlkAllocHdr *ph )
   mokAssert ( status==VOIDBLK || status==PARTIAL );
 #endif
 
-  _LockBlkMgr( gcvar.sys_thread );
-  _blkFreeRegion_locked( (BlkRegionHdr*)ph, 1 );
-  _UnlockBlkMgr( gcvar.sys_thread );
+  if (gcvar.opt.zeroAheadMB > 0)
+    _zeroRegion( (BlkRegionHdr*)ph, 1, true );
+
+  if (!_cachePush( &blkvar.nodeCaches[ BLKNODE(ph) ], ph, (unsigned)gcvar.ee )) {
+    _LockBlkMgr( gcvar.sys_thread );
+    _blkFreeRegion_locked( (BlkRegionHdr*)ph, 1 );
+    _UnlockBlkMgr( gcvar.sys_thread );
+  }
+  gcNoteFreedBlocks( 1 );
 }
 
 GCFUNC void blkFreeRegion( BlkAllocBigHdr *ph )
@@ -637,26 +1020,44 @@ GCFUNC void blkFreeRegion( BlkAllocBigHdr *ph )
   _LockBlkMgr( gcvar.sys_thread );
   _blkFreeRegion_locked( (BlkRegionHdr *)ph, sz );
   _UnlockBlkMgr( gcvar.sys_thread );
-
+  gcNoteFreedBlocks( sz );
 }
 
 #ifdef RCDEBUG
 GCFUNC void blkPrintStats(void)
 {
   jio_printf("_______________ BLK STATS _______________\n" );
-  jio_printf("wild=%d list=%d used=%d\n",
-         blkvar.nWildernessBlocks, blkvar.nListsBlocks, blkvar.nAllocatedBlocks );
+  jio_printf("wild=%d list=%d used=%d cached=%d thread=%d committed=%d decommitted=%d\n",
+         blkvar.nWildernessBlocks, blkvar.nListsBlocks, blkvar.nAllocatedBlocks,
+         blkvar.nCachedBlocks, blkvar.nThreadBlocks, blkvar.nCommittedBlocks, 
+         blkvar.nDecommittedBlocks );
 }
 #endif
 
+/*
+ * What _sweepWalk does with each chunked block it passes.
+ */
+#define SWEEP_NOW        0  /* sweep it */
+#define SWEEP_MARK       1  /* mark it as sweep-pending */
+#define SWEEP_PENDING    2  /* sweep it if it is still sweep-pending */
+#define SWEEP_DEFER      3  /* sweep it, record the outcome in "w" */
+
+/**********************************************************
+* Walk the block headers from "brh" up to "limit".  Big
+* objects are swept on the spot (or recorded in "w" when
+* deferring), chunked blocks are handled according to "mode".
+*
+* Sweeping a chunked block may free it and coalesce it with
+* its right neighbor, so the header of the next block is read
+* before the current one is handed over.
+***********************************************************/
 #pragma optimize( "", off )
-GCFUNC void blkSweep(void)
+static void _sweepWalk(BlkRegionHdr *brh, BlkRegionHdr *limit, int mode,
+                       SWEEPWORKER *w)
 {
-  BlkRegionHdr *wildernessHdr = blkvar.wildernessRegion;
-  BlkRegionHdr *brh = (BlkRegionHdr*)blkvar.allocatedBlockHeaders;
   volatile int *volatile p;
 
-  while (brh < wildernessHdr) {
+  while (brh < limit) {
     volatile int size, status;
 
     p = (volatile int *volatile)&brh->regionSize;
@@ -667,13 +1068,26 @@ GCFUNC void blkSweep(void)
   __next_round:
     switch (status) {
     case BLK:
-    case BLKLIST:
       mokAssert( size >= 1 );
       brh += size;
       break;
 
+    case BLKCACHED:
+      brh++;
+      break;
+
     case ALLOCBIG:
-      _sweepBig( (BlkAllocBigHdr*)brh );
+      if (mode == SWEEP_DEFER) {
+        if (_isBigGarbage( (BlkAllocBigHdr*)brh )) {
+#ifdef RCDEBUG
+          w->nFreed++;
+          w->nBytesFreed += size * BLOCKSIZE;
+#endif
+          SWEEP_RECORD( w, brh, SWEEP_REC_FREE_BIG );
+        }
+      }
+      else if (mode != SWEEP_PENDING)
+        _sweepBig( (BlkAllocBigHdr*)brh );
       mokAssert( size >= 1 );
       brh += size;
       break;
@@ -687,10 +1101,17 @@ GCFUNC void blkSweep(void)
       size = *p;
       p++;
       nextStatus = (*p) >> 24;
-      chkSweepChunkedBlock( (BlkAllocHdr*)brh, status );
+      if (mode == SWEEP_NOW)
+        chkSweepChunkedBlock( (BlkAllocHdr*)brh, status );
+      else if (mode == SWEEP_MARK)
+        chkMarkForLazySweep( (BlkAllocHdr*)brh, status );
+      else if (mode == SWEEP_PENDING)
+        chkSweepPendingBlock( (BlkAllocHdr*)brh );
+      else
+        chkSweepChunkedBlockDeferred( (BlkAllocHdr*)brh, w );
       brh = nextBrh;
       status = nextStatus;
-      if (nextBrh >= wildernessHdr) return;
+      if (nextBrh >= limit) return;
       goto __next_round;
     }
 
@@ -701,6 +1122,293 @@ GCFUNC void blkSweep(void)
     }
   }
 }
+
+/**********************************************************
+* Split the block headers up to "limit" into nRanges ranges
+* of about the same number of blocks.
+*
+* A range must start at a region boundary.  While the sweep
+* is on, mutators only split regions and nothing is freed
+* until all the workers are done, so a boundary found here
+* remains one, and each range's walk ends exactly where the
+* next one's begins.
+***********************************************************/
+static void _splitSweepRange(BlkRegionHdr *limit, int nRanges)
+{
+  BlkRegionHdr *first = (BlkRegionHdr*)blkvar.allocatedBlockHeaders;
+  BlkRegionHdr *brh = first;
+  SWEEPWORKER *w = blkvar.sweepRanges;
+  int step = (limit - first + nRanges - 1) / nRanges;
+  int i;
+  volatile int *volatile p;
+
+  w[0].start = first;
+  for (i=1; i<nRanges; i++) {
+    BlkRegionHdr *goal = first + i*step;
+    if (goal > limit) goal = limit;
+
+    while (brh < goal) {
+      volatile int size, status;
+
+      p = (volatile int *volatile)&brh->regionSize;
+      size = *p;
+      p++;
+      status = (*p) >> 24;
+      if (status == BLK || status == ALLOCBIG) {
+        mokAssert( size >= 1 );
+        brh += size;
+      }
+      else
+        brh++;
+    }
+    w[i].start = w[i-1].limit = brh;
+  }
+  w[nRanges-1].limit = limit;
+
+  for (i=0; i<nRanges; i++) {
+    w[i].records = blkvar.sweepRecords + (w[i].start - first);
+    w[i].nRecords = 0;
+#ifdef RCDEBUG
+    w[i].nFreed = 0;
+    w[i].nBytesFreed = 0;
+#endif
+  }
+}
 #pragma optimize( "", on )
+
+/**********************************************************
+* A worker's part of the parallel sweep: it sweeps ranges
+* until none is left.
+***********************************************************/
+static void _sweepRange(int iWorker, void *arg)
+{
+  int i;
+
+  while ((i = gcWorkClaim( &blkvar.nextSweepRange, 
+                           blkvar.nSweepRanges, 1 )) >= 0) {
+    SWEEPWORKER *w = &blkvar.sweepRanges[ i ];
+    _sweepWalk( w->start, w->limit, SWEEP_DEFER, w );
+  }
+}
+
+/**********************************************************
+* Sweep the heap.  With more than one worker the block
+* headers are split into ranges which are swept in parallel;
+* the shared lists are only updated afterwards, by this
+* thread, from the ranges' records.
+***********************************************************/
+GCFUNC void blkSweep(void)
+{
+  BlkRegionHdr *limit;
+  int i;
+
+  _flushNodeCaches();
+  limit = blkvar.wildernessRegion;
+
+  if (gcvar.nWorkers <= 1) {
+    _sweepWalk( (BlkRegionHdr*)blkvar.allocatedBlockHeaders, limit,
+                SWEEP_NOW, NULL );
+    return;
+  }
+
+  blkvar.nSweepRanges = gcvar.nWorkers * SWEEP_RANGES_PER_WORKER;
+  blkvar.nextSweepRange = 0;
+  _splitSweepRange( limit, blkvar.nSweepRanges );
+  gcWorkParallel( _sweepRange, NULL );
+  for (i=0; i<blkvar.nSweepRanges; i++)
+    chkApplySweepRecords( &blkvar.sweepRanges[i] );
+}
+
+/**********************************************************
+* Lazy sweeping, first half: free dead big objects and mark
+* all chunked blocks as sweep-pending.  Only block headers
+* are touched so this is cheap compared to a full sweep.
+*
+* From here on mutators sweep the blocks they are about to
+* allocate from (see rcchunkmgr.c).
+***********************************************************/
+GCFUNC void blkPrepareLazySweep(void)
+{
+  _flushNodeCaches();
+  chunkvar.lazySweepActive = true;
+  _sweepWalk( (BlkRegionHdr*)blkvar.allocatedBlockHeaders, 
+              blkvar.wildernessRegion, SWEEP_MARK, NULL );
+}
+
+/**********************************************************
+* Lazy sweeping, second half: sweep whatever the mutators
+* have not.  Must be done before the next cycle starts
+* clearing dirty marks, since the sweep predicate relies on
+* the logPos of objects created since the trace.
+***********************************************************/
+GCFUNC void blkSweepPending(void)
+{
+  _sweepWalk( (BlkRegionHdr*)blkvar.allocatedBlockHeaders, 
+              blkvar.wildernessRegion, SWEEP_PENDING, NULL );
+  chkWaitForLazySweepers();
+  chunkvar.lazySweepActive = false;
+}
+
+/**********************************************************
+* Give committed but idle memory back to the OS.  Called
+* by the collector once the figures of a cycle are in.
+*
+* The idle trend follows drops in the number of idle
+* blocks at once and rises slowly, so a footprint which
+* is only briefly low does not get trimmed.  At most half
+* of it is decommitted per cycle, and not more than what
+* brings the committed blocks down to trimTargetMB.  The
+* top of the wilderness goes first, then the biggest
+* free regions; a region is decommitted as a whole so the
+* budget may be overrun by one region.
+*
+* Locks taken: the block manager.
+***********************************************************/
+GCFUNC void blkTrim(void)
+{
+  int          target, minBlocks, wildBlocks, idle, budget, fl, sl;
+  BlkRegionHdr *brh;
+
+  if (gcvar.opt.trimTargetMB <= 0 || blkvar.largePages)
+    return;
+  target = (gcvar.opt.trimTargetMB << 20) >> BLOCKBITS;
+  minBlocks = gcvar.opt.trimMinBlocks;
+  if (minBlocks < N_QUICK_BLK_MGR_LISTS)
+    minBlocks = N_QUICK_BLK_MGR_LISTS;
+
+  _LockBlkMgr( gcvar.sys_thread );
+
+  wildBlocks = 
+    (blkvar.commitTop - REGIONADDR( blkvar.wildernessRegion )) >> BLOCKBITS;
+  idle = blkvar.nListsBlocks + wildBlocks - blkvar.nDecommittedBlocks;
+  if (idle < blkvar.idleTrend)
+    blkvar.idleTrend = idle;
+  else
+    blkvar.idleTrend = (3*blkvar.idleTrend + idle) / 4;
+
+  budget = blkvar.nCommittedBlocks - target;
+  if (budget > blkvar.idleTrend / 2)
+    budget = blkvar.idleTrend / 2;
+
+  if (budget > 0 && wildBlocks > 0) {
+    int   n = budget < wildBlocks ? budget : wildBlocks;
+    byte *newTop = blkvar.commitTop - (n << BLOCKBITS);
+    byte *flag = blkvar.decommitted + REGIONIDX( OBJBLOCKHDR( newTop ) );
+    int   i, nFlagged = 0;
+
+    memset( blkvar.zeroed + REGIONIDX( OBJBLOCKHDR( newTop ) ), 1, n );
+    for (i=0; i<n; i++) {
+      nFlagged += flag[i];
+      flag[i] = 0;
+    }
+    mokMemDecommit( newTop, n << BLOCKBITS );
+    blkvar.nDecommittedBlocks -= nFlagged;
+    blkvar.nCommittedBlocks -= n - nFlagged;
+    budget -= n - nFlagged;
+    blkvar.commitTop = newTop;
+  }
+
+  for (fl=REGION_FL_COUNT-1; fl>=0 && budget>0; fl--) {
+    if (!(blkvar.regionFlBits & (1 << fl)))
+      continue;
+    for (sl=REGION_SL_COUNT-1; sl>=0 && budget>0; sl--) {
+      brh = blkvar.regionLists[fl][sl];
+      for (; brh && budget>0; brh = brh->nextRegion) {
+        if (brh->regionSize >= minBlocks)
+          budget -= _decommitRegion( brh, brh->regionSize );
+      }
+    }
+  }
+
+  _UnlockBlkMgr( gcvar.sys_thread );
+}
+
+/**********************************************************
+* Take the free regions of "list" which are not all zero
+* out of the block manager into "batch", until the batch
+* is full or "*pBudget" dirty blocks have been taken.
+* While out their end blocks are BLKCACHED, so neighbors
+* which are freed meanwhile don't coalesce with them.
+* Returns the new number of regions in the batch.
+*
+* Called with the block manager locked.
+***********************************************************/
+static int _claimDirtyRegions( BlkRegionHdr *list, BlkRegionHdr **batch,
+                               int *sizes, int n, int *pBudget )
+{
+  BlkRegionHdr *brh, *next;
+
+  for (brh = list; brh && n < ZERO_BATCH && *pBudget > 0; brh = next) {
+    byte *flag = blkvar.zeroed + REGIONIDX( brh );
+    int   sz = brh->regionSize;
+    int   i, dirty = 0;
+
+    next = brh->nextRegion;
+    for (i=0; i<sz; i++)
+      dirty += !flag[i];
+    if (!dirty)
+      continue;
+
+    _extractFromRegionList( brh );
+    blkvar.nListsBlocks -= sz;
+    blkvar.nAllocatedBlocks += sz;
+    brh->StatusUnused = BLKCACHED << 24;
+    (brh + sz - 1)->StatusUnused = BLKCACHED << 24;
+
+    batch[ n ] = brh;
+    sizes[ n ] = sz;
+    n++;
+    *pBudget -= dirty;
+  }
+  return n;
+}
+
+/**********************************************************
+* Zero free regions ahead of allocation, up to
+* zeroAheadMB worth of blocks per cycle.  Called by the
+* collector after blkTrim(), so nothing is zeroed only to
+* be decommitted.
+*
+* Small regions go first as they are the likeliest to be
+* allocated next.  The regions are taken out a batch at a
+* time, zeroed with the lock released and freed back.
+*
+* Locks taken: the block manager.
+***********************************************************/
+GCFUNC void blkZeroFree(void)
+{
+  BlkRegionHdr *batch[ ZERO_BATCH ];
+  int          sizes[ ZERO_BATCH ];
+  int          budget, n, i, fl, sl;
+
+  if (gcvar.opt.zeroAheadMB <= 0)
+    return;
+  budget = (gcvar.opt.zeroAheadMB << 20) >> BLOCKBITS;
+
+  while (budget > 0) {
+    n = 0;
+    _LockBlkMgr( gcvar.sys_thread );
+    for (i=1; i<N_QUICK_BLK_MGR_LISTS && n<ZERO_BATCH; i++)
+      n = _claimDirtyRegions( blkvar.quickLists[i], batch, sizes, n, &budget );
+    for (fl=0; fl<REGION_FL_COUNT && n<ZERO_BATCH; fl++) {
+      if (!(blkvar.regionFlBits & (1 << fl)))
+        continue;
+      for (sl=0; sl<REGION_SL_COUNT && n<ZERO_BATCH; sl++)
+        n = _claimDirtyRegions( blkvar.regionLists[fl][sl], 
+                                batch, sizes, n, &budget );
+    }
+    _UnlockBlkMgr( gcvar.sys_thread );
+
+    if (!n)
+      break;
+    for (i=0; i<n; i++)
+      _zeroRegion( batch[i], sizes[i], true );
+
+    _LockBlkMgr( gcvar.sys_thread );
+    for (i=0; i<n; i++)
+      _blkFreeRegion_locked( batch[i], sizes[i] );
+    _UnlockBlkMgr( gcvar.sys_thread );
+  }
+}
 \end{verbatim}
 \end{rawcfig}
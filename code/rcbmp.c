@@ -32,7 +32,7 @@
 /*
  * Specify (log) allignment of handles.
  */
-#define H_GRAIN_BITS      3
+#define H_GRAIN_BITS      OBJBITS
 /*
  * Field selector bits.  The next 3 bits select
  * the bit inside the bmp word.  there
@@ -47,9 +47,9 @@
 #define H1B_NON_BS_BITS   (H_GRAIN_BITS+H1B_FS_BITS)
 
 
-#define H1BIT_BYTE(entry,h)   (byte*)(((uint)h>>H1B_NON_BS_BITS) + (byte*)entry)
+#define H1BIT_BYTE(entry,h)   (byte*)(((haddr)(h)>>H1B_NON_BS_BITS) + (byte*)entry)
 
-void H1BIT_Set(byte* entry, unsigned h)
+void H1BIT_Set(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H1BIT_BYTE(entry, h);
@@ -60,7 +60,7 @@ void H1BIT_Set(byte* entry, unsigned h)
 }
 
 
-void H1BIT_Clear(byte* entry, unsigned h)
+void H1BIT_Clear(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H1BIT_BYTE(entry, h);
@@ -70,13 +70,13 @@ void H1BIT_Clear(byte* entry, unsigned h)
   *bbmp = v;
 }
 
-void H1BIT_ClearByte(byte* entry, unsigned h)
+void H1BIT_ClearByte(byte* entry, haddr h)
 {
   byte *bbmp = H1BIT_BYTE(entry, h);
   *bbmp = 0;
 }
 
-void H1BIT_Put(byte* entry, unsigned h, unsigned val)
+void H1BIT_Put(byte* entry, haddr h, unsigned val)
 {
   mokAssert( val <= 1);
   if (val==0)
@@ -85,7 +85,7 @@ void H1BIT_Put(byte* entry, unsigned h, unsigned val)
     H1BIT_Set(entry, h);
 }
 
-byte H1BIT_Get(byte* entry, unsigned h)
+byte H1BIT_Get(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte  *bbmp = H1BIT_BYTE(entry, h);
@@ -100,7 +100,7 @@ byte H1BIT_Get(byte* entry, unsigned h)
  * at address `rep_addr' and the handles area being `rep_size'
  * bytes long.
  */
-void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size )
+void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, size_t rep_size )
 {
   /* each bit in the bimtap represents a handle, which
    * takes 2^H_GRAIN_BITS bytes.  So a byte in the
@@ -109,10 +109,9 @@ void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size )
         */
   bmp->bmp_size = rep_size >> (H_GRAIN_BITS+3);
   bmp->bmp_size = ROUND_PAGE( bmp->bmp_size );
-  bmp->bmp = (byte*)mokMemReserve( NULL, bmp->bmp_size );
-  mokMemCommit( bmp->bmp, bmp->bmp_size, true );
+  bmp->bmp = (byte*)mokMemReserveCommitted( bmp->bmp_size );
   bmp->rep_addr = (byte*)rep_addr;
-  bmp->entry = bmp->bmp - (((unsigned)rep_addr)>>H1B_NON_BS_BITS);
+  bmp->entry = bmp->bmp - (((haddr)rep_addr)>>H1B_NON_BS_BITS);
 }
 
 
@@ -149,10 +148,10 @@ Where:
 #define H2B_BS_BITS       (32-(H_GRAIN_BITS+H2B_FS_BITS))
 #define H2B_NON_BS_BITS   (32-H2B_BS_BITS)
 
-#define H2BIT_BYTE(entry,h)   ((((uint)h)>>H2B_NON_BS_BITS) + entry)
+#define H2BIT_BYTE(entry,h)   ((((haddr)(h))>>H2B_NON_BS_BITS) + entry)
 
 
-void H2BIT_Put(byte* entry, unsigned h, unsigned val)
+void H2BIT_Put(byte* entry, haddr h, unsigned val)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -170,7 +169,7 @@ void H2BIT_Put(byte* entry, unsigned h, unsigned val)
 }
 
 
-void H2BIT_Clear(byte* entry, unsigned h)
+void H2BIT_Clear(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -186,7 +185,7 @@ void H2BIT_Clear(byte* entry, unsigned h)
 }
 
 
-void H2BIT_Stuck(byte* entry, unsigned h)
+void H2BIT_Stuck(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -201,7 +200,7 @@ void H2BIT_Stuck(byte* entry, unsigned h)
   *bbmp = v;
 }
 
-byte  H2BIT_Get(byte* entry, unsigned h)
+byte  H2BIT_Get(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -219,7 +218,7 @@ byte  H2BIT_Get(byte* entry, unsigned h)
 
 #ifdef RCDEBUG
 #pragma optimize( "", off )
-void _forceIncSanityCheck(byte *entry, unsigned h, int f)
+void _forceIncSanityCheck(byte *entry, haddr h, int f)
 {
   int nextF = (f==3) ? 3 : f+1;
 
@@ -231,7 +230,7 @@ void _forceIncSanityCheck(byte *entry, unsigned h, int f)
 #pragma optimize( "", on )
 #endif
 
-void H2BIT_Inc(byte* entry, unsigned h)
+void H2BIT_Inc(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -255,7 +254,7 @@ void H2BIT_Inc(byte* entry, unsigned h)
 }
 
 
-byte H2BIT_IncRV(byte* entry, unsigned h)
+byte H2BIT_IncRV(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -279,7 +278,7 @@ byte H2BIT_IncRV(byte* entry, unsigned h)
   return f;
 }
 
-byte H2BIT_Dec(byte* entry, unsigned h)
+byte H2BIT_Dec(byte* entry, haddr h)
 {
   /* entry address into the bitmap.*/
   byte *bbmp = H2BIT_BYTE(entry, h);
@@ -307,7 +306,7 @@ byte H2BIT_Dec(byte* entry, unsigned h)
  * at address `rep_addr' and the handles area being `rep_size'
  * bytes long.
  */
-void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size )
+void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, size_t rep_size )
 {
   /* each 2 bits in the bimtap represents a handle, which
    * takes 2^H_GRAIN_BITS bytes.  So a byte in the
@@ -316,10 +315,278 @@ void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size )
         */
   bmp->bmp_size = rep_size >> (H_GRAIN_BITS+2);
   bmp->bmp_size = ROUND_PAGE( bmp->bmp_size );
-  bmp->bmp = (byte*)mokMemReserve( NULL, bmp->bmp_size );
-  mokMemCommit( bmp->bmp, bmp->bmp_size, true );
+  bmp->bmp = (byte*)mokMemReserveCommitted( bmp->bmp_size );
   bmp->rep_addr = (byte*)rep_addr;
-  bmp->entry = bmp->bmp - (((unsigned)rep_addr)>>H2B_NON_BS_BITS);
+  bmp->entry = bmp->bmp - (((haddr)rep_addr)>>H2B_NON_BS_BITS);
+}
+
+/******************************************************************** 
+
+Atomic variants of the 1-bit and 2-bit BMP updates.
+
+The plain versions above do a byte read-modify-write, which is correct
+only while a single thread updates the bitmap.  Marks are set and
+cleared with a locked or/and on the byte.  Counters are updated by a
+CAS on the aligned word that holds them, keeping the saturating
+semantics: STUCK remains STUCK.
+
+**********************************************************************/
+
+#define BMP_WORD(bbmp)        ((uint*)(((haddr)(bbmp))&~(haddr)3))
+#define BMP_WORD_SHIFT(bbmp)  ((((uint)(haddr)(bbmp))&3)<<3)
+
+#define _atomicOrByte(p,v)   _InterlockedOr8( (char*)(p), (char)(v) )
+#define _atomicAndByte(p,v)  _InterlockedAnd8( (char*)(p), (char)(v) )
+
+void H1BIT_AtomicSet(byte* entry, haddr h)
+{
+  byte *bbmp = H1BIT_BYTE(entry, h);
+  uint field_selector = GET_BIT_FIELD( h, H_GRAIN_BITS, H1B_FS_BITS );
+  _atomicOrByte( bbmp, (byte)(1 << field_selector) );
+}
+
+void H1BIT_AtomicClear(byte* entry, haddr h)
+{
+  byte *bbmp = H1BIT_BYTE(entry, h);
+  uint field_selector = GET_BIT_FIELD( h, H_GRAIN_BITS, H1B_FS_BITS );
+  _atomicAndByte( bbmp, (byte)~(1 << field_selector) );
+}
+
+void H2BIT_AtomicStuck(byte* entry, haddr h)
+{
+  byte *bbmp = H2BIT_BYTE(entry, h);
+  uint field_selector = GET_BIT_FIELD( h, H_GRAIN_BITS-1, H2B_FS_BITS+1 );
+  _atomicOrByte( bbmp, (byte)(3 << field_selector) );
+}
+
+byte H2BIT_AtomicIncRV(byte* entry, haddr h)
+{
+  byte *bbmp = H2BIT_BYTE(entry, h);
+  uint *pw = BMP_WORD(bbmp);
+  uint shift = 
+    BMP_WORD_SHIFT(bbmp) + GET_BIT_FIELD( h, H_GRAIN_BITS-1, H2B_FS_BITS+1 );
+  uint f;
+
+  for (;;) {
+    uint oldv = *(volatile uint*)pw;
+    f = (oldv >> shift) & 3;
+    if (f==3) /* STUCK remains STUCK */
+      break;
+    if (gcCompareAndSwap( pw, oldv, oldv + (1<<shift) ))
+      break;
+  }
+#ifdef RCDEBUG
+  if (f==2)
+    InterlockedIncrement( (long*)&gcvar.dbg.nStuckCountersInCycle );
+#endif
+  return f;
+}
+
+void H2BIT_AtomicInc(byte* entry, haddr h)
+{
+  H2BIT_AtomicIncRV( entry, h );
+}
+
+byte H2BIT_AtomicDec(byte* entry, haddr h)
+{
+  byte *bbmp = H2BIT_BYTE(entry, h);
+  uint *pw = BMP_WORD(bbmp);
+  uint shift = 
+    BMP_WORD_SHIFT(bbmp) + GET_BIT_FIELD( h, H_GRAIN_BITS-1, H2B_FS_BITS+1 );
+  uint f;
+
+  for (;;) {
+    uint oldv = *(volatile uint*)pw;
+    f = (oldv >> shift) & 3;
+    mokAssert( f>= 1 ); /* we should never go below zero */
+    if (f==3) /* STUCK remains STUCK */
+      break;
+    if (gcCompareAndSwap( pw, oldv, oldv - (1<<shift) ))
+      break;
+  }
+  return f;
+}
+
+/******************************************************************** 
+
+Implementation of a combined metadata BMP, a nibble per handle.
+
+Layout of a handle:
+
+| 31 --------- 4 | 3  | 2 - 0 |
+|      BS        | FS |  Z    |
+
+Where:
+
+-- Z: these bits are always zero (because handles are 8-byte aligned).
+-- FS: Field Select.  Selects the low or high nibble of the byte.
+-- BS: Byte selector, relatively to the beginning of the heap.
+
+Layout of a nibble:
+
+| 3     | 2   | 1 - 0 |
+| LOCAL | ZCT |  RC   |
+
+The RC field is a saturating 2-bit count, as in the 2-bit BMP.  Keeping
+the three together means the collector touches one cache line per
+object where it used to touch up to three.
+
+**********************************************************************/
+
+#define HM_FS_BITS        1
+#define HM_NON_BS_BITS    (H_GRAIN_BITS+HM_FS_BITS)
+
+#define HMETA_BYTE(entry,h)   ((((haddr)(h))>>HM_NON_BS_BITS) + (byte*)entry)
+/* 0 or 4 */
+#define HMETA_SHIFT(h)        ((((uint)(haddr)(h))>>(H_GRAIN_BITS-2)) & 4)
+/* position of the nibble in the aligned word holding it */
+#define HMETA_WORD_SHIFT(bbmp,h)  (((((uint)(haddr)(bbmp))&3)<<3) + HMETA_SHIFT(h))
+#define HMETA_WORD(bbmp)      ((uint*)(((haddr)(bbmp))&~(haddr)3))
+
+byte HMETA_GetRC(byte* entry, haddr h)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  return (*bbmp >> HMETA_SHIFT(h)) & HMETA_RC;
+}
+
+void HMETA_Inc(byte* entry, haddr h)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint shift = HMETA_SHIFT(h);
+  uint f = (*bbmp >> shift) & HMETA_RC;
+
+  if (f<3) /* STUCK remains STUCK */
+    *bbmp += 1 << shift;
+#ifdef RCDEBUG
+  if (f==2) 
+    gcvar.dbg.nStuckCountersInCycle++;
+#endif
+}
+
+byte HMETA_IncRV(byte* entry, haddr h)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint shift = HMETA_SHIFT(h);
+  uint f = (*bbmp >> shift) & HMETA_RC;
+
+  if (f<3) /* STUCK remains STUCK */
+    *bbmp += 1 << shift;
+#ifdef RCDEBUG
+  if (f==2) 
+    gcvar.dbg.nStuckCountersInCycle++;
+#endif
+  return f;
+}
+
+byte HMETA_Dec(byte* entry, haddr h)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint shift = HMETA_SHIFT(h);
+  uint f = (*bbmp >> shift) & HMETA_RC;
+
+  mokAssert( f>= 1 ); /* we should never go below zero */
+  if (f<3) /* STUCK remains STUCK */
+    *bbmp -= 1 << shift;
+  return f;
+}
+
+byte HMETA_Get(byte* entry, haddr h, unsigned flag)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  return ((*bbmp >> HMETA_SHIFT(h)) & flag) != 0;
+}
+
+void HMETA_Set(byte* entry, haddr h, unsigned flag)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  *bbmp |= flag << HMETA_SHIFT(h);
+}
+
+void HMETA_Clear(byte* entry, haddr h, unsigned flag)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  *bbmp &= ~(flag << HMETA_SHIFT(h));
+}
+
+/*
+ * Atomic variants, for when more than one thread updates the
+ * bitmap.  Each is a CAS loop on the aligned word holding the
+ * nibble.
+ */
+byte HMETA_AtomicIncRV(byte* entry, haddr h)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint *pw = HMETA_WORD(bbmp);
+  uint shift = HMETA_WORD_SHIFT(bbmp, h);
+
+  for (;;) {
+    uint oldv = *(volatile uint*)pw;
+    uint f = (oldv >> shift) & HMETA_RC;
+    if (f==3) /* STUCK remains STUCK */
+      return f;
+    if (gcCompareAndSwap( pw, oldv, oldv + (1<<shift) ))
+      return f;
+  }
+}
+
+byte HMETA_AtomicDec(byte* entry, haddr h)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint *pw = HMETA_WORD(bbmp);
+  uint shift = HMETA_WORD_SHIFT(bbmp, h);
+
+  for (;;) {
+    uint oldv = *(volatile uint*)pw;
+    uint f = (oldv >> shift) & HMETA_RC;
+    mokAssert( f>= 1 ); /* we should never go below zero */
+    if (f==3) /* STUCK remains STUCK */
+      return f;
+    if (gcCompareAndSwap( pw, oldv, oldv - (1<<shift) ))
+      return f;
+  }
+}
+
+void HMETA_AtomicSet(byte* entry, haddr h, unsigned flag)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint *pw = HMETA_WORD(bbmp);
+  uint bits = flag << HMETA_WORD_SHIFT(bbmp, h);
+
+  for (;;) {
+    uint oldv = *(volatile uint*)pw;
+    if (gcCompareAndSwap( pw, oldv, oldv | bits ))
+      return;
+  }
+}
+
+void HMETA_AtomicClear(byte* entry, haddr h, unsigned flag)
+{
+  byte *bbmp = HMETA_BYTE(entry, h);
+  uint *pw = HMETA_WORD(bbmp);
+  uint bits = flag << HMETA_WORD_SHIFT(bbmp, h);
+
+  for (;;) {
+    uint oldv = *(volatile uint*)pw;
+    if (gcCompareAndSwap( pw, oldv, oldv & ~bits ))
+      return;
+  }
+}
+
+/*
+ * Create a new nibble per handle BMP with the handles starting
+ * at address `rep_addr' and the handles area being `rep_size'
+ * bytes long.
+ */
+void HMETA_Init(HMETA_BMP* bmp, unsigned* rep_addr, size_t rep_size )
+{
+  /* a byte in the bitmap represents 2 handles, which
+   * take 2^(H_GRAIN_BITS+1) bytes of the handle space.
+   */
+  bmp->bmp_size = rep_size >> (H_GRAIN_BITS+1);
+  bmp->bmp_size = ROUND_PAGE( bmp->bmp_size );
+  bmp->bmp = (byte*)mokMemReserveCommitted( bmp->bmp_size );
+  bmp->rep_addr = (byte*)rep_addr;
+  bmp->entry = bmp->bmp - (((haddr)rep_addr)>>HM_NON_BS_BITS);
 }
 
 char * write_bits(unsigned x)
@@ -350,7 +617,8 @@ void testBitFields(void)
 }
 
 
-typedef struct HandleTAG { unsigned h1, h2; } Handle;
+#ifdef RCBMPTEST
+typedef struct HandleTAG { byte grain[ OBJGRAIN ]; } Handle;
 
 H2BIT_BMP Bmp;
 
@@ -358,32 +626,129 @@ H2BIT_BMP Bmp;
 
 void test2BitBmp(void)
 {
-  int i,j;
+  int i,j, nBad = 0;
   Handle* handleSpace = (Handle*)mokMalloc( N_HANDLES*sizeof(Handle), false );
   H2BIT_BMP *bmp = &Bmp;
         
   H2BIT_Init( bmp, (unsigned*)handleSpace, N_HANDLES*sizeof(Handle) );
   for (i=0; i<2 ;i++) {
     for (j=0; j<N_HANDLES; j++) {
-      uint v = H2BIT_Get( bmp->entry, (unsigned)&handleSpace[j] );
-      if (v != (uint)i) 
+      uint v = H2BIT_Get( bmp->entry, (haddr)&handleSpace[j] );
+      if (v != (uint)i) {
         jio_printf("Bad RC for j=%d, val=%x\n", j, v );
-      else
-        jio_printf("Good RC for j=%d, val=%x\n", j, v );
-      H2BIT_Inc(  bmp->entry, (unsigned)&handleSpace[j] );
+        nBad++;
+      }
+      H2BIT_Inc(  bmp->entry, (haddr)&handleSpace[j] );
     }
   }
   for (i=2; i>=0 ;i--) {
     for (j=0; j<N_HANDLES; j++) {
-      uint v = H2BIT_Get( bmp->entry, (unsigned)&handleSpace[j] );
-      if (v != (uint)i ) 
-        jio_printf("Bad RC for j=%d, val=%x exoect=%i\n", j, v, i );
-      else
-        jio_printf("Good RC for j=%d, val=%x\n", j, v );
-      H2BIT_Dec(  bmp->entry, (unsigned)&handleSpace[j] );
+      uint v = H2BIT_Get( bmp->entry, (haddr)&handleSpace[j] );
+      if (v != (uint)i ) {
+        jio_printf("Bad RC for j=%d, val=%x expect=%i\n", j, v, i );
+        nBad++;
+      }
+      H2BIT_Dec(  bmp->entry, (haddr)&handleSpace[j] );
     }
   }
+  jio_printf("test2BitBmp: %d bad\n", nBad );
+  mokMemUnreserve( bmp->bmp, bmp->bmp_size );
+  mokFree( handleSpace );
+  sysAssert( nBad == 0 );
+}
+
+
+/*
+ * Hammer the atomic variants from several threads.  Each thread owns
+ * every N_ATOMIC_THREADS'th handle, so a thread's handles share bitmap
+ * bytes and words with the other threads' handles; a lost update shows
+ * up as a bad value of a neighbour.  All threads also bang on one
+ * shared handle, whose counter must get stuck exactly once.
+ */
+#define N_ATOMIC_THREADS  8
+#define N_ATOMIC_ROUNDS   1000
+
+static Handle     *atomicHandles;
+static Handle     *atomicShared;
+static H1BIT_BMP  atomicBmp1;
+static H2BIT_BMP  atomicBmp2;
+static HMETA_BMP  atomicBmpM;
+static long       nAtomicStuck;
+
+static DWORD WINAPI _testAtomicBmpThread(void *param)
+{
+  int t = (int)(INT_PTR)param;
+  int i, j, k;
+
+  for (i=0; i<N_ATOMIC_ROUNDS; i++) {
+    for (j=t; j<N_HANDLES; j+=N_ATOMIC_THREADS) {
+      haddr h = (haddr)&atomicHandles[j];
+      for (k=0; k<j%3; k++) {
+        H2BIT_AtomicInc( atomicBmp2.entry, h );
+        HMETA_AtomicIncRV( atomicBmpM.entry, h );
+      }
+      H1BIT_AtomicSet( atomicBmp1.entry, h );
+      HMETA_AtomicSet( atomicBmpM.entry, h, HMETA_ZCT );
+      if (i==N_ATOMIC_ROUNDS-1)
+        continue; /* leave the last round's marks for checking */
+      for (k=0; k<j%3; k++) {
+        H2BIT_AtomicDec( atomicBmp2.entry, h );
+        HMETA_AtomicDec( atomicBmpM.entry, h );
+      }
+      H1BIT_AtomicClear( atomicBmp1.entry, h );
+      HMETA_AtomicClear( atomicBmpM.entry, h, HMETA_ZCT );
+    }
+    if (H2BIT_AtomicIncRV( atomicBmp2.entry, (haddr)atomicShared ) == 2)
+      InterlockedIncrement( &nAtomicStuck );
+  }
+  return 0;
+}
+
+void testAtomicBmp(void)
+{
+  HANDLE threads[ N_ATOMIC_THREADS ];
+  int j, nBad = 0;
+  unsigned sz = (N_HANDLES+1)*sizeof(Handle);
+  Handle* handleSpace = (Handle*)mokMalloc( sz, false );
+
+  atomicShared = handleSpace;
+  atomicHandles = handleSpace + 1;
+  nAtomicStuck = 0;
+  H1BIT_Init( &atomicBmp1, (unsigned*)handleSpace, sz );
+  H2BIT_Init( &atomicBmp2, (unsigned*)handleSpace, sz );
+  HMETA_Init( &atomicBmpM, (unsigned*)handleSpace, sz );
+
+  for (j=0; j<N_ATOMIC_THREADS; j++)
+    threads[j] = mokThreadCreate( _testAtomicBmpThread, (void*)(INT_PTR)j );
+  WaitForMultipleObjects( N_ATOMIC_THREADS, threads, TRUE, INFINITE );
+  for (j=0; j<N_ATOMIC_THREADS; j++)
+    CloseHandle( threads[j] );
+
+  for (j=0; j<N_HANDLES; j++) {
+    haddr h = (haddr)&atomicHandles[j];
+    uint v2 = H2BIT_Get( atomicBmp2.entry, h );
+    uint vm = HMETA_GetRC( atomicBmpM.entry, h );
+    uint v1 = H1BIT_Get( atomicBmp1.entry, h );
+    uint vz = HMETA_Get( atomicBmpM.entry, h, HMETA_ZCT );
+    if (v2 != (uint)j%3 || vm != (uint)j%3 || v1 != 1 || vz != 1) {
+      jio_printf("Bad atomic BMP for j=%d, rc=%x meta rc=%x bit=%x zct=%x\n",
+                 j, v2, vm, v1, vz );
+      nBad++;
+    }
+  }
+  if (H2BIT_Get( atomicBmp2.entry, (haddr)atomicShared ) != 3 || nAtomicStuck != 1) {
+    jio_printf("Bad shared counter, val=%x stuck=%d\n", 
+               H2BIT_Get( atomicBmp2.entry, (haddr)atomicShared ), nAtomicStuck );
+    nBad++;
+  }
+  jio_printf("testAtomicBmp: %d bad\n", nBad );
+  mokMemUnreserve( atomicBmp1.bmp, atomicBmp1.bmp_size );
+  mokMemUnreserve( atomicBmp2.bmp, atomicBmp2.bmp_size );
+  mokMemUnreserve( atomicBmpM.bmp, atomicBmpM.bmp_size );
+  mokFree( handleSpace );
+  sysAssert( nBad == 0 );
 }
+#endif /* RCBMPTEST */
 
 
 #endif /* RCNOINLINE */
@@ -20,7 +20,7 @@
 /*
  * Specify (log) allignment of handles.
  */
-#define H_GRAIN_BITS      3
+#define H_GRAIN_BITS      OBJBITS
 /*
  * Field selector bits.  The next 3 bits select
  * the bit inside the bmp word.  there
@@ -35,7 +35,7 @@
 #define H1B_NON_BS_BITS   (H_GRAIN_BITS+H1B_FS_BITS)
 
 
-#define H1BIT_BYTE(entry,h)   (byte*)(((uint)(h)>>H1B_NON_BS_BITS) + (byte*)entry)
+#define H1BIT_BYTE(entry,h)   (byte*)(((haddr)(h)>>H1B_NON_BS_BITS) + (byte*)entry)
 
 #define H1BIT_Set(entry,h)\
 do {\
@@ -93,10 +93,9 @@ do {\
 do {\
 	(__bmp)->bmp_size = (__rep_size) >> (H_GRAIN_BITS+3);\
 	(__bmp)->bmp_size = ROUND_PAGE( (__bmp)->bmp_size );\
-	(__bmp)->bmp = (byte*)mokMemReserve( NULL, (__bmp)->bmp_size );\
-	mokMemCommit( (__bmp)->bmp, (__bmp)->bmp_size, true );\
+	(__bmp)->bmp = (byte*)mokMemReserveCommitted( (__bmp)->bmp_size );\
 	(__bmp)->rep_addr = (byte*)(__rep_addr);\
-	(__bmp)->entry = (__bmp)->bmp - (((unsigned)(__rep_addr))>>H1B_NON_BS_BITS);\
+	(__bmp)->entry = (__bmp)->bmp - (((haddr)(__rep_addr))>>H1B_NON_BS_BITS);\
 } while (0) 
 
 
@@ -133,7 +132,7 @@ Where:
 #define H2B_BS_BITS       (32-(H_GRAIN_BITS+H2B_FS_BITS))
 #define H2B_NON_BS_BITS   (32-H2B_BS_BITS)
 
-#define H2BIT_BYTE(entry,h)   ((((uint)h)>>H2B_NON_BS_BITS) + entry)
+#define H2BIT_BYTE(entry,h)   ((((haddr)(h))>>H2B_NON_BS_BITS) + entry)
 
 
 #define H2BIT_Put(entry,h,val)\
@@ -277,9 +276,214 @@ do {\
 	*/\
 	(__bmp)->bmp_size = (__rep_size) >> (H_GRAIN_BITS+2);\
 	(__bmp)->bmp_size = ROUND_PAGE( (__bmp)->bmp_size );\
-	(__bmp)->bmp = (byte*)mokMemReserve( NULL, (__bmp)->bmp_size );\
-	mokMemCommit( (__bmp)->bmp, (__bmp)->bmp_size, true );\
+	(__bmp)->bmp = (byte*)mokMemReserveCommitted( (__bmp)->bmp_size );\
 	(__bmp)->rep_addr = (byte*)(__rep_addr);\
-	(__bmp)->entry = (__bmp)->bmp - (((unsigned)(__rep_addr))>>H2B_NON_BS_BITS);\
+	(__bmp)->entry = (__bmp)->bmp - (((haddr)(__rep_addr))>>H2B_NON_BS_BITS);\
 } while(0);
 
+
+/*
+ * Atomic variants of the 1-bit and 2-bit BMP updates, see rcbmp.c.
+ * Here all of them are a CAS on the aligned word holding the field.
+ */
+#define BMP_WORD(bbmp)        ((uint*)(((haddr)(bbmp))&~(haddr)3))
+#define BMP_WORD_SHIFT(bbmp)  ((((uint)(haddr)(bbmp))&3)<<3)
+
+#define H1BIT_AtomicSet(entry,h)\
+do {\
+	byte *bbmp = H1BIT_BYTE((entry), (h));\
+	uint *pw = BMP_WORD(bbmp);\
+	uint bits = 1 << (BMP_WORD_SHIFT(bbmp) + GET_BIT_FIELD( (h), H_GRAIN_BITS, H1B_FS_BITS ));\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		if (gcCompareAndSwap( pw, oldv, oldv | bits )) break;\
+	}\
+} while(0)
+
+#define H1BIT_AtomicClear(entry,h)\
+do {\
+	byte *bbmp = H1BIT_BYTE((entry), (h));\
+	uint *pw = BMP_WORD(bbmp);\
+	uint bits = 1 << (BMP_WORD_SHIFT(bbmp) + GET_BIT_FIELD( (h), H_GRAIN_BITS, H1B_FS_BITS ));\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		if (gcCompareAndSwap( pw, oldv, oldv & ~bits )) break;\
+	}\
+} while(0)
+
+#define H2BIT_AtomicIncRVInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = H2BIT_BYTE(entry, h);\
+	uint *pw = BMP_WORD(bbmp);\
+	uint shift = BMP_WORD_SHIFT(bbmp) + GET_BIT_FIELD( h, H_GRAIN_BITS-1, H2B_FS_BITS+1 );\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		uint f = (oldv >> shift) & 3;\
+		__res_var__ = f;\
+		if (f==3) break; /* STUCK remains STUCK */\
+		if (gcCompareAndSwap( pw, oldv, oldv + (1<<shift) )) break;\
+	}\
+} while(0)
+
+#define H2BIT_AtomicInc(entry, h)\
+do {\
+	uint __prev;\
+	H2BIT_AtomicIncRVInlined( entry, h, __prev );\
+} while(0)
+
+#define H2BIT_AtomicDecInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = H2BIT_BYTE(entry, h);\
+	uint *pw = BMP_WORD(bbmp);\
+	uint shift = BMP_WORD_SHIFT(bbmp) + GET_BIT_FIELD( h, H_GRAIN_BITS-1, H2B_FS_BITS+1 );\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		uint f = (oldv >> shift) & 3;\
+		mokAssert( f>= 1 ); /* we should never go below zero */\
+		__res_var__ = f;\
+		if (f==3) break; /* STUCK remains STUCK */\
+		if (gcCompareAndSwap( pw, oldv, oldv - (1<<shift) )) break;\
+	}\
+} while(0)
+
+/******************************************************************** 
+
+Implementation of a combined metadata BMP, a nibble per handle.
+
+Layout of a handle:
+
+| 31 --------- 4 | 3  | 2 - 0 |
+|      BS        | FS |  Z    |
+
+Layout of a nibble:
+
+| 3     | 2   | 1 - 0 |
+| LOCAL | ZCT |  RC   |
+
+See rcbmp.c.
+
+**********************************************************************/
+
+#define HM_FS_BITS        1
+#define HM_NON_BS_BITS    (H_GRAIN_BITS+HM_FS_BITS)
+
+#define HMETA_BYTE(entry,h)   ((((haddr)(h))>>HM_NON_BS_BITS) + (byte*)(entry))
+#define HMETA_SHIFT(h)        ((((uint)(haddr)(h))>>(H_GRAIN_BITS-2)) & 4)
+#define HMETA_WORD_SHIFT(bbmp,h)  (((((uint)(haddr)(bbmp))&3)<<3) + HMETA_SHIFT(h))
+#define HMETA_WORD(bbmp)      ((uint*)(((haddr)(bbmp))&~(haddr)3))
+
+#define HMETA_GetRCInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	__res_var__ = (*bbmp >> HMETA_SHIFT(h)) & HMETA_RC;\
+} while(0)
+
+#define HMETA_Inc(entry, h)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint shift = HMETA_SHIFT(h);\
+	if (((*bbmp >> shift) & HMETA_RC) < 3) /* STUCK remains STUCK */\
+		*bbmp += 1 << shift;\
+} while(0)
+
+#define HMETA_IncRVInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint shift = HMETA_SHIFT(h);\
+	uint f = (*bbmp >> shift) & HMETA_RC;\
+	if (f<3) /* STUCK remains STUCK */\
+		*bbmp += 1 << shift;\
+	__res_var__ = f;\
+} while(0)
+
+#define HMETA_DecInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint shift = HMETA_SHIFT(h);\
+	uint f = (*bbmp >> shift) & HMETA_RC;\
+	mokAssert( f>= 1 ); /* we should never go below zero */\
+	if (f<3) /* STUCK remains STUCK */\
+		*bbmp -= 1 << shift;\
+	__res_var__ = f;\
+} while(0)
+
+#define HMETA_GetInlined( entry, h, flag, __res_var__)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	__res_var__ = ((*bbmp >> HMETA_SHIFT(h)) & (flag)) != 0;\
+} while(0)
+
+#define HMETA_Set(entry, h, flag)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	*bbmp |= (flag) << HMETA_SHIFT(h);\
+} while(0)
+
+#define HMETA_Clear(entry, h, flag)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	*bbmp &= ~((flag) << HMETA_SHIFT(h));\
+} while(0)
+
+/*
+ * Atomic variants: CAS on the aligned word holding the nibble.
+ */
+#define HMETA_AtomicIncRVInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint *pw = HMETA_WORD(bbmp);\
+	uint shift = HMETA_WORD_SHIFT(bbmp, h);\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		uint f = (oldv >> shift) & HMETA_RC;\
+		__res_var__ = f;\
+		if (f==3) break; /* STUCK remains STUCK */\
+		if (gcCompareAndSwap( pw, oldv, oldv + (1<<shift) )) break;\
+	}\
+} while(0)
+
+#define HMETA_AtomicDecInlined( entry, h, __res_var__)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint *pw = HMETA_WORD(bbmp);\
+	uint shift = HMETA_WORD_SHIFT(bbmp, h);\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		uint f = (oldv >> shift) & HMETA_RC;\
+		mokAssert( f>= 1 ); /* we should never go below zero */\
+		__res_var__ = f;\
+		if (f==3) break; /* STUCK remains STUCK */\
+		if (gcCompareAndSwap( pw, oldv, oldv - (1<<shift) )) break;\
+	}\
+} while(0)
+
+#define HMETA_AtomicSet(entry, h, flag)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint *pw = HMETA_WORD(bbmp);\
+	uint bits = (flag) << HMETA_WORD_SHIFT(bbmp, h);\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		if (gcCompareAndSwap( pw, oldv, oldv | bits )) break;\
+	}\
+} while(0)
+
+#define HMETA_AtomicClear(entry, h, flag)\
+do {\
+	byte *bbmp = HMETA_BYTE(entry, h);\
+	uint *pw = HMETA_WORD(bbmp);\
+	uint bits = (flag) << HMETA_WORD_SHIFT(bbmp, h);\
+	for (;;) {\
+		uint oldv = *(volatile uint*)pw;\
+		if (gcCompareAndSwap( pw, oldv, oldv & ~bits )) break;\
+	}\
+} while(0)
+
+#define HMETA_Init( __bmp, __rep_addr, __rep_size )\
+do {\
+	(__bmp)->bmp_size = (__rep_size) >> (H_GRAIN_BITS+1);\
+	(__bmp)->bmp_size = ROUND_PAGE( (__bmp)->bmp_size );\
+	(__bmp)->bmp = (byte*)mokMemReserveCommitted( (__bmp)->bmp_size );\
+	(__bmp)->rep_addr = (byte*)(__rep_addr);\
+	(__bmp)->entry = (__bmp)->bmp - (((haddr)(__rep_addr))>>HM_NON_BS_BITS);\
+} while (0)
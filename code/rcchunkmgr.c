@@ -4,60 +4,173 @@
  * Author:  Mr. Yossi Levanoni
  * Purpose: implementation of the chunk manager
  */
+/*
+ * Number of bits set in a word.
+ */
+static int _popCount( uint m )
+{
+  m = m - ((m >> 1) & 0x55555555);
+  m = (m & 0x33333333) + ((m >> 2) & 0x33333333);
+  m = (m + (m >> 4)) & 0x0f0f0f0f;
+  return (m * 0x01010101) >> 24;
+}
+
+#ifdef RCFREEBMP
+#define _blockFreeCount(ph)  bhFreeCount(ph)
+#else
+#define _blockFreeCount(ph)  ((ph)->freeList ? (int)(ph)->freeList->count : 0)
+#endif /* RCFREEBMP */
+
 /************************************************
 *
-* Lock a partial list.  Implemented by a spin
-* lock which is imbedded in the list header.
+* Partial lists are lock-free stacks.  The "top"
+* of a list is 64 bits wide.  Its low half holds
+* the index of the first block, plus one so that
+* zero is the empty list, and its high half a tag
+* which is bumped on every change.  A block which
+* is popped and pushed back while a CAS is in
+* flight thus doesn't fool the CAS, unless 2^32
+* changes went by in between.
+*
+* In the 32-bit build the top may be read torn.
+* The CAS compares all 64 bits, so such a value
+* merely makes it fail.
 */
-#define _lockPartialList(pList, ee)\
-do {\
-        mokAssert( ee );\
-        gcSpinLockEnter( &pList->lock, (unsigned)ee );\
-} while(0)
+#define PL_TAG_ONE         ((ULONGLONG)1<<32)
+
+#define _plIndex(top)      ((uint)(top))
+
+#define _plBlock(top) \
+  (_plIndex(top) ? \
+   blkvar.allocatedBlockHeaders + _plIndex(top) - 1 : NULL)
+
+#define _plTop(oldTop, ph) \
+  ((LONGLONG)((((ULONGLONG)(oldTop) & ~(ULONGLONG)0xffffffff) + PL_TAG_ONE) | \
+              (uint)((ph) ? ((ph) - blkvar.allocatedBlockHeaders) + 1 : 0)))
+
+#define _plCas(pList, oldTop, newTop) \
+  (InterlockedCompareExchange64( &(pList)->top, (newTop), (oldTop) ) == (oldTop))
+
+/************************************************
+*
+* The partial list a block belongs to: that of
+* its bin on the node owning its memory.
+*/
+#define _blockPartialList(ph) \
+  (&chunkvar.partialLists[ BLKNODE(ph) ][ bhGet_bin_idx(ph) ])
+
+/************************************************
+*
+* Push the chain of blocks first...last, linked
+* by nextPartial, onto a partial list.
+*/
+static void _pushPartialChain( PARTIALLIST *pList, 
+                               BlkAllocHdr *first, 
+                               BlkAllocHdr *last )
+{
+  for (;;) {
+    LONGLONG oldTop = pList->top;
+    last->nextPartial = _plBlock( oldTop );
+    if (_plCas( pList, oldTop, _plTop(oldTop, first) ))
+      return;
+  }
+}
+
+/************************************************
+*
+* Pop the first block of a partial list, NULL if
+* it is empty.
+*
+* The next pointer may be read off a block which
+* another thread has just popped and reused; the
+* tag makes the CAS fail in that case.
+*/
+static BlkAllocHdr *_popPartialBlock( PARTIALLIST *pList )
+{
+  for (;;) {
+    LONGLONG oldTop = pList->top;
+    BlkAllocHdr *ph = _plBlock( oldTop );
+    if (!ph)
+      return NULL;
+    if (_plCas( pList, oldTop, _plTop(oldTop, ph->nextPartial) ))
+      return ph;
+  }
+}
+
+/************************************************
+*
+* Take all the blocks of a partial list at once.
+* Returns the chain, linked by nextPartial.
+*/
+static BlkAllocHdr *_drainPartialList( PARTIALLIST *pList )
+{
+  for (;;) {
+    LONGLONG oldTop = pList->top;
+    BlkAllocHdr *ph = _plBlock( oldTop );
+    if (!ph)
+      return NULL;
+    if (_plCas( pList, oldTop, _plTop(oldTop, NULL) ))
+      return ph;
+  }
+}
 
 /************************************************
 *
-* Unlock a partial list
+* Lock and unlock the sweep list which sits next
+* to a partial list.
 */
-#define _unlockPartialList(pList, ee)\
+#define _lockSweepList(pList, ee)\
+do {\
+        mokAssert( ee );\
+        gcSpinLockEnter( &pList->sweepLock, (unsigned)ee );\
+} while(0)
+
+#define _unlockSweepList(pList, ee)\
 do {\
         mokAssert( ee );\
-        gcSpinLockExit( &pList->lock, (unsigned)(ee) );\
+        gcSpinLockExit( &pList->sweepLock, (unsigned)(ee) );\
 } while(0)
 
 
+/************************************************
+*
+* The number of blocks in the partial lists of a
+* bin comes from its counter.  The free chunks
+* are summed up by walking the lists in place,
+* which leaves them to the mutators meanwhile.
+* Headers are never unmapped, so a walk which
+* races with a pop merely reads stale links.  It
+* is cut short after as many blocks as counted,
+* and it skips blocks which have left the list,
+* so the byte count is an estimate.  The block
+* manager lock keeps the trimmer from
+* decommitting a free list being read.
+*/
 static void  _getPartialListStats( int iList, 
                                    int *pFreeBlocks, 
                                    int *pFreeBytes )
 {
-  ExecEnv *ee = EE();
-  PARTIALLIST *pList = &chunkvar.partialLists[ iList ];
   int objSz  = chkconv.binSize[ iList ];
   int maxObj = chkconv.binToObjectsPerBlock[ iList ];
-  int status, count;
-  BlkAllocHdr *ph, *nextPh;
-  BLKOBJ *freeList;
+  int nLeft, count, node;
+  BlkAllocHdr *ph;
   
-  *pFreeBlocks = 0;
+  *pFreeBlocks = chunkvar.nBlocksInPartialList[ iList ];
   *pFreeBytes = 0;
+  nLeft = *pFreeBlocks;
   
-  _lockPartialList( pList, ee);
-  
-  ph = pList->firstBlock;
-  while (ph) {
-    (*pFreeBlocks)++;
-    status = bhGet_status( ph );
-    mokAssert( status == PARTIAL );
-    freeList = (BLKOBJ*)ph->freeList;
-    if (freeList) {
-      mokAssert( OBJBLOCKHDR(freeList) == ph );
-      count = (int)freeList->count;
-      mokAssert( count<=maxObj && count>0 );
-      *pFreeBytes += count;
+  _LockBlkMgr( sysThreadSelf() );
+  for (node=0; node<blkvar.nNodes; node++) {
+    ph = _plBlock( chunkvar.partialLists[ node ][ iList ].top );
+    for (; ph && nLeft>0; ph = ph->nextPartial, nLeft--) {
+      if (bhGet_status( ph ) != PARTIAL)
+        continue;
+      count = _blockFreeCount( ph );
+      if (count>0 && count<=maxObj)
+        *pFreeBytes += count;
     }
-    ph = ph->nextPartial;
   }
-  _unlockPartialList( pList, ee );
+  _UnlockBlkMgr( sysThreadSelf() );
   *pFreeBytes *= objSz;
 }
 
@@ -81,50 +194,161 @@ GCEXPORT int chkCountPartialBlocks(void)
 ************** Mutual Services **********************************
 ****************************************************************/
 
+/********************************************
+*
+* The built-in bin sizes.
+*/
+static int _defaultBinSizes[] = {
+#ifdef RCLP64
+  32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+#else
+  8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+#endif
+  320, 384, 448, 512, 640, 768, 1024, 1280, 2048, 4096, 8192
+};
+
+#define N_DEFAULT_BINS  (sizeof(_defaultBinSizes)/sizeof(int))
+
+/********************************************
+*
+* Read an allocation size histogram, lines of
+* "size count" with sizes in bytes including
+* the GCHandle.  Counts are added into "hist",
+* which is indexed by size in OBJGRAIN units.
+* Says why and returns false if the file can't
+* be opened or has a malformed line.
+*/
+static bool _readSizeHistogram( uint *hist )
+{
+  FILE *f = fopen( BIN_HIST_FILE, "r" );
+  char buff[200];
+  int  size, line = 0;
+  uint count;
+
+  if (!f) {
+    jio_printf("%s could not be opened\n", BIN_HIST_FILE );
+    return false;
+  }
+  while (fgets( buff, sizeof(buff), f )) {
+    line++;
+    if (buff[0]=='#') continue; /* remark line */
+    if (2 != sscanf( buff, "%d %u", &size, &count ) || 
+        size <= 0 || size > MAX_CHUNK_ALLOC) {
+      jio_printf("Error reading %s, line %d\n", BIN_HIST_FILE, line );
+      fclose( f );
+      return false;
+    }
+    hist[ (size + OBJGRAIN-1) >> OBJBITS ] += count;
+  }
+  fclose( f );
+  return true;
+}
+
+/********************************************
+*
+* Fit nBins bin sizes to a size histogram so
+* as to minimize the total internal waste of
+* the allocations it counts.  The last bin is
+* always MAX_CHUNK_ALLOC.
+*
+* Sizes are in OBJGRAIN units.  best[k][j] is
+* the least waste with k+1 bins covering sizes
+* up to j, the last of them being of size j;
+* it is the least over i<j of best[k-1][i] plus
+* the waste of the sizes in (i,j] in a bin of
+* size j.  from[k][j] is that i.
+*/
+static void _fitBinSizes( uint *hist, int nBins, int *sizes )
+{
+  int    nSizes = MAX_CHUNK_ALLOC >> OBJBITS;
+  int    stride = nSizes + 1;
+  double *cnt  = (double*)mokMalloc( sizeof(double)*stride, true );
+  double *sum  = (double*)mokMalloc( sizeof(double)*stride, true );
+  double *best = (double*)mokMalloc( sizeof(double)*stride*nBins, false );
+  short  *from = (short*)mokMalloc( sizeof(short)*stride*nBins, false );
+  int    i, j, k;
+
+#define _waste(i,j) ((j)*(cnt[j]-cnt[i]) - (sum[j]-sum[i]))
+
+  for (j=1; j<=nSizes; j++) {
+    cnt[j] = cnt[j-1] + hist[j];
+    sum[j] = sum[j-1] + (double)hist[j]*j;
+  }
+
+  for (j=1; j<=nSizes; j++) {
+    best[j] = _waste(0,j);
+    from[j] = 0;
+  }
+  for (k=1; k<nBins; k++) {
+    double *prev = best + (k-1)*stride;
+    double *curr = best + k*stride;
+    for (j=k+1; j<=nSizes; j++) {
+      curr[j] = -1;
+      for (i=k; i<j; i++) {
+        double w = prev[i] + _waste(i,j);
+        if (curr[j] < 0 || w < curr[j]) {
+          curr[j] = w;
+          from[ k*stride + j ] = i;
+        }
+      }
+    }
+  }
+#undef _waste
+
+  for (j=nSizes, k=nBins-1; k>=0; k--) {
+    sizes[k] = j << OBJBITS;
+    j = from[ k*stride + j ];
+  }
+
+  mokFree( cnt );
+  mokFree( sum );
+  mokFree( best );
+  mokFree( from );
+}
+
 /********************************************
 *
 * Initialize conversion tables.
 *
+* With the nBins option the bin sizes are
+* fitted to the histogram in BIN_HIST_FILE,
+* otherwise, or if the file can't be read, the
+* built-in sizes are used.
 */
 static void _initChunkConv( void )
 {
   int target,i, j;
+  int nBins = gcvar.opt.nBins;
+  uint *hist;
+
+  chkconv.nBins = N_DEFAULT_BINS;
+  for (i=0; i<N_DEFAULT_BINS; i++)
+    chkconv.binSize[i] = _defaultBinSizes[i];
+
+  if (nBins > 0) {
+    mokAssert( nBins <= MAX_BINS );
+    hist = (uint*)mokMalloc( sizeof(uint)*BIN_HIST_ENTRIES, true );
+    if (_readSizeHistogram( hist )) {
+      _fitBinSizes( hist, nBins, chkconv.binSize );
+      chkconv.nBins = nBins;
+#ifdef RCVERBOSE
+      jio_printf("bins:");
+      for (i=0; i<N_BINS; i++)
+        jio_printf(" %d", chkconv.binSize[i] );
+      jio_printf("\n");
+#endif
+    }
+    else
+      jio_printf("using the built-in bins\n" );
+    mokFree( hist );
+  }
 
-  i=0;
-
-  chkconv.binSize[ i++ ] = 8;
-  chkconv.binSize[ i++ ] = 16;
-  chkconv.binSize[ i++ ] = 24;
-  chkconv.binSize[ i++ ] = 32;
-  chkconv.binSize[ i++ ] = 40;
-  chkconv.binSize[ i++ ] = 48;
-  chkconv.binSize[ i++ ] = 56;
-  chkconv.binSize[ i++ ] = 64;
-  chkconv.binSize[ i++ ] = 80;
-  chkconv.binSize[ i++ ] = 96;
-  chkconv.binSize[ i++ ] = 112;
-  chkconv.binSize[ i++ ] = 128;
-  chkconv.binSize[ i++ ] = 160;
-  chkconv.binSize[ i++ ] = 192;
-  chkconv.binSize[ i++ ] = 224;
-  chkconv.binSize[ i++ ] = 256;
-  chkconv.binSize[ i++ ] = 320;
-  chkconv.binSize[ i++ ] = 384;
-  chkconv.binSize[ i++ ] = 448;
-  chkconv.binSize[ i++ ] = 512;
-  chkconv.binSize[ i++ ] = 640;
-  chkconv.binSize[ i++ ] = 768;
-  chkconv.binSize[ i++ ] = 1024;
-  chkconv.binSize[ i++ ] = 1280;
-  chkconv.binSize[ i++ ] = 2048;
-  chkconv.binSize[ i++ ] = 4096;
-  chkconv.binSize[ i++ ] = 8192;
-
-  mokAssert( i == N_BINS );
+  mokAssert( chkconv.binSize[ N_BINS-1 ] == MAX_CHUNK_ALLOC );
 
   j = 0;
-  for (i=0; i<=N_BINS; i++) {
+  for (i=0; i<N_BINS; i++) {
     target = chkconv.binSize[i];
+    mokAssert( (target & (OBJGRAIN-1)) == 0 );
     for (; j<=target; j++) {
       chkconv.szToBinIdx[ j ] = i;
       chkconv.szToBinSize[ j ] = target;
@@ -133,12 +357,44 @@ static void _initChunkConv( void )
 
   for (i=0; i<N_BINS; i++) {
     chkconv.binToObjectsPerBlock[i] = BLOCKSIZE / chkconv.binSize[i];
-#ifdef RCDEBUG
     chunkvar.nBlocksInPartialList[i] = 0;
-#endif /* RCDEBUG */
+  }
+
+  /* object starts, in RC bitmap layout */
+  for (i=0; i<N_BINS; i++) {
+    int g = 0;
+    int stride = chkconv.binSize[i] >> OBJBITS;
+    for (j=0; j<chkconv.binToObjectsPerBlock[i]; j++, g+=stride)
+      chkconv.binStartMask[i][ g/RC_HANDLES_PER_WORD ] |= 
+        1 << ((g%RC_HANDLES_PER_WORD)*RC_FIELD_BITS);
   }
 }
 
+/********************************************
+*
+* Write the allocation sizes counted so far,
+* in the format _readSizeHistogram() reads,
+* so that a later run can fit its bins to them.
+*/
+GCEXPORT void chkWriteSizeHistogram( void )
+{
+  FILE *f;
+  int i;
+
+  if (!gcvar.opt.binProfile)
+    return;
+  f = fopen( BIN_HIST_FILE, "w" );
+  if (!f) {
+    jio_printf("%s could not be written\n", BIN_HIST_FILE );
+    return;
+  }
+  fprintf( f, "# size count\n" );
+  for (i=1; i<BIN_HIST_ENTRIES; i++)
+    if (chkconv.sizeHist[i])
+      fprintf( f, "%d %u\n", i << OBJBITS, chkconv.sizeHist[i] );
+  fclose( f );
+}
+
 
 /***************************************************************/
 /******************* COLLECTION ********************************/
@@ -158,7 +414,7 @@ static void _initChunkConv( void )
 *
 *
 * Locks taken: 
-*       the partial list lock
+*       none, the block is pushed by CAS.
 *
 * Competing operations: 
 *       mutators executing _getPartialBlock
@@ -168,131 +424,94 @@ static void _initChunkConv( void )
 */
 static void _addPageToPartialList( BlkAllocHdr* ph )
 {
-  BlkAllocHdr *head;
   int idx = bhGet_bin_idx(ph);
-  PARTIALLIST *pList = &chunkvar.partialLists[ idx ];
+  PARTIALLIST *pList = _blockPartialList( ph );
+  bool ok;
 
-  mokAssert( bhGet_status(ph) == VOIDBLK );
-  bhSet_status(ph, PARTIAL );
+  ok = bhCasStatus( ph, VOIDBLK, PARTIAL );
+  mokAssert( ok );
 
-  _lockPartialList( pList, gcvar.ee );
-  head = pList->firstBlock;
-  ph->nextPartial = head;
-  ph->prevPartial = (BlkAllocHdr*)pList;
-  if (head)
-    head->prevPartial = ph;
-  pList->firstBlock = ph;
-#ifdef RCDEBUG
-  chunkvar.nBlocksInPartialList[ idx ] ++;
-#endif /* RCDEBUG */
-  _unlockPartialList( pList, gcvar.ee );
+  ph->prevPartial = NULL;
+  InterlockedIncrement( (long*)&chunkvar.nBlocksInPartialList[ idx ] );
+  _pushPartialChain( pList, ph, ph );
 }
 
 
 /*************************************************
 *
-* Flush the buffers that contains block headers
-* which have observed to be full.
-*
-* Each partial list is locked and the buffer 
-* corresponding to it is examined.
-*
-* Each element has been already observed to be
-* entirely free may have undergone many changes
-* since:
-*
-* 1. It could have been reallocated and now
-*     it is either OWNED or VOIDBLK.
-*
-* 2. If it turned into VOPIDBLK then the collector
-*    could have already freed it.
-*
-* We protect against each of these possibilities
-* by checking that the block is indeed full, and
-* in the original partial list where it was observed.
+* Return the fully free blocks of the partial
+* lists to the block manager.
 *
-* Additionally, we mark such a block as DUMMYBLK in
-* order not to free it twice.
+* Only lists in which blocks have been observed
+* to be full are looked at.  Such a list is taken
+* as a whole, the blocks that are still entirely
+* free are picked out of it and the rest is
+* pushed back.  Meanwhile the list looks empty
+* to mutators, which at worst go to the block
+* manager for a fresh block.
 *
-* When the candidates for freeing are verifired, the
-* array of truly deletable blocks is passed to the
-* block manager.
+* A picked block is marked as DUMMYBLK, then the
+* truly deletable blocks are passed to the block
+* manager, in batches of MAX_OBSERVED_FULL.
 *
 * Locks taken: 
-*     1. the partial list lock.  Each at a time.
-*     2. Afterwards, the block manager lock.
+*     the block manager lock.
 *
 * Competing operations: 
 *     mutators executing _getPartialBlock.
 *
 * State changes:
-*     PARTIAL ---> Block Mgr states.  Contention resolved
-*     by block mgr lock.
+*     PARTIAL ---> Block Mgr states.  No contention
+*     since the blocks are off the list.
 */
 static void _flushObservedFull(void)
 {
-  int  listIdx, status, count, maxObj, currentListIdx;
-  int   blockIdx;
+  int  i, listIdx, maxObj;
   PARTIALLIST *pList;
-  BlkAllocHdr *ph;
+  BlkAllocHdr *ph, *next, *keepFirst, *keepLast;
+  bool ok;
 
   chunkvar.nTrulyFull = 0;
 
-
-  for (listIdx = 0; listIdx<N_BINS; listIdx++) {
-    pList = &chunkvar.partialLists[ listIdx ];
+  /* the lists of all nodes, node after node */
+  for (i = 0; i<blkvar.nNodes*MAX_BINS; i++) {
+    pList = &chunkvar.partialLists[ 0 ][ 0 ] + i;
+    if (!pList->nObservedFull)
+      continue;
+    listIdx = i % MAX_BINS;
     maxObj = chkconv.binToObjectsPerBlock[listIdx] ;
 
-    _lockPartialList( pList, gcvar.ee);
+    keepFirst = keepLast = NULL;
+    for (ph = _drainPartialList( pList ); ph; ph = next) {
+      next = ph->nextPartial;
 
-    for (blockIdx=0; blockIdx<pList->nObservedFull; blockIdx++) {
-      ph = pList->observedFull[ blockIdx ];
-                
-      /* Did some mutator took it ? */
-      status = bhGet_status(ph);
-      if (status != PARTIAL) { /* yep */
-        continue;
-      }
-        
-      /* 
-       * Is it in the original partial list
-       * where it was observed to be full ?
-       */
-      currentListIdx = bhGet_bin_idx(ph);
-      if (currentListIdx != listIdx ) /* nop */
-        continue;
+      mokAssert( bhGet_status(ph) == PARTIAL );
+      mokAssert( bhGet_bin_idx(ph) == listIdx );
 
-      /**
-       * Is it still fully free ?
-       */
-      if (!ph->freeList) /* nop */
+      if (_blockFreeCount( ph ) < maxObj) {
+        /* keep it */
+        if (keepLast)
+          keepLast->nextPartial = ph;
+        else
+          keepFirst = ph;
+        keepLast = ph;
         continue;
+      }
 
-      count = ph->freeList->count;
-
-      mokAssert( count>=0 && count<=maxObj );
-                        
-      if (count < maxObj) /* nop */
-        continue;
-                        
-      /*
-       * Protect against extracting a single block
-       * mutiple times.
-       */
-      bhSet_status( ph, DUMMYBLK );
-                        
-      /* extract the page */
-      ph->prevPartial->nextPartial = ph->nextPartial;
-      if (ph->nextPartial)
-        ph->nextPartial->prevPartial = ph->prevPartial;
-#ifdef RCDEBUG
-      chunkvar.nBlocksInPartialList[ listIdx ] --;
-#endif /* RCDEBUG */
+      mokAssert( _blockFreeCount( ph ) == maxObj );
+      ok = bhCasStatus( ph, PARTIAL, DUMMYBLK );
+      mokAssert( ok );
+      InterlockedDecrement( (long*)&chunkvar.nBlocksInPartialList[ listIdx ] );
 
       chunkvar.trulyFull[ chunkvar.nTrulyFull++ ] = ph;
+      if (chunkvar.nTrulyFull == MAX_OBSERVED_FULL) {
+        blkFreeSomeChunkedBlocks( chunkvar.trulyFull, chunkvar.nTrulyFull );
+        chunkvar.nTrulyFull = 0;
+      }
     }
 
-    _unlockPartialList( pList, gcvar.ee );
+    if (keepFirst)
+      _pushPartialChain( pList, keepFirst, keepLast );
 
     pList->nObservedFull = 0; /* reset the list specific counter */
   }
@@ -300,28 +519,28 @@ static void _flushObservedFull(void)
   chunkvar.nObservedFull = 0;        
 
   /* return blocks to the block manager */
-  blkFreeSomeChunkedBlocks( chunkvar.trulyFull, chunkvar.nTrulyFull );
+  if (chunkvar.nTrulyFull)
+    blkFreeSomeChunkedBlocks( chunkvar.trulyFull, chunkvar.nTrulyFull );
 }
 
 /*************************************************************************
 *
 * Take a note that a block has been observed to be fully free.
 *
-* For each partial list we keep a buffer and a counter of blocks that
-* were observed as full.  Additonally, we keep a global counter of
-* all the blocks in all the partial lists that were observed to be full.
+* For each partial list we keep a counter of blocks that were observed
+* as full.  Additonally, we keep a global counter of all the blocks in
+* all the partial lists that were observed to be full.
 *
 * If either the list specific counter or the global counter crosses a
 * threshold, the lists are flushed using _flushObservedFull()
 *
 *
 * Locks taken:
-*       the call to _flushObservedFull() may lock partial lists and/or
-*       the block manager (one at a time).
+*       the call to _flushObservedFull() may lock the block manager.
 */
 static void _handleFullPartialBlock( PARTIALLIST *pList, BlkAllocHdr* ph )
 {
-  pList->observedFull[ pList->nObservedFull++ ] = ph;
+  pList->nObservedFull++;
   chunkvar.nObservedFull++;
   if (pList->nObservedFull >= MAX_OBSERVED_FULL_PER_LIST || 
       chunkvar.nObservedFull >= MAX_OBSERVED_FULL)
@@ -356,14 +575,54 @@ static void _handleFullPartialBlock( PARTIALLIST *pList, BlkAllocHdr* ph )
 *    _flushRecycledListEntry().  Contention is
 *    resolved by the page's lock.
 */
+#ifdef RCFREEBMP
+/**************************************************
+*
+* Move the first non-empty word of a block's free
+* bitmap, at or after "freeWord", into the
+* allocation list.  The caller holds the block's
+* lock and has seen that the block has free
+* objects.
+*/
+static void _takeFreeWord( ALLOCLIST *allocList, BlkAllocHdr *ph )
+{
+  uint *bmp = BLKFREEBMP( ph );
+  int i = allocList->freeWord;
+  uint bits;
+
+  mokAssert( bhFreeCount(ph) > 0 );
+
+  for (;;) {
+    if (i >= FREEBMP_WORDS)
+      i = 0;
+    bits = bmp[i];
+    if (bits)
+      break;
+    i++;
+  }
+  bmp[i] = 0;
+  bhFreeCount(ph) -= _popCount( bits );
+  allocList->freeBits = bits;
+  allocList->freeWord = i;
+}
+#endif /* RCFREEBMP */
+
 static void _stealFreeList( ALLOCLIST *allocList )
 {
   BlkAllocHdr *ph = allocList->allocBlock;
+#ifndef RCFREEBMP
   BLKOBJ *prev, *head;
+#endif
 
   mokAssert( allocList->binIdx == bhGet_bin_idx( ph ) );
   mokAssert( bhGet_status(ph) == OWNED );
 
+#ifdef RCFREEBMP
+  bhLock( ph );
+  allocList->freeWord = 0;
+  _takeFreeWord( allocList, ph );
+  bhUnlock( ph );
+#else
   bhLock( ph );
   (volatile BLKOBJ*)prev = ph->freeList;
   ph->freeList = NULL;
@@ -376,6 +635,7 @@ static void _stealFreeList( ALLOCLIST *allocList )
   prev->next = ALLOC_LIST_NULL;
 
   allocList->head = head;
+#endif /* RCFREEBMP */
 }
 
 /***************************************************
@@ -383,15 +643,15 @@ static void _stealFreeList( ALLOCLIST *allocList )
 * Tries extracting a block from a partial list.
 *
 * If the partial list corresponding to the allocation
-* list is non-empty then the first element is extracted.
+* list is non-empty then the first element is popped.
+* The list of the node we run on is tried first, then
+* those of the other nodes.
 *
-* While the partial list lock is held, the state of the
-* block is changed to OWNED.  This protects against
-* freeing the block by the collector back to the block
+* Once popped, the block is ours and its state is
+* changed to OWNED.  This protects against freeing
+* the block by the collector back to the block
 * manager.
 *
-* The partial list lock is then released.
-*
 * Then the blocks free list is stolen (i.e., moved onto the
 * allocation list) which entails locking the block.
 */
@@ -402,13 +662,15 @@ static BOOL _getPartialBlock( ALLOCLIST *allocList, ExecEnv *ee )
   int delta = GetTickCount();
 #endif
 
-  BlkAllocHdr *ph;
-  PARTIALLIST *pList = &chunkvar.partialLists[ allocList->binIdx ];
+  BlkAllocHdr *ph = NULL;
+  int node = BLKCURRENTNODE();
+  int i;
+  bool ok;
         
-  _lockPartialList( pList, ee );
-  ph = pList->firstBlock;
+  for (i=0; !ph && i<blkvar.nNodes; i++)
+    ph = _popPartialBlock( 
+           &chunkvar.partialLists[ (node+i) % blkvar.nNodes ][ allocList->binIdx ] );
   if ( !ph ) {
-    _unlockPartialList( pList, ee );
 #ifdef RCDEBUG
     delta = GetTickCount() - delta;
     if (delta > deltaMax) {
@@ -419,24 +681,30 @@ static BOOL _getPartialBlock( ALLOCLIST *allocList, ExecEnv *ee )
 #endif
     return FALSE;
   }
-  else {
-    BlkAllocHdr *next = ph->nextPartial;
-    pList->firstBlock = next;
-    if (next) 
-      next->prevPartial = (BlkAllocHdr*)pList;
-  }
-  bhSet_status( ph, OWNED );
-#ifdef RCDEBUG
-  chunkvar.nBlocksInPartialList[ allocList->binIdx ] --;
-#endif /* RCDEBUG */
-  _unlockPartialList( pList, ee );
+  ok = bhCasStatus( ph, PARTIAL, OWNED );
+  mokAssert( ok );
+  ph->nextPartial = NULL;
+  mokAssert( !ph->prevPartial );
+  InterlockedDecrement( (long*)&chunkvar.nBlocksInPartialList[ allocList->binIdx ] );
 
   allocList->allocBlock = ph;
 
+  /* if the block hasn't been swept since the last trace, do it now */
+  if (chunkvar.lazySweepActive) {
+    InterlockedIncrement( (long*)&chunkvar.nLazySweepers );
+    if (bhClaimSweep( ph ))
+      _sweepOwnedBlock( ph );
+    InterlockedDecrement( (long*)&chunkvar.nLazySweepers );
+  }
+
   _stealFreeList(allocList);
         
+#ifdef RCFREEBMP
+  mokAssert( allocList->freeBits );
+#else
   mokAssert( allocList->head );
   mokAssert( allocList->head->count );
+#endif
 
 #ifdef RCDEBUG
   delta = GetTickCount() - delta;
@@ -455,6 +723,14 @@ static BOOL _getPartialBlock( ALLOCLIST *allocList, ExecEnv *ee )
 * Tries allocating object from the allocation list or from
 * the block which is currently owned by it.
 *
+* If the bump cursor hasn't reached its limit, then the object
+* at the cursor is returned and the cursor is moved on.  The
+* object's "next" is set to ALLOC_LIST_NULL before the cursor
+* is published so it doesn't look like garbage to the sweep.
+* "next" is in the object's header, so an object bumped out of
+* a zeroed block has a zero body (see ALLOCLIST).  Such objects
+* are logged as ranges, the caller has to count them in.
+*
 * If the allocation list is non-empty, then the first element
 * is extracted and returned (no locking required).
 *
@@ -473,7 +749,31 @@ static BOOL _getPartialBlock( ALLOCLIST *allocList, ExecEnv *ee )
 static BLKOBJ *_allocFromOwnedBlock( ALLOCLIST* allocList )
 {
   BLKOBJ *head = allocList->head;
+  byte *cur = allocList->cursor;
+
+  if (cur < allocList->limit) {
+    BLKOBJ *o = (BLKOBJ*)cur;
+
+    mokAssert( bhGet_status( allocList->allocBlock) == OWNED );
+    mokAssert( bhBumpTop( allocList->allocBlock ) == cur );
+    o->next = ALLOC_LIST_NULL;
+    cur += allocList->objSize;
+    allocList->cursor = cur;
+    allocList->lastBumped = true;
+    bhBumpTop( allocList->allocBlock ) = cur;
+    return o;
+  }
 
+  allocList->lastBumped = false;
+
+#ifdef RCFREEBMP
+  if (allocList->freeBits) {
+    BLKOBJ *o;
+    _allocListNext( allocList, head, o );
+    mokAssert( o->next == ALLOC_LIST_NULL );
+    return o;
+  }
+#else
   if (head != ALLOC_LIST_NULL) {
 
 #ifdef RCDEBUG
@@ -505,6 +805,7 @@ static BLKOBJ *_allocFromOwnedBlock( ALLOCLIST* allocList )
     allocList->head = head->next;
     return head;
   }
+#endif /* RCFREEBMP */
 
   {
 #ifdef RCDEBUG
@@ -517,6 +818,15 @@ static BLKOBJ *_allocFromOwnedBlock( ALLOCLIST* allocList )
 
     /* see if there is something on the free list */
     bhLock( ph );
+#ifdef RCFREEBMP
+    if (bhFreeCount( ph )) {
+      BLKOBJ *o;
+      _takeFreeWord( allocList, ph );
+      bhUnlock( ph );
+      _allocListNext( allocList, head, o );
+      return o;
+    }
+#else
     (volatile BLKOBJ*)head = ph->freeList;
     if (head) { 
       /* copy and clear */
@@ -530,6 +840,7 @@ static BLKOBJ *_allocFromOwnedBlock( ALLOCLIST* allocList )
         return ret;
       }        
     }
+#endif /* RCFREEBMP */
 
     /* OK, we have to abandon the page, i.e.,
      * transfrom it into a VOIDPG page
@@ -553,7 +864,9 @@ static BLKOBJ *_allocFromOwnedBlock( ALLOCLIST* allocList )
 /********************************************************
 *
 * Allocate a single block from the block manager and
-* chunk it into the given allocation list.
+* make it the bump allocation block of the given list.
+* Nothing in the block is written here.  The block's
+* zero flag is taken over by the list.
 */
 static bool _getBlkMgrBlock( ALLOCLIST* allocList, ExecEnv *ee )
 {
@@ -565,7 +878,7 @@ static bool _getBlkMgrBlock( ALLOCLIST* allocList, ExecEnv *ee )
   BlkAllocHdr *ph = blkAllocBlock( ee );
   int sz;
   int count;
-  BLKOBJ *start, *curr, *next;
+  byte *start;
         
   if (!ph) {
 #ifdef RCDEBUG
@@ -584,21 +897,29 @@ static bool _getBlkMgrBlock( ALLOCLIST* allocList, ExecEnv *ee )
 
   mokAssert( count >= 2 );
 
-  count--;
+  start = (byte*)BLOCKHDROBJ(ph);
 
-  start = curr = BLOCKHDROBJ(ph);
-        
-  for ( ;count>0; count--) {
-    next = (BLKOBJ*)(((word)curr) + sz );
-    curr->next = next;
-    curr = next;
-  }
-  curr->next = ALLOC_LIST_NULL;
-
-  allocList->head = start;
+  allocList->head = ALLOC_LIST_NULL;
   allocList->allocBlock = ph;
-  ph->nextPartial = ph->prevPartial = NULL;
+  allocList->cursor = start;
+  allocList->limit = start + count*sz;
+  allocList->objSize = sz;
+  allocList->bumpZero = BLKZEROED( ph );
+  BLKZEROED( ph ) = 0;
+  mokAssert( allocList->createStart == allocList->createTop );
+  /* HS1 logs the range, it mustn't see one end moved and not the other */
+  ee->gcblk.cantCoop = true;
+  allocList->createStart = start;
+  allocList->createTop = start;
+  ee->gcblk.cantCoop = false;
+#ifdef RCFREEBMP
+  allocList->freeBits = 0;
+  memset( BLKFREEBMP( ph ), 0, FREEBMP_WORDS*sizeof(uint) );
+#endif
+  ph->nextPartial = NULL;
   ph->freeList = NULL;
+  /* the cursor must be in place before the block is seen OWNED */
+  bhBumpTop( ph ) = start;
   ph->StatusLockBinidx = (OWNED << 24) | allocList->binIdx;
 
 #ifdef RCDEBUG
@@ -625,20 +946,18 @@ static bool _getBlkMgrBlock( ALLOCLIST* allocList, ExecEnv *ee )
 #ifdef RCDEBUG
 GCFUNC void chkPreCollect(BLKOBJ *o)
 {
-  word blockid;
   RLCENTRY *rlce;
   BLKOBJ *head;
 
-  blockid = OBJBLOCKID(o);
-  rlce = &chunkvar.rlCache[blockid % chunkvar.nCacheEntries];
+  rlce = RLCENTRY_OF(o);
   head = rlce->recycledList;
         
   /**
-   * Is the cache entry currently owned by this block ?
+   * Is the entry already in use ?
    */
-  if ((((word)head) ^ ((word)o)) < BLOCKSIZE) {
+  if (head) {
         
-    mokAssert( OBJBLOCKID(head)==blockid );
+    mokAssert( OBJBLOCKID(head)==OBJBLOCKID(o) );
     {
       int binIdx = bhGet_bin_idx( OBJBLOCKHDR(o) );
       int objSize = chkconv.binSize[ binIdx ];
@@ -656,48 +975,33 @@ GCFUNC void chkPreCollect(BLKOBJ *o)
     return;
   }
 
-  if (head) 
-    chkFlushRecycledListEntry( rlce );
-        
-  /* now the entry is vacant and we can use it */
+  /* first object freed in this block during the pass */
   o->count = 1;
   o->next  = o;
   rlce->recycledList = o;
+  chunkvar.rlDirty[ chunkvar.nDirty++ ] = rlce;
 }
 #endif /* RCDEBUG */
 
-/***********************************************************************
-*
-* Flush an entry in the recycled lists cache.
-*
-*
-* First of, the block is locked then its state is read, the free list
-* is merged with the recycled list and then the lock is released.
-*
-* -- If the block is in the VOIDBLK state:
-*
-* a. The free list must be empty.
-* b. If the free list now contains all elements in the block then the
-*    block is returned directly to the block manager (without going 
-*    through the "observed full" set).  Otherwise, the state is changed 
-*    to PARTIAL  (no lock is taken).  Then the corresponding partial list
-*    is locked and the block is added to it.
-*
-* -- Additional action for PARTIAL
-* a. If the block is now fully freed, then it is marked as "observed full"
-*    which may lead to the flushing of the "observed full" set.
-*
-* Note: free lists and recycled lists are circular.
-*
-*/
-GCFUNC void chkFlushRecycledListEntry(RLCENTRY *rlce)
+/*
+ * Merge a circular recycled list into the free list of its block.
+ * Returns the number of objects now in the free list, and the
+ * status of the block, as read under the block lock, in "pStatus".
+ */
+static int _mergeRecycledList( BLKOBJ *recycledList, unsigned *pStatus )
 {
   BlkAllocHdr *ph;
   int nFree, nRecycled;
-  BLKOBJ *recycledList, *freeList;
+#ifdef RCFREEBMP
+  BLKOBJ *o, *next;
+  byte *blockStart;
+  uint *bmp;
+  int i;
+#else
+  BLKOBJ *freeList;
+#endif
   unsigned status;
-        
-  recycledList = rlce->recycledList;
+
   ph = OBJBLOCKHDR( recycledList );
 
   mokAssert( recycledList ); /* or else it woudn't be in the cache */
@@ -712,6 +1016,26 @@ GCFUNC void chkFlushRecycledListEntry(RLCENTRY *rlce)
   status = bhGet_status(ph);
   mokAssert( status==PARTIAL || status==OWNED || status==VOIDBLK);
 
+#ifdef RCFREEBMP
+  /*
+   * Set the objects' bits.  Their "next" is reset so they
+   * still don't look like garbage to the sweep.
+   */
+  blockStart = (byte*)BLOCKHDROBJ( ph );
+  bmp = BLKFREEBMP( ph );
+  o = recycledList;
+  for (i=0; i<nRecycled; i++) {
+    int grain = ((byte*)o - blockStart) >> OBJBITS;
+    next = o->next;
+    mokAssert( !(bmp[grain/32] & (1 << (grain%32))) );
+    bmp[ grain/32 ] |= 1 << (grain%32);
+    o->next = ALLOC_LIST_NULL;
+    o = next;
+  }
+  mokAssert( o == recycledList );
+  nFree = bhFreeCount(ph) + nRecycled;
+  bhFreeCount(ph) = nFree;
+#else
   (volatile BLKOBJ*)freeList = ph->freeList;
 
   if (freeList) {
@@ -729,16 +1053,57 @@ GCFUNC void chkFlushRecycledListEntry(RLCENTRY *rlce)
 
   freeList->count = nFree;
   ph->freeList = freeList;
+#endif /* RCFREEBMP */
 
   bhUnlock( ph );
 
+  *pStatus = status;
+  return nFree;
+}
+
+/***********************************************************************
+*
+* Flush an entry in the recycled lists cache.
+*
+*
+* First of, the block is locked then its state is read, the free list
+* is merged with the recycled list and then the lock is released.
+*
+* -- If the block is in the VOIDBLK state:
+*
+* a. The free list must be empty.
+* b. If the free list now contains all elements in the block then the
+*    block is returned directly to the block manager (without going 
+*    through the "observed full" set).  Otherwise, the state is changed 
+*    to PARTIAL  (no lock is taken).  Then the block is pushed onto the
+*    corresponding partial list.
+*
+* -- Additional action for PARTIAL
+* a. If the block is now fully freed, then it is marked as "observed full"
+*    which may lead to the flushing of the "observed full" set.
+*
+* Note: free lists and recycled lists are circular.
+*
+*/
+GCFUNC void chkFlushRecycledListEntry(RLCENTRY *rlce)
+{
+  BlkAllocHdr *ph;
+  int nFree;
+  BLKOBJ *recycledList;
+  unsigned status;
+        
+  recycledList = rlce->recycledList;
+  ph = OBJBLOCKHDR( recycledList );
+
+  nFree = _mergeRecycledList( recycledList, &status );
+
   if (status == PARTIAL) {
     /*
      * Have we freed all chunks on a
      * partial page ?
      */
     int binIdx = bhGet_bin_idx( ph );
-    PARTIALLIST *pList = &chunkvar.partialLists[ binIdx ];
+    PARTIALLIST *pList = _blockPartialList( ph );
     int maxChunks = chkconv.binToObjectsPerBlock[ binIdx ];
     if (maxChunks == nFree)
       _handleFullPartialBlock( pList, ph );
@@ -763,59 +1128,400 @@ GCFUNC void chkFlushRecycledListEntry(RLCENTRY *rlce)
 GCFUNC void chkFlushRecycledListsCache( void )
 {
   int i;
-  RLCENTRY *rlce = chunkvar.rlCache;
-  for (i=chunkvar.nCacheEntries; i>0; i--, rlce++) 
-    if (rlce->recycledList) 
-      chkFlushRecycledListEntry( rlce );
+  for (i=0; i<chunkvar.nDirty; i++) {
+    mokAssert( chunkvar.rlDirty[i]->recycledList );
+    chkFlushRecycledListEntry( chunkvar.rlDirty[i] );
+  }
+  chunkvar.nDirty = 0;
 }
 
-GCFUNC void chkSweepChunkedBlock( BlkAllocHdr *ph, int status)
+/*
+ * Link "o" into the circular recycled list held by "rlce".
+ */
+#define _recycleObject( rlce, o ) \
+do { \
+  if ((rlce)->recycledList) { \
+    (o)->next = (rlce)->recycledList->next; \
+    (rlce)->recycledList->next = (o); \
+  } \
+  else { \
+    (o)->next = (o); \
+    (rlce)->recycledList = (o); \
+  } \
+} while (0)
+
+/*********************************************************************
+*
+* Sweep a block of small objects by its RC bitmap words.
+*
+* Each word has the counts of RC_HANDLES_PER_WORD handles.  The low bit
+* of a field in RC_ZERO_FIELDS(w) is set iff the count is zero, and
+* masking with the bin's start mask leaves the objects of the block
+* which have no references.  Only those are checked further, so the
+* live parts of the block are skipped without touching the objects
+* themselves.
+*
+* The words are taken four at a time with SSE2, and a group with no
+* candidate is passed over with a single compare.
+*/
+static int _sweepBlockByWords( BlkAllocHdr *ph, byte *top, RLCENTRY *rlce )
+{
+  uint *startMask = chkconv.binStartMask[ bhGet_bin_idx( ph ) ];
+  byte *blockStart = (byte*)BLOCKHDROBJ( ph );
+  uint *rcWord = RC_BMP_WORD( blockStart );
+  __m128i zero = _mm_setzero_si128();
+  uint cand[4];
+  int count = 0;
+  int i, j;
+
+  rlce->recycledList = NULL;
+
+  for (i=0; i<RC_WORDS_PER_BLOCK; i+=4) {
+    __m128i m4 = RC_ZERO_FIELDS4( _mm_loadu_si128( (__m128i*)(rcWord+i) ),
+                                  _mm_loadu_si128( (__m128i*)(startMask+i) ) );
+
+    if (_mm_movemask_epi8( _mm_cmpeq_epi32( m4, zero ) ) == 0xffff)
+      continue;
+    _mm_storeu_si128( (__m128i*)cand, m4 );
+
+    for (j=0; j<4; j++) {
+      uint m = cand[j];
+
+      while (m) {
+        int bit = _lowestBit( m );
+        GCHandle *h = (GCHandle*)
+          (blockStart + 
+           (((i+j)*RC_HANDLES_PER_WORD + bit/RC_FIELD_BITS) << OBJBITS));
+        m &= m-1;
+        if ((byte*)h >= top)
+          goto __done;
+        if (gcIsHandleGarbage(h)) {
+          BLKOBJ *o = (BLKOBJ*)h;
+          _recycleObject( rlce, o );
+          count++;
+        }
+      }
+    }
+  }
+
+ __done:
+  if (count)
+    rlce->recycledList->count = count;
+  return count;
+}
+
+/*********************************************************************
+*
+* Sweep a block of large objects, one object at a time.  With fewer
+* objects than bitmap words this is cheaper than going by the words.
+*/
+static int _sweepBlockByObjects( BlkAllocHdr *ph, byte *top, RLCENTRY *rlce )
 {
   int binidx = bhGet_bin_idx( ph );
   int objsz = chkconv.binSize[ binidx ];
   int nobj = chkconv.binToObjectsPerBlock[ binidx ];
   GCHandle *h = (GCHandle*)BLOCKHDROBJ(ph);
-  RLCENTRY rlce;
   int count = 0;
 
-  while (nobj>0) {
-    nobj--;
-    if (gcGetHandleRC(h)==0 && !h->logPos) {
+  rlce->recycledList = NULL;
+
+  for (; nobj>0 && (byte*)h < top; nobj--) {
+    if (gcIsHandleGarbage(h)) {
       BLKOBJ *o = (BLKOBJ*)h;
-      o->next = o;
-      rlce.recycledList = o;
-      count = 1;
-      goto __scan_with_list;
+      _recycleObject( rlce, o );
+      count++;
     }
     h = (GCHandle*)(objsz + (char*)h);
   }
 
-  return; /* found nothing */
+  if (count)
+    rlce->recycledList->count = count;
+  return count;
+}
 
- __scan_with_list:
-  /* here recycled list is non-empty */
+/*********************************************************************
+*
+* Scan a chunked block for garbage and link whatever is found into a
+* circular recycled list held by "rlce".  Returns the number of objects
+* found.
+*
+* In a block which is being bump allocated only the objects below the
+* published cursor are scanned.  The status is read before the cursor,
+* and the owner writes them in the opposite order.
+*/
+static int _sweepBlockObjects( BlkAllocHdr *ph, RLCENTRY *rlce )
+{
+  int objsz = chkconv.binSize[ bhGet_bin_idx( ph ) ];
+  byte *top = NULL;
 
-  h = (GCHandle*)(objsz + (char*)h);
-  while (nobj>0) {
-    nobj--;
-    if (gcGetHandleRC(h)==0 && !h->logPos) {
-      BLKOBJ *o = (BLKOBJ*)h;
-      count++;
-      o->next = rlce.recycledList->next;
-      rlce.recycledList->next = o;
-      goto __scan_with_list;
-    }
-    h = (GCHandle*)(objsz + (char*)h);
-  }
+  if (bhGet_status( ph ) == OWNED)
+    top = bhBumpTop( ph );
+  if (!top)
+    top = (byte*)BLOCKHDROBJ( ph ) + BLOCKSIZE;
+
+  if (objsz <= (RC_HANDLES_PER_WORD << OBJBITS))
+    return _sweepBlockByWords( ph, top, rlce );
+  return _sweepBlockByObjects( ph, top, rlce );
+}
+
+GCFUNC void chkSweepChunkedBlock( BlkAllocHdr *ph, int status)
+{
+  RLCENTRY rlce;
+  int count = _sweepBlockObjects( ph, &rlce );
+
+  if (!count)
+    return;
 
 #ifdef RCDEBUG
   gcvar.dbg.nFreedInCycle += count;
-  gcvar.dbg.nBytesFreedInCycle += count*objsz;
+  gcvar.dbg.nBytesFreedInCycle += count*chkconv.binSize[ bhGet_bin_idx(ph) ];
 #endif
-  rlce.recycledList->count = count;
   chkFlushRecycledListEntry( &rlce );
 }
 
+/*********************************************************************
+*
+* Sweep a chunked block on behalf of a parallel sweep worker (see
+* blkSweep()).  The garbage is merged into the block's free list right
+* away, under the block lock as usual, but whatever would touch a shared
+* list is only recorded in "w".
+*
+* The merge leaves a VOIDBLK block with a non-empty free list outside
+* of any partial list until the record is applied.  Nobody else flushes
+* into it meanwhile since only the collector frees.
+*/
+GCFUNC void chkSweepChunkedBlockDeferred( BlkAllocHdr *ph, SWEEPWORKER *w )
+{
+  RLCENTRY rlce;
+  unsigned status;
+  int nFree, maxChunks;
+  int count = _sweepBlockObjects( ph, &rlce );
+
+  if (!count)
+    return;
+
+#ifdef RCDEBUG
+  w->nFreed += count;
+  w->nBytesFreed += count*chkconv.binSize[ bhGet_bin_idx(ph) ];
+#endif
+  nFree = _mergeRecycledList( rlce.recycledList, &status );
+  maxChunks = chkconv.binToObjectsPerBlock[ bhGet_bin_idx(ph) ];
+
+  if (status == PARTIAL) {
+    if (maxChunks == nFree)
+      SWEEP_RECORD( w, ph, SWEEP_REC_FULL );
+  }
+  else if (status == VOIDBLK) {
+    if (maxChunks == nFree)
+      SWEEP_RECORD( w, ph, SWEEP_REC_FREE_BLOCK );
+    else
+      SWEEP_RECORD( w, ph, SWEEP_REC_TO_PARTIAL );
+  }
+}
+
+/*********************************************************************
+*
+* Carry out the records of a parallel sweep worker.  Called by the
+* collector once all the workers are done.
+*/
+GCFUNC void chkApplySweepRecords( SWEEPWORKER *w )
+{
+  int i;
+
+  for (i=0; i<w->nRecords; i++) {
+    BlkAllocHdr *ph = (BlkAllocHdr*)(w->records[i] & ~SWEEP_REC_MASK);
+
+    switch (w->records[i] & SWEEP_REC_MASK) {
+    case SWEEP_REC_TO_PARTIAL:
+      _addPageToPartialList( ph );
+      break;
+
+    case SWEEP_REC_FREE_BLOCK:
+      blkFreeChunkedBlock( ph );
+      break;
+
+    case SWEEP_REC_FULL:
+      _handleFullPartialBlock( _blockPartialList(ph), ph );
+      break;
+
+    case SWEEP_REC_FREE_BIG:
+      blkFreeRegion( (BlkAllocBigHdr*)ph );
+      break;
+    }
+  }
+#ifdef RCDEBUG
+  gcvar.dbg.nFreedInCycle += w->nFreed;
+  gcvar.dbg.nBytesFreedInCycle += w->nBytesFreed;
+#endif
+}
+
+/*************************************************
+***************  Lazy Sweeping *******************
+**************************************************/
+
+/*********************************************************************
+*
+* Mark a chunked block as sweep-pending.  Called by the collector,
+* through blkPrepareLazySweep(), at the end of a tracing cycle.
+*
+* VOIDBLK blocks are in no list so they are linked into the sweep
+* list of their bin, where allocating mutators can find them.  Only
+* the collector moves a block out of VOIDBLK so the status read by
+* the caller is stable.
+*
+* Locks taken:
+*     the sweep list lock, for VOIDBLK blocks.
+*/
+GCFUNC void chkMarkForLazySweep( BlkAllocHdr *ph, int status )
+{
+  PARTIALLIST *pList;
+  BlkAllocHdr *head;
+
+  bhSetSweepPending( ph );
+  if (status != VOIDBLK)
+    return;
+
+  pList = _blockPartialList( ph );
+  _lockSweepList( pList, gcvar.ee );
+  head = pList->firstSweepBlock;
+  ph->nextPartial = head;
+  ph->prevPartial = (BlkAllocHdr*)&pList->firstSweepBlock;
+  if (head)
+    head->prevPartial = ph;
+  pList->firstSweepBlock = ph;
+  _unlockSweepList( pList, gcvar.ee );
+}
+
+/*********************************************************************
+*
+* Sweep a block on behalf of the collector if no mutator got to it
+* first.
+*
+* A VOIDBLK block which is still sweep-pending sits in a sweep list
+* and may only be claimed under the list lock, otherwise we could
+* race with a mutator which is adopting it.
+*/
+GCFUNC void chkSweepPendingBlock( BlkAllocHdr *ph )
+{
+  int status = bhGet_status( ph );
+
+  if (status == VOIDBLK) {
+    PARTIALLIST *pList = _blockPartialList( ph );
+    bool claimed;
+
+    _lockSweepList( pList, gcvar.ee );
+    claimed = bhClaimSweep( ph );
+    if (claimed) {
+      ph->prevPartial->nextPartial = ph->nextPartial;
+      if (ph->nextPartial)
+        ph->nextPartial->prevPartial = ph->prevPartial;
+      ph->nextPartial = ph->prevPartial = NULL;
+    }
+    _unlockSweepList( pList, gcvar.ee );
+    if (!claimed)
+      return;
+  }
+  else if (!bhClaimSweep( ph ))
+    return;
+
+  chkSweepChunkedBlock( ph, status );
+}
+
+/*********************************************************************
+*
+* Wait for mutators which have claimed a block to finish sweeping it.
+* Once the collector has walked all the blocks, nothing is left to be
+* claimed so the count can only go down.
+*/
+GCFUNC void chkWaitForLazySweepers( void )
+{
+  while (chunkvar.nLazySweepers)
+    mokSleep( 0 );
+}
+
+/*********************************************************************
+*
+* Sweep a block which the calling mutator owns and has claimed.
+* Whatever is found is merged into the block's free list; the status
+* is OWNED so no list has to be updated.
+*
+* The caller must be counted in nLazySweepers from before the claim
+* until this returns.
+*/
+static void _sweepOwnedBlock( BlkAllocHdr *ph )
+{
+  RLCENTRY rlce;
+
+  mokAssert( bhGet_status(ph) == OWNED );
+
+  if (_sweepBlockObjects( ph, &rlce ))
+    chkFlushRecycledListEntry( &rlce );
+}
+
+/*********************************************************************
+*
+* Adopt a sweep-pending VOIDBLK block of the allocation list's bin and
+* sweep it.  The block is the first on the bin's sweep list of the NUMA
+* node we run on or, if that list is empty, of the first other node
+* whose list isn't.
+*
+* The block is taken off the list and claimed while the sweep list lock
+* is held, which is what chkSweepPendingBlock() expects.  It is then
+* OWNED and becomes the list's allocation block, and what the sweep
+* finds goes into its free list.  If nothing is found the following
+* call to _allocFromOwnedBlock() hands the block back as a VOIDBLK.
+*
+* Locks taken:
+*     the sweep list lock, then the block's lock.
+*/
+static bool _getSweepPendingBlock( ALLOCLIST *allocList, ExecEnv *ee )
+{
+  PARTIALLIST *pList;
+  BlkAllocHdr *ph, *next;
+  int node = BLKCURRENTNODE();
+  int i;
+  bool claimed;
+
+  if (!chunkvar.lazySweepActive)
+    return false;
+
+  /* the sweep list of the node we run on, else any non-empty one */
+  for (i=0; i<blkvar.nNodes; i++) {
+    pList = 
+      &chunkvar.partialLists[ (node+i) % blkvar.nNodes ][ allocList->binIdx ];
+    if (pList->firstSweepBlock)
+      break;
+  }
+  if (i == blkvar.nNodes)
+    return false;
+
+  InterlockedIncrement( (long*)&chunkvar.nLazySweepers );
+
+  _lockSweepList( pList, ee );
+  ph = pList->firstSweepBlock;
+  if (!ph) {
+    _unlockSweepList( pList, ee );
+    InterlockedDecrement( (long*)&chunkvar.nLazySweepers );
+    return false;
+  }
+  next = ph->nextPartial;
+  pList->firstSweepBlock = next;
+  if (next)
+    next->prevPartial = (BlkAllocHdr*)&pList->firstSweepBlock;
+  ph->nextPartial = ph->prevPartial = NULL;
+  claimed = bhClaimSweep( ph );
+  mokAssert( claimed );
+  bhSet_status( ph, OWNED );
+  _unlockSweepList( pList, ee );
+
+  allocList->allocBlock = ph;
+  allocList->head = ALLOC_LIST_NULL;
+  _sweepOwnedBlock( ph );
+
+  InterlockedDecrement( (long*)&chunkvar.nLazySweepers );
+  return true;
+}
+
 /******************* Allocation ********************************/
 
 GCEXPORT BLKOBJ *chkAllocSmall(ExecEnv* ee, unsigned binIdx )
@@ -839,40 +1545,169 @@ GCEXPORT BLKOBJ *chkAllocSmall(ExecEnv* ee, unsigned binIdx )
       mokAssert( ores );
       return ores;
     }
+    while (_getSweepPendingBlock( allocList, ee )) {
+      ores = _allocFromOwnedBlock( allocList );
+      if (ores)
+        return ores;
+    }
     if (_getBlkMgrBlock( allocList, ee )) {
       ores = _allocFromOwnedBlock( allocList );
       mokAssert( ores );
       return ores;
     }
-    /* Sync GC */
-    if (gcvar.initialized) {
-      gcvar.memStress = true;
-      gcRequestSyncGC();
-    }
-    else
+    /* wait for the collector to free some */
+    if (!gcStallForMemory( ee, 1 ))
       break;
   }
-  OutOfMemory();
+  /* the caller raises OutOfMemoryError */
   return NULL;
 }
 
+/*********************************************************************
+*
+* Give back the block owned by an allocation list of a thread which
+* is detaching.  The objects left in the list and those above the
+* bump cursor are merged into the block's free list, and the block
+* becomes PARTIAL, or VOIDBLK if nothing is left on it.  The list is
+* left empty.
+*
+* The objects above the cursor are linked before the block lock is
+* taken; the sweep doesn't look above the bump top of an OWNED block.
+* The status is changed while the lock is still held, so a concurrent
+* chkFlushRecycledListEntry() either merges into an OWNED block or sees
+* the new status, never a VOIDBLK block which already has free objects.
+*
+* Locks taken:
+*     the block's lock.
+*
+* State changes:
+*     OWNED ---> PARTIAL, or OWNED ---> VOIDBLK.
+*/
+GCFUNC void chkRetireAllocList( ExecEnv *ee, ALLOCLIST *allocList )
+{
+  BlkAllocHdr *ph = allocList->allocBlock;
+  byte *cur = allocList->cursor;
+  int objSize = allocList->objSize;
+  int nFree;
+#ifdef RCFREEBMP
+  byte *blockStart;
+  uint *bmp;
+  int n = 0;
+#else
+  BLKOBJ *o, *chain, *tail = NULL, *freeList;
+  int n = 0;
+#endif
+
+  if (!ph)
+    return;
+
+  mokAssert( bhGet_status(ph) == OWNED );
+  mokAssert( allocList->binIdx == bhGet_bin_idx( ph ) );
+
+#ifdef RCFREEBMP
+  blockStart = (byte*)BLOCKHDROBJ( ph );
+  bmp = BLKFREEBMP( ph );
+
+  bhLock( ph );
+  if (allocList->freeBits) {
+    mokAssert( !(bmp[ allocList->freeWord ] & allocList->freeBits) );
+    bmp[ allocList->freeWord ] |= allocList->freeBits;
+    n += _popCount( allocList->freeBits );
+  }
+  for (; cur < allocList->limit; cur += objSize) {
+    int grain = (cur - blockStart) >> OBJBITS;
+    ((BLKOBJ*)cur)->next = ALLOC_LIST_NULL;
+    bmp[ grain/32 ] |= 1 << (grain%32);
+    n++;
+  }
+  nFree = bhFreeCount(ph) + n;
+  bhFreeCount(ph) = nFree;
+#else
+  /* the rest of the stolen list, then the objects never bumped */
+  for (o = allocList->head; o != ALLOC_LIST_NULL; o = o->next) {
+    tail = o;
+    n++;
+  }
+  chain = allocList->head;
+  for (; cur < allocList->limit; cur += objSize) {
+    o = (BLKOBJ*)cur;
+    o->next = chain;
+    if (!tail)
+      tail = o;
+    chain = o;
+    n++;
+  }
+
+  bhLock( ph );
+  (volatile BLKOBJ*)freeList = ph->freeList;
+  if (n) {
+    /* close the circle, "tail" holds the count like a recycled list */
+    tail->next = chain;
+    if (freeList) {
+      mokAssert( freeList->count );
+      nFree = freeList->count + n;
+      o = tail->next;
+      tail->next = freeList->next;
+      freeList->next = o;
+    }
+    else {
+      nFree = n;
+      freeList = tail;
+    }
+    freeList->count = nFree;
+    ph->freeList = freeList;
+  }
+  else
+    nFree = freeList ? freeList->count : 0;
+#endif /* RCFREEBMP */
+
+  if (nFree) {
+    bhSet_status( ph, PARTIAL );
+    ph->prevPartial = NULL;
+  }
+  else
+    bhSet_status( ph, VOIDBLK );
+  bhUnlock( ph );
+
+  if (nFree) {
+    InterlockedIncrement(
+          (long*)&chunkvar.nBlocksInPartialList[ bhGet_bin_idx(ph) ] );
+    _pushPartialChain( _blockPartialList( ph ), ph, ph );
+  }
+
+  allocList->allocBlock = NULL;
+  allocList->head = ALLOC_LIST_NULL;
+  allocList->cursor = NULL;
+  allocList->limit = NULL;
+  /* HS1 logs the range, it mustn't see one end moved and not the other */
+  ee->gcblk.cantCoop = true;
+  allocList->createStart = NULL;
+  allocList->createTop = NULL;
+  ee->gcblk.cantCoop = false;
+#ifdef RCFREEBMP
+  allocList->freeBits = 0;
+#endif
+}
+
 /******************* Initialization ********************************/
 GCFUNC void chkInit(unsigned nMB)
 {
   unsigned      sz;
-  unsigned      nPages;
  
   /* init conversion tables */
   _initChunkConv();
 
-  /* Allocate page headers cache, ZEROED OUT */
-  nPages = nMB << (20 - BLOCKBITS); 
-  chunkvar.nCacheEntries = nPages / RLCACHE_RATIO;
-  if (chunkvar.nCacheEntries < 117)
-    chunkvar.nCacheEntries = 117;
-  sz = chunkvar.nCacheEntries * sizeof(RLCENTRY);
+  /* block indices must fit in the partial lists' top words */
+  mokAssert( blkvar.nBlocks < PL_INDEX_MASK );
+
+  /* Allocate the recycled lists cache, ZEROED OUT, and its stack */
+  sz = blkvar.nBlocks * sizeof(RLCENTRY);
   chunkvar.rlCache = (RLCENTRY*)mokMemReserve( NULL, sz );
   mokMemCommit( chunkvar.rlCache, sz, true );
+  sz = blkvar.nBlocks * sizeof(RLCENTRY*);
+  chunkvar.rlDirty = (RLCENTRY**)mokMemReserve( NULL, sz );
+  mokMemCommit( chunkvar.rlDirty, sz, false );
+  chunkvar.nDirty = 0;
 }
 \end{verbatim}
 \end{rawcfig}
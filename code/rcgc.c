@@ -9,6 +9,8 @@ static void _snoopThreadLocals( sys_thread_t* t );
 static void _incrementHandleRC( void * h);
 static void _traceSetup(void);
 static void _freeHandle(GCHandle* h);
+static void _applyPendingOptions(void);
+static void _wakeStalled( bool cycleDone );
 
 /************** Debug Prints ********************/
 static FILE *fDbg;
@@ -99,8 +101,18 @@ static uint* _allocFreshBuff(void)
 {
   uint *bf;
   
+#ifdef RCLP64
+  /* carve it out of the arena, links are logged as offsets into it */
+  bf = (uint*)InterlockedExchangeAdd64( (volatile LONG64*)&gcvar.buffArenaTop, 
+                                        BUFFSIZE );
+  if ((byte*)bf + BUFFSIZE > gcvar.logBuffBase + sizeof(uint) + BUFF_ARENA_SIZE)
+    bf = NULL;
+  else
+    mokMemCommit( bf, BUFFSIZE, false );
+#else
   bf = (uint*)mokMemReserve( NULL, BUFFSIZE );
   mokMemCommit( bf, BUFFSIZE, false );
+#endif
   if (!bf) {
     jio_printf("YLRC: out of log buffers space\n");
     fflush( stdout );
@@ -142,13 +154,13 @@ static uint* _allocBuff(ExecEnv *ee)
     mokAssert( bf[USED_IDX] == Im_free );
     bf[USED_IDX] = Im_used;
 #endif // RCDEBUG
-    buffList = (unsigned*)bf[LINKED_LIST_IDX];
+    buffList = LOG_TO_LINK(bf[LINKED_LIST_IDX]);
     _buffListLockExit( (unsigned)ee );
   }
  checkout:
   if (ee != gcvar.ee) {
     gcvar.nChunksAllocatedRecentlyByUser++; // allow inaccuracy due to race condition
-    if (gcvar.nChunksAllocatedRecentlyByUser >= gcvar.opt.userBuffTrig 
+    if (gcvar.nChunksAllocatedRecentlyByUser >= gcvar.buffTrig 
         && gcvar.initialized
         && !gcvar.gcActive) {
 #ifdef RCVERBOSE
@@ -170,7 +182,7 @@ static void _freeBuff( ExecEnv *ee, uint* buff)
 #endif 
 
   _buffListLockEnter( (unsigned)ee );
-  buff[LINKED_LIST_IDX] = (uint)buffList;
+  buff[LINKED_LIST_IDX] = LOG_LINK(buffList);
   buffList = buff;
   gcvar.nFreeChunks++;
   gcvar.nUsedChunks--;
@@ -203,13 +215,13 @@ GCEXPORT void gcBuffAllocAndLink(ExecEnv* ee, BUFFHDR *bh)
   _initBuffReservedSlots( ee, newBuff );
 
   /* backword link */
-  newBuff[N_RESERVED_SLOTS] = ((uint)bh->pos) | BUFF_LINK_MARK;
+  newBuff[N_RESERVED_SLOTS] = LOG_LINK(bh->pos) | BUFF_LINK_MARK;
 
   /* forward link */
   /* from the current position to the new chunk */
-  *bh->pos = ((uint)&newBuff[N_RESERVED_SLOTS]) | BUFF_LINK_MARK;
+  *bh->pos = LOG_LINK(&newBuff[N_RESERVED_SLOTS]) | BUFF_LINK_MARK;
   /* from the beginning of the current buffer to the next buffer */
-  bh->currBuff[NEXT_BUFF_IDX] = (uint)newBuff;
+  bh->currBuff[NEXT_BUFF_IDX] = LOG_LINK(newBuff);
 
     
   /* update record */
@@ -233,7 +245,7 @@ static void buffInit(ExecEnv *ee, BUFFHDR *bh)
   _initBuffReservedSlots( ee, bh->start );
 
   /* backword link */
-  bh->start[N_RESERVED_SLOTS] = ((unsigned)NULL) | BUFF_LINK_MARK;
+  bh->start[N_RESERVED_SLOTS] = LOG_LINK(NULL) | BUFF_LINK_MARK;
   bh->pos = &bh->start[N_RESERVED_SLOTS+1];
   bh->limit = bh->start + BUFFSIZE/sizeof(uint);
   bh->limit -= 3; /* for the handle, forward pointer and reserved snoop */
@@ -248,7 +260,7 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
 {
   int avail;
   GCHandle **objslots;
-  GCHandle **p;
+  uint *p;
   ClassClass *cb;
   BUFFHDR *bh;
 
@@ -268,12 +280,12 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
       objslots = (GCHandle**)(((char*)unhand(h))-1);
             
       mokAssert( objslots && h && bh && ee && offs && nrefs>0);
-      p = (GCHandle**)bh->pos;
-      avail = bh->limit - (uint*)p;
+      p = bh->pos;
+      avail = bh->limit - p;
       if (nrefs > avail) {
         ee->gcblk.cantCoop = false;
         gcBuffAllocAndLink( ee, bh );
-        p = (GCHandle**)bh->pos;
+        p = bh->pos;
 #ifdef RCDEBUG
         avail = bh->limit - bh->pos;
         mokAssert( nrefs <= avail );
@@ -288,7 +300,7 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
         
         child = *(GCHandle**)(slot + (char*)objslots);
         if (child) {
-          *p = child;
+          *p = LOG_HANDLE(child);
           p++;
 #ifdef RCDEBUG
           nLoggedChilds++; // increment counter of logged slots
@@ -307,12 +319,12 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
     mokAssert( obj_flags(h) == T_CLASS);     /* an array of classes */
     mokAssert( n > 0 );
 
-    p = (GCHandle**)bh->pos;
-    avail = bh->limit - (uint*)p;
+    p = bh->pos;
+    avail = bh->limit - p;
     if (n > avail) {
       ee->gcblk.cantCoop = false;
       gcBuffAllocAndLink( ee, bh );
-      p = (GCHandle**)bh->pos;
+      p = bh->pos;
 #ifdef RCDEBUG
       avail = bh->limit - bh->pos;
       mokAssert( n <= avail );
@@ -323,7 +335,7 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
       GCHandle *child = *body;
       body++;
       if (child) {
-        *p = child;
+        *p = LOG_HANDLE(child);
         p++;
 #ifdef RCDEBUG
         nLoggedChilds++; // increment counter of logged slots
@@ -334,14 +346,14 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
 
   /* commit ? or discard ? */
   if (!h->logPos) { /* commit */
-    *p = (GCHandle*)(BUFF_HANDLE_MARK | (unsigned)h);
+    *p = BUFF_HANDLE_MARK | LOG_HANDLE(h);
     /*
      * actually the order of instructions here
      * should be reversed in order to enable
      * async reading of buffers.
      */
-    h->logPos = (uint*)p;
-    bh->pos = (unsigned*)(p+1);
+    h->logPos = p;
+    bh->pos = p+1;
 #ifdef RCDEBUG
     // increment counters of logged slots
     bh->start[LOG_CHILDS_IDX] += nLoggedChilds;
@@ -352,6 +364,28 @@ GCEXPORT void gcBuffSlowConditionalLogHandle(ExecEnv* ee, GCHandle *h)
 #pragma optimize( "", on )
 
 
+/*
+ * Log the objects of the list's block from createStart up to
+ * createTop as a range, if there are any.  There must be room for
+ * two words, and "ee" must not cooperate meanwhile.
+ */
+static void _logCreateRange(BUFFHDR *bh, ALLOCLIST *allocList)
+{
+  byte *start = allocList->createStart;
+  byte *top = allocList->createTop;
+
+  if (start == top)
+    return;
+  mokAssert( bh->limit - bh->pos >= 2 );
+  bh->pos[0] = BUFF_HANDLE_MARK | LOG_HANDLE(start);
+  bh->pos[1] = BUFF_DUP_HANDLE_MARK | LOG_HANDLE(top);
+  bh->pos += 2;
+  allocList->createStart = top;
+#ifdef RCDEBUG
+  bh->start[LOG_OBJECTS_IDX] += (top - start) / allocList->objSize;
+#endif // RCDEBUG
+}
+
 #ifdef RCNOINLINE
 
 GCEXPORT void gcBuffConditionalLogHandle(ExecEnv* ee, GCHandle *h)
@@ -396,7 +430,7 @@ GCEXPORT void gcBuffLogNewHandle(ExecEnv *ee, GCHandle *h)
   bh = &ee->gcblk.createBuffer;
 
   ee->gcblk.cantCoop = true;
-  *bh->pos = (uint)h;
+  *bh->pos = LOG_HANDLE(h);
   h->logPos = bh->pos;
   bh->pos++;
 #ifdef RCDEBUG
@@ -410,6 +444,41 @@ GCEXPORT void gcBuffLogNewHandle(ExecEnv *ee, GCHandle *h)
   mokAssert( gcNonNullValidHandle(h) );
 }
 
+/*
+ * Count in an object bumped out of the list's block.  Once the
+ * block is used up, the range of objects not yet logged goes into
+ * the create buffer.
+ */
+GCEXPORT void gcBuffLogBumpedHandle(ExecEnv *ee, ALLOCLIST *allocList, 
+                                    GCHandle *h)
+{
+  BUFFHDR *bh;
+  byte    *top = (byte*)h + allocList->objSize;
+
+  mokAssert( ee );
+  mokAssert( allocList->createTop == (byte*)h );
+
+  /* 
+   * HS1 logs the range up to createTop, so logPos must be set before
+   * the object is in it.
+   */
+  ee->gcblk.cantCoop = true;
+  h->logPos = LOG_IMPLICIT_POS;
+  _ReadWriteBarrier();
+  allocList->createTop = top;
+  ee->gcblk.cantCoop = false;
+  if (top < allocList->limit)
+    return;
+
+  bh = &ee->gcblk.createBuffer;
+  if (bh->limit - bh->pos < 2)
+    gcBuffAllocAndLink( ee, bh );
+  ee->gcblk.cantCoop = true;
+  _logCreateRange( bh, allocList );
+  ee->gcblk.cantCoop = false;
+  gcBuffReserveWord( ee, bh );
+}
+
 #endif /* RCNOINLINE */
 
 
@@ -441,6 +510,13 @@ GCFUNC bool _isHandle(void *h)
   if (status<OWNED || status>PARTIAL)
     return false;
 
+  /* not yet handed out by the bump cursor */
+  if (status==OWNED) {
+    byte *top = bhBumpTop( bah );
+    if (top && (byte*)h >= top)
+      return false;
+  }
+
 #ifdef RCDEBUG
   {
     int bin_idx = bhGet_bin_idx( bah );
@@ -449,17 +525,17 @@ GCFUNC bool _isHandle(void *h)
 #endif
   
   /* check if on same page or ALLOC_LIST terminator */
-  if ((uint)((GCHandle*)h)->logPos == (uint)ALLOC_LIST_NULL) return false;
-  if ( ((uint)h ^ (uint)((GCHandle*)h)->logPos) < BLOCKSIZE )
+  if ((haddr)((GCHandle*)h)->logPos == (haddr)ALLOC_LIST_NULL) return false;
+  if ( ((haddr)h ^ (haddr)((GCHandle*)h)->logPos) < BLOCKSIZE )
     return false;
 
 #ifdef RCDEBUG
   {
     uint val;
     uint *pos = ((GCHandle*)h)->logPos;
-    if (pos) {
+    if (pos && pos != LOG_IMPLICIT_POS) {
       val = *pos;
-      if ( (val & ~3) != (uint)h ) {
+      if ( LOG_TO_HANDLE(val) != (GCHandle*)h ) {
         /*
          * This is a problem only if we're the collctor,
          * this means that someone has garbaled the log, the
@@ -487,25 +563,77 @@ GCFUNC bool _isHandle(void *h)
 #ifndef RCDEBUG
 #define _putInNextZCT(h)\
 do { \
-  gcBuffLogWord( gcvar.ee, (&gcvar.nextZctBuff), (uint)h );\
+  gcBuffLogWord( gcvar.ee, (&gcvar.nextZctBuff), LOG_HANDLE(h) );\
 } while(0)
 #else
 static void _putInNextZCT(void *h)
 { 
-  gcBuffLogWord( gcvar.ee, (&gcvar.nextZctBuff), (uint)h );
+  gcBuffLogWord( gcvar.ee, (&gcvar.nextZctBuff), LOG_HANDLE(h) );
   gcvar.dbgpersist.nPendInCycle++;
 }
 #endif
 
 
-#define _markInZCT(h) H1BIT_Set( gcvar.zctBmp.entry, (unsigned)h )
-
-#define _markNotInZCT(h)  H1BIT_Clear( gcvar.zctBmp.entry, (unsigned)h )
+/*
+ * Per handle marks.  With RCCOMBINEDMETA the count, the ZCT mark and
+ * the local mark of a handle share a nibble, otherwise each one lives
+ * in a bitmap of its own.  With RCATOMICBMP they are updated through
+ * the atomic variants, for collector phases run by more than one
+ * thread.
+ */
+#ifdef RCCOMBINEDMETA
+#define _getInZCT(h,res)    HMETA_GetInlined( gcvar.metaBmp.entry, (haddr)h, HMETA_ZCT, res )
+#define _getRC(h,res)       HMETA_GetRCInlined( gcvar.metaBmp.entry, (haddr)h, res )
+#define _getLocal(h,res)    HMETA_GetInlined( gcvar.metaBmp.entry, (haddr)h, HMETA_LOCAL, res )
+#ifdef RCATOMICBMP
+#define _markInZCT(h)       HMETA_AtomicSet( gcvar.metaBmp.entry, (haddr)h, HMETA_ZCT )
+#define _markNotInZCT(h)    HMETA_AtomicClear( gcvar.metaBmp.entry, (haddr)h, HMETA_ZCT )
+#define _incRC(h)           do { uint __prev; _incRCRV(h, __prev); } while (0)
+#define _incRCRV(h,res)     HMETA_AtomicIncRVInlined( gcvar.metaBmp.entry, (haddr)h, res )
+#define _decRC(h,res)       HMETA_AtomicDecInlined( gcvar.metaBmp.entry, (haddr)h, res )
+#define _markLocal(h)       HMETA_AtomicSet( gcvar.metaBmp.entry, (haddr)h, HMETA_LOCAL )
+#define _clearLocal(h)      HMETA_AtomicClear( gcvar.metaBmp.entry, (haddr)h, HMETA_LOCAL )
+#else
+#define _markInZCT(h)       HMETA_Set( gcvar.metaBmp.entry, (haddr)h, HMETA_ZCT )
+#define _markNotInZCT(h)    HMETA_Clear( gcvar.metaBmp.entry, (haddr)h, HMETA_ZCT )
+#define _incRC(h)           HMETA_Inc( gcvar.metaBmp.entry, (haddr)h )
+#define _incRCRV(h,res)     HMETA_IncRVInlined( gcvar.metaBmp.entry, (haddr)h, res )
+#define _decRC(h,res)       HMETA_DecInlined( gcvar.metaBmp.entry, (haddr)h, res )
+#define _markLocal(h)       HMETA_Set( gcvar.metaBmp.entry, (haddr)h, HMETA_LOCAL )
+#define _clearLocal(h)      HMETA_Clear( gcvar.metaBmp.entry, (haddr)h, HMETA_LOCAL )
+#endif /* RCATOMICBMP */
+#else
+#define _getInZCT(h,res)    H1BIT_GetInlined( gcvar.zctBmp.entry, (haddr)h, res )
+#define _getRC(h,res)       H2BIT_GetInlined( gcvar.rcBmp.entry, (haddr)h, res )
+#define _getLocal(h,res)    H1BIT_GetInlined( gcvar.localsBmp.entry, (haddr)h, res )
+#ifdef RCATOMICBMP
+#define _markInZCT(h)       H1BIT_AtomicSet( gcvar.zctBmp.entry, (haddr)h )
+#define _markNotInZCT(h)    H1BIT_AtomicClear( gcvar.zctBmp.entry, (haddr)h )
+#define _incRC(h)           H2BIT_AtomicInc( gcvar.rcBmp.entry, (haddr)h )
+#define _incRCRV(h,res)     H2BIT_AtomicIncRVInlined( gcvar.rcBmp.entry, (haddr)h, res )
+#define _decRC(h,res)       H2BIT_AtomicDecInlined( gcvar.rcBmp.entry, (haddr)h, res )
+#define _markLocal(h)       H1BIT_AtomicSet( gcvar.localsBmp.entry, (haddr)h )
+#define _clearLocal(h)      H1BIT_AtomicClear( gcvar.localsBmp.entry, (haddr)h )
+#else
+#define _markInZCT(h)       H1BIT_Set( gcvar.zctBmp.entry, (haddr)h )
+#define _markNotInZCT(h)    H1BIT_Clear( gcvar.zctBmp.entry, (haddr)h )
+#define _incRC(h)           H2BIT_Inc( gcvar.rcBmp.entry, (haddr)h )
+#define _incRCRV(h,res)     H2BIT_IncRVInlined( gcvar.rcBmp.entry, (haddr)h, res )
+#define _decRC(h,res)       H2BIT_DecInlined( gcvar.rcBmp.entry, (haddr)h, res )
+#define _markLocal(h)       H1BIT_Set( gcvar.localsBmp.entry, (haddr)h )
+/* 
+ * This also resets the local mark of near by objects,
+ * but we don't care since we're turning everybody
+ * off.
+ */
+#define _clearLocal(h)      H1BIT_ClearByte( gcvar.localsBmp.entry, (haddr)h )
+#endif /* RCATOMICBMP */
+#endif /* RCCOMBINEDMETA */
 
 static bool _isInZCT(GCHandle *h)
 {
   bool res;
-  H1BIT_GetInlined( gcvar.zctBmp.entry, (unsigned)h, res );
+  _getInZCT( h, res );
   return res;
 }
 
@@ -513,29 +641,54 @@ static bool _isInZCT(GCHandle *h)
 GCFUNC uint gcGetHandleRC( GCHandle *h)
 {
   uint res;
-  H2BIT_GetInlined( gcvar.rcBmp.entry, (unsigned)h, res  );
+  _getRC( h, res );
   return res;
 }
 
+/*
+ * The sweep predicate: not referenced, not logged and not waiting in
+ * the ZCT.  The last test only matters when sweeping lazily, after
+ * _processLocalsIntoNextZCT() has dropped the local counts.
+ */
+GCFUNC bool gcIsHandleGarbage( GCHandle *h)
+{
+  return gcGetHandleRC(h)==0 && !h->logPos && !_isInZCT(h);
+}
+
+/* 
+ * A counter going from 2 to 3 is stuck, RC won't reclaim the object;
+ * the cost model needs their number.
+ */
+#ifdef RCATOMICBMP
+#define _noteIfStuck(prevRC) \
+  do { if ((prevRC)==2) InterlockedIncrement( &gcvar.cost.nStuck ); } while (0)
+#else
+#define _noteIfStuck(prevRC) \
+  do { if ((prevRC)==2) gcvar.cost.nStuck++; } while (0)
+#endif /* RCATOMICBMP */
+
 static void _incrementHandleRC( void  * h)
 {
-  H2BIT_Inc( gcvar.rcBmp.entry, (unsigned)h );
+  uint res;
+  _incRCRV( h, res );
+  _noteIfStuck( res );
 }
 
 static uint _incrementHandleRCWithReturnValue( void * h)
 {
   uint res;
-  H2BIT_IncRVInlined( gcvar.rcBmp.entry, (unsigned)h, res );
+  _incRCRV( h, res );
+  _noteIfStuck( res );
   return res;
 }
 
 static void _decrementHandleRCInUpdate( void * h)
 {
   uint prevRC;
-  H2BIT_DecInlined( gcvar.rcBmp.entry, (unsigned)h, prevRC );
+  _decRC( h, prevRC );
   if (prevRC==1 && !_isInZCT(h)) {
     _markInZCT( h );
-    gcBuffLogWord( gcvar.ee, &gcvar.zctBuff, (uint)h );
+    gcBuffLogWord( gcvar.ee, &gcvar.zctBuff, LOG_HANDLE(h) );
 #ifdef RCDEBUG
     gcvar.dbg.nInZct++;
     gcvar.dbg.nUpdate2ZCT++;
@@ -573,7 +726,7 @@ static void _enlargeZctStack(void)
 static void _decrementHandleRCInDeletion(void *child)
 {
   uint prevRC;
-  H2BIT_DecInlined( gcvar.rcBmp.entry, (unsigned)child, prevRC );
+  _decRC( child, prevRC );
   mokAssert( !_isInZCT(child) );
   mokAssert( prevRC > 0 );
   if (prevRC==1) {
@@ -601,7 +754,7 @@ static void _putInMarkStack(void *h)
 static void _decrementLocalHandleRC(void *h)
 {
   uint prevRC;
-  H2BIT_DecInlined( gcvar.rcBmp.entry, (unsigned)h, prevRC );
+  _decRC( h, prevRC );
   mokAssert( !_isInZCT(h) );
   mokAssert( prevRC > 0 );
   if (prevRC==1) {
@@ -615,16 +768,16 @@ static void _decrementLocalHandleRC(void *h)
 static bool _isLocal(void *h)
 {
   uint res;
-  H1BIT_GetInlined( gcvar.localsBmp.entry, (unsigned)h, res );
+  _getLocal( h, res );
   return res;
 }
 
 static void _setLocal(void *h)
 {
   if (!_isLocal(h)) {
-    H1BIT_Set( gcvar.localsBmp.entry, (unsigned)h);
+    _markLocal( h );
     _incrementHandleRC(h);
-    gcBuffLogWord( gcvar.ee, (&gcvar.uniqueLocalsBuff), (uint)h );
+    gcBuffLogWord( gcvar.ee, (&gcvar.uniqueLocalsBuff), LOG_HANDLE(h) );
 #ifdef RCDEBUG
     gcvar.dbg.nLocals++;
 #endif
@@ -634,11 +787,7 @@ static void _setLocal(void *h)
 
 static void _unsetLocal(void *h)
 {
-  /* This also resets the local mark of near by objects,
-   * but we don't care since we're turning everybody
-   * off.
-   */
-  H1BIT_ClearByte( gcvar.localsBmp.entry, (unsigned)h);
+  _clearLocal( h );
 }
 
 
@@ -660,6 +809,8 @@ static int _setSnoopFlagHelper(sys_thread_t * thrd, void *dummy)
 static int _HS1Helper(sys_thread_t *thrd, bool *allOK)
 {
   ExecEnv *ee;
+  uint *rangePos;
+  int i;
 
   ee = SysThread2EE( thrd );
 
@@ -675,6 +826,9 @@ static int _HS1Helper(sys_thread_t *thrd, bool *allOK)
     buffInit( gcvar.ee, &gcvar.preAllocatedBuffers[gcvar.nPreAllocatedBuffers] );
     gcvar.nPreAllocatedBuffers++;
   }
+  /* room for a range per allocation list */
+  if (gcvar.rangeBuff.limit - gcvar.rangeBuff.pos < 2*N_BINS)
+    gcBuffAllocAndLink( gcvar.ee, &gcvar.rangeBuff );
 
   mokThreadSuspendForGC( thrd );
   mokAssert(ee->gcblk.stage==GCHS4);
@@ -690,6 +844,18 @@ static int _HS1Helper(sys_thread_t *thrd, bool *allOK)
   gcvar.dbg.nCreateObjects += ee->gcblk.createBuffer.start[LOG_OBJECTS_IDX];
 #endif // RCDEBUG
 
+  /* 
+   * Objects bumped out of blocks which are still in use are logged
+   * as ranges into the collector's own buffer.  Objects the thread
+   * has yet to count in are left to the next cycle.
+   */
+  rangePos = gcvar.rangeBuff.pos;
+  for (i=0; i<N_BINS; i++)
+    _logCreateRange( &gcvar.rangeBuff, &ee->gcblk.allocLists[i] );
+
+  /* the blocks the thread keeps in its cache go back, once it runs */
+  blkDrainThreadCache( ee );
+
   /* now steal the buffers (if they were modified) */
 
   if (buffIsModified(&ee->gcblk.createBuffer)) {
@@ -698,16 +864,16 @@ static int _HS1Helper(sys_thread_t *thrd, bool *allOK)
     /* make sure the second entry in the buffer points to
      * the last entry
      */
-    ee->gcblk.createBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.createBuffer.pos;
+    ee->gcblk.createBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.createBuffer.pos);
     /* the first entry is the linked list pointer */
-    ee->gcblk.createBuffer.start[LINKED_LIST_IDX] = (uint)gcvar.createBuffList;
+    ee->gcblk.createBuffer.start[LINKED_LIST_IDX] = LOG_LINK(gcvar.createBuffList);
     gcvar.createBuffList = ee->gcblk.createBuffer.start;
     /* give the thread new buffers to play with */
     gcvar.nPreAllocatedBuffers--;
     ee->gcblk.createBuffer = gcvar.preAllocatedBuffers[gcvar.nPreAllocatedBuffers];
   }
 #ifdef RCDEBUG
-  else {
+  else if (gcvar.rangeBuff.pos == rangePos) {
     mokAssert( ee->gcblk.dbg.nBytesAllocatedInCycle==0 );
     mokAssert( ee->gcblk.dbg.nRefsAllocatedInCycle==0 );
   }
@@ -716,8 +882,8 @@ static int _HS1Helper(sys_thread_t *thrd, bool *allOK)
   if (buffIsModified(&ee->gcblk.updateBuffer)) {
     /* do the same for the update buffer */
     *ee->gcblk.updateBuffer.pos = 0;
-    ee->gcblk.updateBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.updateBuffer.pos;
-    ee->gcblk.updateBuffer.start[LINKED_LIST_IDX] = (uint)gcvar.updateBuffList;
+    ee->gcblk.updateBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.updateBuffer.pos);
+    ee->gcblk.updateBuffer.start[LINKED_LIST_IDX] = LOG_LINK(gcvar.updateBuffList);
     gcvar.updateBuffList = ee->gcblk.updateBuffer.start;
     gcvar.nPreAllocatedBuffers--;
     ee->gcblk.updateBuffer = gcvar.preAllocatedBuffers[gcvar.nPreAllocatedBuffers];
@@ -750,6 +916,7 @@ static void _Initiate_Collection_Cycle(void)
   bool allOK;
 
   mokAssert( gcvar.stage == GCHS4);
+  mokAssert( !chunkvar.lazySweepActive );
 
   // if (gcvar.
   /* raise snoop flags */
@@ -793,7 +960,21 @@ static void _Initiate_Collection_Cycle(void)
     mokSleep( 10 );
   }
 
+  /* the ranges logged on behalf of the threads go in as well */
+  if (buffIsModified(&gcvar.rangeBuff)) {
+#ifdef RCDEBUG
+    gcvar.dbg.nCreateObjects += gcvar.rangeBuff.start[LOG_OBJECTS_IDX];
+#endif
+    *gcvar.rangeBuff.pos = 0;
+    gcvar.rangeBuff.start[LAST_POS_IDX] = LOG_LINK(gcvar.rangeBuff.pos);
+    gcvar.rangeBuff.start[LINKED_LIST_IDX] = LOG_LINK(gcvar.createBuffList);
+    gcvar.createBuffList = gcvar.rangeBuff.start;
+    buffInit( gcvar.ee, &gcvar.rangeBuff );
+  }
+
   QUEUE_UNLOCK( gcvar.sys_thread );
+
+  blkFreeDrainedBlocks();
 }
 #pragma optimize( "", on  )
 
@@ -810,7 +991,7 @@ static void _clearFlagsInUpdateBuffer(uint *p)
   mokAssert( p );
 
 
-  p = (uint*)p[LAST_POS_IDX];
+  p = LOG_TO_LINK(p[LAST_POS_IDX]);
   mokAssert( ! *p );
   p--;
   mokAssert( *p );
@@ -818,7 +999,7 @@ static void _clearFlagsInUpdateBuffer(uint *p)
   for (;;) {
     type = *p & 3;
   next_entry:
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
 #ifdef RCDEBUG
     /* 
      *the one and only entry which
@@ -870,7 +1051,7 @@ static void _clearFlagsInUpdateBuffer(uint *p)
 #endif
         return;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; // skip forward pointer
       break;
     }
@@ -891,7 +1072,7 @@ static void _clearFlagsInUpdateBuffer(uint *p)
         mokAssert( gcNonNullValidHandle(h) );
         h->logPos = NULL; /* clear dirty flag */
       } else {
-        *p = BUFF_DUP_HANDLE_MARK | (uint)h;
+        *p = BUFF_DUP_HANDLE_MARK | LOG_HANDLE(h);
 #ifdef RCDEBUG
         gcvar.dbg.nUpdateDuplicates++;
 #endif
@@ -908,7 +1089,7 @@ static void _clearFlagsInUpdateBufferList(void)
   uint *buffList = gcvar.updateBuffList;
   while (buffList) {
     _clearFlagsInUpdateBuffer( buffList );
-    buffList = (uint*)buffList[LINKED_LIST_IDX];
+    buffList = LOG_TO_LINK(buffList[LINKED_LIST_IDX]);
   }
 }
 
@@ -916,7 +1097,7 @@ static void _clearFlagsInUpdateBufferList(void)
 static void _clearFlagsInCreateBuffer(uint *p)
 {
 #ifdef RCDEBUG
-  uint *last_entry = (uint*)p[LAST_POS_IDX];
+  uint *last_entry = LOG_TO_LINK(p[LAST_POS_IDX]);
 #endif
 
   mokAssert( p );
@@ -925,9 +1106,8 @@ static void _clearFlagsInCreateBuffer(uint *p)
   p++; /* skip the first back pointer */
 
   for (;;) {
-    uint *ptr = (uint*)(*p & ~3);
+    uint *ptr = LOG_TO_PTR(*p);
     uint type = *p & 3;
-    mokAssert( type != BUFF_HANDLE_MARK);
     mokAssert( type != BUFF_DUP_HANDLE_MARK);
 #ifdef RCDEBUG
     /* 
@@ -958,9 +1138,26 @@ static void _clearFlagsInCreateBuffer(uint *p)
 #endif
       p++;
     }
+    else if (type==BUFF_HANDLE_MARK) { /* a range of bumped objects */
+      byte *o = (byte*)ptr;
+      byte *end = (byte*)LOG_TO_HANDLE(p[1]);
+      int  sz = LOG_RANGE_OBJSIZE( o );
+
+      mokAssert( (p[1] & 3) == BUFF_DUP_HANDLE_MARK );
+      for (; o < end; o += sz) {
+        GCHandle *h = (GCHandle*)o;
+        mokAssert( gcValidHandle(h) );
+        mokAssert( h->logPos == LOG_IMPLICIT_POS );
+        h->logPos = NULL; /* clear dirty mark */
+#ifdef RCDEBUG
+        gcvar.dbg.nActualCreateObjects++;
+#endif
+      }
+      p += 2;
+    }
     else { /*type==BUFF_LINK_MARK*/
       mokAssert( ptr );
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       mokAssert( (LOWBUFFMASK & (uint)ptr) == N_RESERVED_SLOTS*sizeof(uint));
       p = ptr+1;
     }
@@ -974,7 +1171,7 @@ static void _clearFlagsInCreateBufferList( void )
   uint *buffList = gcvar.createBuffList;
   while (buffList) {
     _clearFlagsInCreateBuffer( buffList );
-    buffList = (uint*)buffList[LINKED_LIST_IDX];
+    buffList = LOG_TO_LINK(buffList[LINKED_LIST_IDX]);
   }
 }
 
@@ -1045,7 +1242,7 @@ static int _HS2Helper(sys_thread_t *thrd, bool *allOK)
   }
 
   /* mark current position in the buffer */
-  ee->gcblk.updateBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.updateBuffer.pos;
+  ee->gcblk.updateBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.updateBuffer.pos);
   /* 
    * link the buffer into the reinforce buff
    * list.  Note that the buffer stays at the
@@ -1057,7 +1254,7 @@ static int _HS2Helper(sys_thread_t *thrd, bool *allOK)
    * stage.
    */
   ee->gcblk.updateBuffer.start[REINFORCE_LINKED_LIST_IDX] = 
-    (uint)gcvar.reinforceBuffList;
+    LOG_LINK(gcvar.reinforceBuffList);
   gcvar.reinforceBuffList = ee->gcblk.updateBuffer.start;
 
 #ifdef RCDEBUG
@@ -1103,7 +1300,7 @@ static void _reinforceUpdateBuffer( uint *p, uint *limit )
   p++; /* skip the first back pointer */
 
   for (;;) {
-    uint *ptr = (uint*)(*p & ~3);
+    uint *ptr = LOG_TO_PTR(*p);
     uint type = *p & 3;
 #ifdef DEBUG
     if (!ptr)
@@ -1115,7 +1312,7 @@ static void _reinforceUpdateBuffer( uint *p, uint *limit )
     switch (type) {
     case BUFF_LINK_MARK: {
       mokAssert( ptr );
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       mokAssert( (LOWBUFFMASK & (uint)ptr) == N_RESERVED_SLOTS*sizeof(uint));
       p = ptr+1; /* skip backward pointer */
       break;
@@ -1263,9 +1460,9 @@ static void _Reinforce_Clearing_Conflict_Set(void)
 
   while ( gcvar.reinforceBuffList ) {
     uint *p = gcvar.reinforceBuffList;
-    uint *limit = (uint*)gcvar.reinforceBuffList[LAST_POS_IDX];
+    uint *limit = LOG_TO_LINK(gcvar.reinforceBuffList[LAST_POS_IDX]);
     _reinforceUpdateBuffer( p, limit );
-    gcvar.reinforceBuffList = (uint*)p[REINFORCE_LINKED_LIST_IDX];
+    gcvar.reinforceBuffList = LOG_TO_LINK(p[REINFORCE_LINKED_LIST_IDX]);
   }
 
   /* do third handshake */
@@ -1310,7 +1507,7 @@ static void _markHandlesInSnoopBufferAsLocal(uint *buff)
   mokAssert( buff );
 
   /* go backwards */
-  p = (uint*)buff[LAST_POS_IDX];
+  p = LOG_TO_LINK(buff[LAST_POS_IDX]);
   mokAssert( p );
   mokAssert( *p==0 );
   p--;
@@ -1318,7 +1515,7 @@ static void _markHandlesInSnoopBufferAsLocal(uint *buff)
 
 
   for (;;) {
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     type = *p & 3;
     mokAssert( type != BUFF_HANDLE_MARK );
     mokAssert( type != BUFF_DUP_HANDLE_MARK );
@@ -1344,7 +1541,7 @@ static void _markHandlesInSnoopBufferAsLocal(uint *buff)
       _freeBuff( gcvar.ee, p - N_RESERVED_SLOTS);
       if (!ptr)
         return;
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
     }
 
@@ -1605,8 +1802,8 @@ static int _HS4Helper( sys_thread_t *thrd, bool *allOK )
   /* now steal the snooped objects set */
   if (buffIsModified(&ee->gcblk.snoopBuffer)) {
     *ee->gcblk.snoopBuffer.pos = 0;
-    ee->gcblk.snoopBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.snoopBuffer.pos;
-    ee->gcblk.snoopBuffer.start[LINKED_LIST_IDX] = (uint)gcvar.snoopBuffList;
+    ee->gcblk.snoopBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.snoopBuffer.pos);
+    ee->gcblk.snoopBuffer.start[LINKED_LIST_IDX] = LOG_LINK(gcvar.snoopBuffList);
     gcvar.snoopBuffList = ee->gcblk.snoopBuffer.start;
     
 #ifdef RCDEBUG
@@ -1840,15 +2037,15 @@ static void _determineHandleContents(GCHandle *h)
   p = h->logPos;
   
   if (p) {
-    mokAssert( h == (GCHandle*)(*p^BUFF_HANDLE_MARK) );
+    mokAssert( h == LOG_TO_HANDLE(*p) );
 #ifdef RCDEBUG
     gcvar.dbg.nUndetermined++;
 #endif // RCDEBUG
     p--;
     while (1) {
-      GCHandle *hSon = (GCHandle*)*p;
+      GCHandle *hSon = LOG_TO_HANDLE(*p);
       uint type = 3 & *p;
-      mokAssert( hSon );
+      mokAssert( *p );
       if (type) return;
       _incrementHandleRC( hSon );
       p--;
@@ -1929,7 +2126,7 @@ static void _updateRCofSingleUpdateLog(uint *buff)
    * so we want to first see the handle and
    * only then its contents.
    */
-  p = (uint*)buff[LAST_POS_IDX];
+  p = LOG_TO_LINK(buff[LAST_POS_IDX]);
 
   mokAssert( p );
   mokAssert( *p==0 );
@@ -1940,7 +2137,7 @@ static void _updateRCofSingleUpdateLog(uint *buff)
   for (;;) {
     type = *p & 3;
   next_round:
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     mokAssert( type != 0 );
     switch (type) {
     case BUFF_LINK_MARK: {
@@ -1951,7 +2148,7 @@ static void _updateRCofSingleUpdateLog(uint *buff)
         mokAssert( buff+N_RESERVED_SLOTS == p);
         return;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
       break;
     }
@@ -1967,8 +2164,8 @@ static void _updateRCofSingleUpdateLog(uint *buff)
       for(;;) {
         GCHandle *h;
         p--;
-        h = (GCHandle*)*p;
-        type = ((uint)h) &3;
+        type = *p & 3;
+        h = LOG_TO_HANDLE(*p);
         if (type) goto next_round;
         mokAssert( gcNonNullValidHandle(h) );
         _decrementHandleRCInUpdate( h );
@@ -2005,17 +2202,16 @@ static void _updateRCofSingleCreateLog(uint *buff)
 
   mokAssert( buff );
 
-  p = (uint*)buff[LAST_POS_IDX];
+  p = LOG_TO_LINK(buff[LAST_POS_IDX]);
   mokAssert( p );
   mokAssert( *p == 0 );
   p--;
   mokAssert( *p );
 
   for (;;) {
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     type = *p & 3;
     mokAssert( type != BUFF_HANDLE_MARK );
-    mokAssert( type != BUFF_DUP_HANDLE_MARK );
 
     if (type==0) {
       GCHandle *h = (GCHandle*)ptr;
@@ -2027,13 +2223,28 @@ static void _updateRCofSingleCreateLog(uint *buff)
 #endif // RCDEBUG
       p--;
     }
+    else if (type==BUFF_DUP_HANDLE_MARK) { /* the end of a range */
+      byte *o = (byte*)LOG_TO_HANDLE(p[-1]);
+      int  sz = LOG_RANGE_OBJSIZE( o );
+
+      mokAssert( (p[-1] & 3) == BUFF_HANDLE_MARK );
+      for (; o < (byte*)ptr; o += sz) {
+        GCHandle *h = (GCHandle*)o;
+        mokAssert( gcNonNullValidHandle(h) );
+        _determineHandleContents( h );
+#ifdef RCDEBUG
+        gcvar.dbg.nCreateRCObjects++;
+#endif // RCDEBUG
+      }
+      p -= 2;
+    }
     else { /* type==BUFF_LINK_MARK*/
       mokAssert( (LOWBUFFMASK & (uint)p) == N_RESERVED_SLOTS*sizeof(uint));
       if (!ptr) {
         mokAssert( buff+N_RESERVED_SLOTS == p);
         return;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
     }
   }
@@ -2125,7 +2336,7 @@ static void _throwNonZerosFromCurrentZCT( BUFFHDR *tmpZCT )
   mokAssert( *p );
   
   for (;;) {
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     type = *p & 3;
     mokAssert( type != BUFF_HANDLE_MARK );
     mokAssert( type != BUFF_DUP_HANDLE_MARK );
@@ -2148,7 +2359,7 @@ static void _throwNonZerosFromCurrentZCT( BUFFHDR *tmpZCT )
 #ifdef RCDEBUG
         nDel++;
 #endif 
-        gcBuffLogWord( gcvar.ee, tmpZCT, (unsigned)h );
+        gcBuffLogWord( gcvar.ee, tmpZCT, LOG_HANDLE(h) );
       }
       p--;
     }
@@ -2160,7 +2371,7 @@ static void _throwNonZerosFromCurrentZCT( BUFFHDR *tmpZCT )
         mokAssert( buff+N_RESERVED_SLOTS == p);
         goto __end;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
     }
   }
@@ -2209,43 +2420,56 @@ static void _processCreateBuffsIntoZCT( void )
     mokAssert( (((uint)buff) & LOWBUFFMASK) == 0);
     mokAssert( buff );
 
-    p = (uint*)buff[LAST_POS_IDX];
+    p = LOG_TO_LINK(buff[LAST_POS_IDX]);
     mokAssert( p );
     mokAssert( *p == 0 );
     p--;
     mokAssert( *p );
 
     for        (;;) {
-      ptr = (uint*)(*p & ~3);
+      ptr = LOG_TO_PTR(*p);
       type = *p & 3;
       mokAssert( type != BUFF_HANDLE_MARK );
-      mokAssert( type != BUFF_DUP_HANDLE_MARK );
-      if (type==0) {
-        GCHandle *h = (GCHandle*)ptr;
+      if (type==0 || type==BUFF_DUP_HANDLE_MARK) {
+        /* a single object, or the end of a range of bumped objects */
+        byte *o = (byte*)ptr;
+        byte *end = o + 1;
+        int  sz = 1;
+
+        if (type==BUFF_DUP_HANDLE_MARK) {
+          mokAssert( (p[-1] & 3) == BUFF_HANDLE_MARK );
+          end = o;
+          o = (byte*)LOG_TO_HANDLE(p[-1]);
+          sz = LOG_RANGE_OBJSIZE( o );
+          p--;
+        }
+        for (; o < end; o += sz) {
+          GCHandle *h = (GCHandle*)o;
 #ifdef RCDEBUG
-        nCreate++;
+          nCreate++;
 #endif 
-        mokAssert( h );
-        mokAssert( gcNonNullValidHandle(h) );
-        if (gcGetHandleRC(h) == 0) {
-          if (!_isInZCT(h)) {
-            _markInZCT( h );
+          mokAssert( h );
+          mokAssert( gcNonNullValidHandle(h) );
+          if (gcGetHandleRC(h) == 0) {
+            if (!_isInZCT(h)) {
+              _markInZCT( h );
 #ifdef RCDEBUG
-            nDel++;
+              nDel++;
 #endif 
-            gcBuffLogWord( gcvar.ee, tmpZCT, (unsigned)h );
+              gcBuffLogWord( gcvar.ee, tmpZCT, LOG_HANDLE(h) );
+            }
+#ifdef RCDEBUG
+            else {
+              nAlreadyInZct++;
+            }
+#endif // RCDEBUG
           }
 #ifdef RCDEBUG
           else {
-            nAlreadyInZct++;
+            nThrown++;
           }
 #endif // RCDEBUG
         }
-#ifdef RCDEBUG
-        else {
-          nThrown++;
-        }
-#endif // RCDEBUG
         p--;
       }
       else { /* type==BUFF_LINK_MARK*/
@@ -2256,7 +2480,7 @@ static void _processCreateBuffsIntoZCT( void )
           mokAssert( buff+N_RESERVED_SLOTS == p);
           goto __end_chunk;
         }
-        mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+        mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
         p = ptr-1; /* skip forward pointer */
       }
     }
@@ -2318,16 +2542,16 @@ static void _freeHandle(GCHandle* h)
     if (p) {
 #ifdef RCDEBUG
       dbgprn( 1, "\t\tfree:dirty: %x\n", h);
-      mokAssert( h == (GCHandle*)(*p^BUFF_HANDLE_MARK) );
+      mokAssert( h == LOG_TO_HANDLE(*p) );
       h->logPos = NULL;
       gcvar.dbgpersist.nFreeCyclesBroken++;
 #endif 
       *p = *p | BUFF_DUP_HANDLE_MARK;
       p--;
       while (1) {
-        GCHandle *child = (GCHandle*)*p;
+        GCHandle *child = LOG_TO_HANDLE(*p);
         uint type = 3 & *p;
-        mokAssert( child );
+        mokAssert( *p );
         if (type) break;
 #ifdef RCDEBUG
         dbgprn( 3, "\t\tfree:dirty:dec %x\n", child);
@@ -2432,7 +2656,7 @@ static void _freeHandlesOnTempZCT(BUFFHDR *tmpZCT)
   mokAssert( *p );
 
   for (;;) {
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     type = *p & 3;
     mokAssert( type != BUFF_DUP_HANDLE_MARK );
     mokAssert( type != BUFF_HANDLE_MARK );
@@ -2461,7 +2685,7 @@ static void _freeHandlesOnTempZCT(BUFFHDR *tmpZCT)
 #endif // RCDEBUG
         goto __end;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
     }
   }
@@ -2498,7 +2722,7 @@ static void _processLocalsIntoNextZCT( void)
   mokAssert( *p );
 
   for (;;) {
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     type = *p & 3;
     mokAssert( type != BUFF_DUP_HANDLE_MARK );
     mokAssert( type != BUFF_HANDLE_MARK );
@@ -2525,7 +2749,7 @@ static void _processLocalsIntoNextZCT( void)
 #endif
         goto checkout;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
     }
   }
@@ -2559,7 +2783,7 @@ static void _freeListOfBuffers( uint* buff )
 {
   while (buff) {
     uint *next;
-    next = (uint*)buff[NEXT_BUFF_IDX];
+    next = LOG_TO_LINK(buff[NEXT_BUFF_IDX]);
     _freeBuff( gcvar.ee, buff );
     buff = next;
   }
@@ -2570,7 +2794,7 @@ static void _freeListOfListsOfBuffers( uint *buff)
 {
   while (buff) {
     uint *next;
-    next = (uint*)buff[LINKED_LIST_IDX];
+    next = LOG_TO_LINK(buff[LINKED_LIST_IDX]);
     _freeListOfBuffers( buff );
     buff = next;
   }
@@ -2586,15 +2810,24 @@ static void _traceSetup( void )
   gcvar.updateBuffList = NULL;
 
   *gcvar.zctBuff.pos = 0;
-  gcvar.zctBuff.start[ LAST_POS_IDX ] = (int)gcvar.zctBuff.pos;
+  gcvar.zctBuff.start[ LAST_POS_IDX ] = LOG_LINK(gcvar.zctBuff.pos);
   _freeListOfBuffers( gcvar.zctBuff.start );
 
+#ifdef RCCOMBINEDMETA
+  /*
+   * Clear the counts and the ZCT marks.  Local marks are all clear
+   * at this point, _processLocalsIntoNextZCT() turned them off.
+   */
+  mokMemDecommit( gcvar.metaBmp.bmp, gcvar.metaBmp.bmp_size );
+  mokMemCommit( gcvar.metaBmp.bmp, gcvar.metaBmp.bmp_size, true );
+#else
   /* Decommit the "zct" bmp */
   mokMemDecommit( gcvar.zctBmp.bmp, gcvar.zctBmp.bmp_size );
 
   /*  Clear the "rc" bmp */
   mokMemDecommit( gcvar.rcBmp.bmp, gcvar.rcBmp.bmp_size );
   mokMemCommit( gcvar.rcBmp.bmp, gcvar.rcBmp.bmp_size, true );
+#endif
 }
 
 static void _scanHandle(GCHandle *h)
@@ -2626,12 +2859,12 @@ static void _markHandleSons(GCHandle *h)
       mokAssert( _isLocal(h) );
       return;
     }
-    mokAssert( h == (GCHandle*)(*p^BUFF_HANDLE_MARK) );
+    mokAssert( h == LOG_TO_HANDLE(*p) );
     p--;
     while (1) {
-      GCHandle *hSon = (GCHandle*)*p;
+      GCHandle *hSon = LOG_TO_HANDLE(*p);
       uint type = 3 & *p;
-      mokAssert( hSon );
+      mokAssert( *p );
       if (type) return;
       _scanHandle( hSon );
       p--;
@@ -2721,8 +2954,8 @@ static void _emptyMarkStack( void )
        * cycle.
        */
       uint *p = h->logPos;
-      if (p) {
-        mokAssert( h == (GCHandle*)(*p^BUFF_HANDLE_MARK) );
+      if (p && p != LOG_IMPLICIT_POS) {
+        mokAssert( h == LOG_TO_HANDLE(*p) );
       }
     }
 #endif
@@ -2744,7 +2977,7 @@ static void _traceFromLocals( void)
   mokAssert( *p );
 
   for (;;) {
-    ptr = (uint*)(*p & ~3);
+    ptr = LOG_TO_PTR(*p);
     type = *p & 3;
     mokAssert( type != BUFF_DUP_HANDLE_MARK );
     mokAssert( type != BUFF_HANDLE_MARK );
@@ -2768,7 +3001,7 @@ static void _traceFromLocals( void)
         mokAssert( buff+N_RESERVED_SLOTS == p);
         return;
       }
-      mokAssert( *ptr == BUFF_LINK_MARK|(uint)p );
+      mokAssert( *ptr == BUFF_LINK_MARK|LOG_LINK(p) );
       p = ptr-1; /* skip forward pointer */
     }
   }
@@ -2802,7 +3035,10 @@ static void _Sweep( void )
   dbgprn( 0, "_Sweep(start) time=%d\n", start );
 #endif
 
-  blkSweep();
+  if (gcvar.opt.lazySweep)
+    blkPrepareLazySweep();
+  else
+    blkSweep();
 
 #ifdef RCDEBUG
   end = GetTickCount();
@@ -2912,66 +3148,286 @@ GCFUNC void gcCheckGC(void)
     gcRequestAsyncGC();
 }
 
+/*
+ * Cost model for the choice of the next cycle's type.
+ *
+ * The phases up to _Consolidate() are common; what differs is the cost of
+ * the rest.  That of an RC cycle grows with the logs it processes, so it
+ * is kept per log buffer; that of a tracing cycle grows with the heap in
+ * use, so it is kept per used block.  Both are moving averages over the
+ * cycles of each type, and the estimates for the next cycle apply them to
+ * the latest log volume and heap occupancy.
+ *
+ * The tracing cost includes the sweep, also when it is done lazily after
+ * the cycle.
+ *
+ * RC doesn't recover cyclic garbage nor objects with stuck counters.  The
+ * blocks in use after an RC cycle beyond those in use after the last
+ * tracing cycle are taken as such garbage, and once they exceed
+ * COST_UNRECOVERED_PCT of the heap a tracing cycle is due whatever the
+ * estimates.  Stuck counters are counted as they stick; each RC cycle
+ * brings the tracing cycle which recovers them closer, so the RC estimate
+ * is charged the share of one that the counters it is expected to stick
+ * (at their rate per log buffer) are of COST_STUCK_PER_TRACE.  Once that
+ * many have stuck since the last tracing cycle one is due as well.  An
+ * estimate which hasn't been measured yet favours RC.
+ *
+ * The choice and its reason are kept in gcvar.cost, for gcGetCollectionChoice().
+ */
+#define COST_UNRECOVERED_PCT  10
+#define COST_WEIGHT           0.5f
+#define COST_STUCK_PER_TRACE  4096
+
+#define _costAverage( avg, x ) \
+  ((avg) = (avg) ? (avg)*(1-COST_WEIGHT) + (x)*COST_WEIGHT : (x))
+
+static void _updateCosts( int nNowFree )
+{
+  int nUsedAtStart = blkvar.nBlocks - gcvar.nFreeBlocksAtStart;
+  int nUsed = blkvar.nBlocks - nNowFree;
+
+  if (gcvar.collectionType == GCT_RCING) {
+    _costAverage( gcvar.cost.rcMsPerBuff, 
+                  (float)gcvar.cost.typeMs / (gcvar.cost.nBuffs ? gcvar.cost.nBuffs : 1) );
+    _costAverage( gcvar.cost.stuckPerBuff, 
+                  (float)gcvar.cost.nStuck / (gcvar.cost.nBuffs ? gcvar.cost.nBuffs : 1) );
+    gcvar.cost.nStuckSinceTrace += gcvar.cost.nStuck;
+    gcvar.cost.nUnrecovered = nUsed - gcvar.cost.nUsedAfterTrace;
+    if (gcvar.cost.nUnrecovered < 0)
+      gcvar.cost.nUnrecovered = 0;
+  }
+  else {
+    _costAverage( gcvar.cost.traceMsPerBlock, 
+                  (float)gcvar.cost.typeMs / (nUsedAtStart>0 ? nUsedAtStart : 1) );
+    gcvar.cost.nUsedAfterTrace = nUsed;
+    gcvar.cost.nUnrecovered = 0;
+    gcvar.cost.nStuckSinceTrace = 0;
+  }
+  gcvar.cost.estTrace = gcvar.cost.traceMsPerBlock * nUsed;
+  gcvar.cost.estRC = gcvar.cost.rcMsPerBuff * gcvar.cost.nBuffs +
+    gcvar.cost.estTrace * 
+    (gcvar.cost.stuckPerBuff * gcvar.cost.nBuffs) / COST_STUCK_PER_TRACE;
+}
+
 static int _recommendCollectionMethod(void)
 {
-  int    nSamples, i, t, m;
-  float  norm, avg[2], prob[2], r;
+  int m;
   
-  if (gcvar.opt.recommendOnlyRCGC)
+  if (gcvar.opt.recommendOnlyRCGC) {
+    gcvar.cost.reason = "option";
     return GCT_RCING;
+  }
 
-  for (t=0; t<2; t++) {
-    nSamples = 0;
-    avg[t] = 0;
-    for (i=0; i<N_SAMPLES; i++) {
-      if (gcvar.runHist[t][i]) {
-        avg[t] += gcvar.runHist[t][i];
-        nSamples++;
-      }
-      else break;
-    }
-    avg[t] = nSamples ? avg[t]/nSamples : 0;
+  if (gcvar.cost.nUnrecovered*100 > COST_UNRECOVERED_PCT*(int)blkvar.nBlocks) {
+    gcvar.cost.reason = "unrecovered";
+    m = GCT_TRACING;
   }
-  
-  printf( "***  _recommendCollectionMethod trace=%f rc=%f\n",
-          avg[GCT_TRACING], avg[GCT_RCING] );
+  else if (gcvar.cost.nStuckSinceTrace >= COST_STUCK_PER_TRACE) {
+    gcvar.cost.reason = "stuck";
+    m = GCT_TRACING;
+  }
+  else if (!gcvar.cost.rcMsPerBuff || !gcvar.cost.traceMsPerBlock) {
+    gcvar.cost.reason = "unmeasured";
+    m = GCT_RCING;
+  }
+  else if (gcvar.cost.estTrace < gcvar.cost.estRC) {
+    gcvar.cost.reason = "cheaper";
+    m = GCT_TRACING;
+  }
+  else {
+    gcvar.cost.reason = "cheaper";
+    m = GCT_RCING;
+  }
+  return m;
+}
 
-  if (avg[GCT_TRACING] < 0.001) return GCT_TRACING;
-  if (avg[GCT_RCING] < 0.001) return GCT_RCING;
+/*
+ * The type chosen for the next cycle and why, with the estimates of
+ * both types, in ms.
+ */
+GCEXPORT int gcGetCollectionChoice( const char **pReason,
+                                    float *pEstRC,
+                                    float *pEstTrace )
+{
+  *pReason = gcvar.cost.reason;
+  *pEstRC = gcvar.cost.estRC;
+  *pEstTrace = gcvar.cost.estTrace;
+  return gcvar.nextCollectionType;
+}
 
-  /* 
-   * Normalize so that prob ~ 1/avg
-   * and prob[0]+prob[1] == 1
-   */
-  norm = (avg[0] * avg[1]) / ( avg[0] + avg[1] );
-  prob[0] = norm / avg[0];
-  prob[1] = norm / avg[1];
+/*
+ * Pacer.
+ *
+ * With the pacer option the trigger is set from what was measured
+ * rather than moved up and down by fixed steps.  The allocation rate,
+ * in blocks handed out to threads per ms, is taken over the time from
+ * the end of a cycle to the end of the next, the log buffer rate from
+ * the start of a cycle to the start of the next, and a cycle lasts
+ * until its (lazy) sweep is over.  Each is a moving average.
+ *
+ * A cycle must start while enough blocks are free for the allocations
+ * it runs alongside, and leave pacerHeadroom percent of the heap free:
+ *
+ *     late = headroom + allocRate * cycleMs
+ *
+ * It is started PACER_MARGIN percent earlier than that, against load
+ * spikes.  With pacerBudget, the percentage of the time the collector
+ * may be busy, cycles are spaced by at least cycleMs*(100-budget)/budget
+ * and the margin is whatever that spacing leaves, from none up to a
+ * whole cycle's allocation.  The same spacing holds back the buffer
+ * trigger when the logs fill faster than the heap does.
+ */
+#define PACER_MARGIN  25
+#define PACER_WEIGHT  0.5f   /* of a new measure in the averages */
 
-  printf( "p[0]=%f p[1]=%f sum=%f\n", prob[0], prob[1], prob[0]+prob[1] );
-  r = (float)rand() / (float)RAND_MAX;
+#define _pacerAverage( avg, x ) \
+  ((avg) = (avg) ? (avg)*(1-PACER_WEIGHT) + (x)*PACER_WEIGHT : (x))
 
-  if (r < prob[0]) m = 0;
-  else m = 1;
+static void _pacerCycleStart(void)
+{
+  uint now = GetTickCount();
+  int  period = now - gcvar.pacer.cycleStart;
+
+  if (period <= 0) 
+    period = 1;
+  _pacerAverage( gcvar.pacer.buffRate, 
+                 (float)gcvar.nChunksAllocatedRecentlyByUser / period );
+  gcvar.pacer.cycleStart = now;
+}
 
-  printf("r=%f --> m=%d\n", r , m );
-  return m;
+static void _pace( int nNowFree )
+{
+  uint now = GetTickCount();
+  int  period = now - gcvar.pacer.lastEnd;
+  long handed = blkvar.nBlocksHandedOut;
+  float headroom, during, late, early, trig, minInterval;
+
+  if (period <= 0) 
+    period = 1;
+  _pacerAverage( gcvar.pacer.allocRate, 
+                 (float)(handed - gcvar.pacer.handedAtLastEnd) / period );
+  _pacerAverage( gcvar.pacer.cycleMs, (float)(now - gcvar.pacer.cycleStart) );
+  gcvar.pacer.lastEnd = now;
+  gcvar.pacer.handedAtLastEnd = handed;
+
+  headroom = (float)gcvar.opt.pacerHeadroom * blkvar.nBlocks / 100;
+  during = gcvar.pacer.allocRate * gcvar.pacer.cycleMs;
+  late = headroom + during;
+
+  if (gcvar.opt.pacerBudget > 0 && gcvar.opt.pacerBudget < 100) {
+    minInterval = gcvar.pacer.cycleMs * 
+      (100 - gcvar.opt.pacerBudget) / gcvar.opt.pacerBudget;
+    early = late + during;
+    trig = nNowFree - gcvar.pacer.allocRate * minInterval;
+    if (trig > early) trig = early;
+    if (trig < late)  trig = late;
+    gcvar.buffTrig = (uint)(gcvar.pacer.buffRate * minInterval);
+    if (gcvar.buffTrig < (uint)gcvar.opt.userBuffTrig)
+      gcvar.buffTrig = gcvar.opt.userBuffTrig;
+  }
+  else
+    trig = late + during * PACER_MARGIN / 100;
+
+  if (trig > (float)blkvar.nBlocks)
+    trig = (float)blkvar.nBlocks;
+  gcvar.gcTrigHigh = (int)trig;
+
+  jio_printf("**** pacer alloc=%.2f/ms buff=%.3f/ms cycle=%.0fms trig=%d buffTrig=%d\n",
+             gcvar.pacer.allocRate,
+             gcvar.pacer.buffRate,
+             gcvar.pacer.cycleMs,
+             gcvar.gcTrigHigh,
+             gcvar.buffTrig );
+  fflush( stdout );
 }
 
-static void _updateRunHist(int runTime)
+/*
+ * OK, now see where we stand and set the strategy for the
+ * next cycle.
+ */
+static void _adjustTriggers(void)
 {
-  int i;
-  int t = gcvar.collectionType;
+  int nNowFree, nLowMark, nWasFree = gcvar.nFreeBlocksAtStart;
+  int prevTrig;
+  bool  failed, gotIntoSync;
+
+  nNowFree = FREE_BLOCKS();
+  nLowMark = gcvar.gcTrigHigh + (gcvar.opt.lowTrigDelta * blkvar.nBlocks)/100;
+  
+  failed = nNowFree < nLowMark;
+  gotIntoSync = gcvar.memStress;
+  _updateCosts( nNowFree );
+
+  jio_printf("**** high=%d low=%d free=%d was=%d failed=%d sync=%d\n",
+             gcvar.gcTrigHigh,
+             nLowMark,
+             nNowFree,
+             nWasFree,
+             failed,
+             gotIntoSync
+             );
+  fflush( stdout );
 
-  for (i=N_SAMPLES-2; i>=0; i--)
-    gcvar.runHist[t][i+1] =  gcvar.runHist[t][i];
+  prevTrig = gcvar.gcTrigHigh;
 
-  gcvar.runHist[t][0] = runTime;
+  if (gcvar.collectionType == GCT_TRACING) {
+    if (gotIntoSync && failed) {
+      gcvar.nextCollectionType =  GCT_TRACING;
+      gcvar.gcTrigHigh -= (gcvar.opt.raiseTrigInc * blkvar.nBlocks)/100;
+    }
+    else if (gotIntoSync && !failed) {
+      gcvar.nextCollectionType =  GCT_TRACING;
+      gcvar.gcTrigHigh += (gcvar.opt.lowerTrigDec * blkvar.nBlocks)/100;
+    }
+    else if (!gotIntoSync && failed) {
+      gcvar.nextCollectionType =  GCT_TRACING;
+      gcvar.gcTrigHigh -= (gcvar.opt.raiseTrigInc * blkvar.nBlocks)/100;
+    }
+    else /* (!gotIntoSync && !failed) */ {
+      gcvar.nextCollectionType =  _recommendCollectionMethod();
+    }
+  }
+  else /*(gcvar.collectionType == GCT_RCING)*/ {
+    if (gotIntoSync && failed) {
+      gcvar.nextCollectionType =  GCT_TRACING;
+    }
+    else if (gotIntoSync && !failed) {
+      gcvar.nextCollectionType =  GCT_TRACING;
+    }
+    else if (!gotIntoSync && failed) {
+      gcvar.nextCollectionType =  GCT_TRACING;
+    }
+    else /* (!gotIntoSync && !failed) */ {
+      gcvar.nextCollectionType =  _recommendCollectionMethod();
+    }
+  }
+  if (gotIntoSync || failed)
+    gcvar.cost.reason = gotIntoSync ? "sync" : "failed";
+    
+  jio_printf("**** prevTrig=%d currTrig=%d curCycle=%s nextCycle=%s\n",
+             prevTrig,
+             gcvar.gcTrigHigh,
+             gcvar.collectionType == GCT_RCING ? "RC" : "TRACING",
+             gcvar.nextCollectionType == GCT_RCING ? "RC" : "TRACING"
+             );
+  jio_printf("**** reason=%s estRC=%.1fms estTrace=%.1fms buffs=%d unrecovered=%d stuck=%d/%d\n",
+             gcvar.cost.reason,
+             gcvar.cost.estRC,
+             gcvar.cost.estTrace,
+             gcvar.cost.nBuffs,
+             gcvar.cost.nUnrecovered,
+             gcvar.cost.nStuck,
+             gcvar.cost.nStuckSinceTrace
+             );
+  fflush( stdout );
+
+  if (gcvar.opt.pacer)
+    _pace( nNowFree );
 }
 
 static void _gc(void)
 {
-  uint  delta, end, start;
-  int   nWasFree;
+  uint  delta, end, start, typeStart;
 
   start = GetTickCount();
   gcvar.gcActive = true;
@@ -2991,7 +3447,7 @@ static void _gc(void)
     gcvar.collectionType = GCT_RCING;
     
 
-  nWasFree = FREE_BLOCKS();
+  gcvar.nFreeBlocksAtStart = FREE_BLOCKS();
 
 #ifdef RCVERBOSE
   jio_printf("----------------- start gc(%d--%s)  time=%d  -----\n", 
@@ -3004,25 +3460,30 @@ static void _gc(void)
   _Clear_Dirty_Marks();
   _Reinforce_Clearing_Conflict_Set();
   _Consolidate();
+  typeStart = GetTickCount();
   if (gcvar.collectionType == GCT_RCING) {
     _Update_Reference_Counters( );
     _Reclaim_Garbage( );
   }
   else {
     _Trace();
-    _Sweep();
-    /* re-commit the "zct" bmp */
+#ifndef RCCOMBINEDMETA
+    /* re-commit the "zct" bmp, the sweep predicate reads it */
     mokMemCommit( gcvar.zctBmp.bmp, gcvar.zctBmp.bmp_size, true );
+#endif
+    _Sweep();
   }
 
+  /* the reclaimed blocks may do for some stalled allocators already */
+  _wakeStalled( false );
+
   _processLocalsIntoNextZCT();
   gcvar.zctBuff = gcvar.nextZctBuff;
   gcvar.nextZctBuff.pos = NULL;
 
   end = GetTickCount();
   delta = end - start;
-
-  _updateRunHist( delta );
+  gcvar.cost.typeMs = end - typeStart;
 
 #ifdef RCDEBUG
   if (gcvar.collectionType == GCT_RCING) {
@@ -3032,74 +3493,15 @@ static void _gc(void)
 #endif //RCDEBUG
 
   /*
-   * OK, now see where we stand and set the strategy for the
-   * next cycle.
+   * If sweeping is left to the mutators the figures aren't in
+   * yet; gcThreadFunc() adjusts once the sweep is done.
    */
-  {
-    int nNowFree, nLowMark;
-    int prevTrig;
-    bool  failed, gotIntoSync;
-
-    nNowFree = FREE_BLOCKS();
-    nLowMark = gcvar.gcTrigHigh + (gcvar.opt.lowTrigDelta * blkvar.nBlocks)/100;
-    
-    failed = nNowFree < nLowMark;
-    gotIntoSync = gcvar.memStress;
-
-    jio_printf("**** high=%d low=%d free=%d was=%d failed=%d sync=%d\n",
-               gcvar.gcTrigHigh,
-               nLowMark,
-               nNowFree,
-               nWasFree,
-               failed,
-               gotIntoSync
-               );
-    fflush( stdout );
-
-    prevTrig = gcvar.gcTrigHigh;
-
-    if (gcvar.collectionType == GCT_TRACING) {
-      if (gotIntoSync && failed) {
-        gcvar.nextCollectionType =  GCT_TRACING;
-        gcvar.gcTrigHigh -= (gcvar.opt.raiseTrigInc * blkvar.nBlocks)/100;
-      }
-      else if (gotIntoSync && !failed) {
-        gcvar.nextCollectionType =  GCT_TRACING;
-        gcvar.gcTrigHigh += (gcvar.opt.lowerTrigDec * blkvar.nBlocks)/100;
-      }
-      else if (!gotIntoSync && failed) {
-        gcvar.nextCollectionType =  GCT_TRACING;
-        gcvar.gcTrigHigh -= (gcvar.opt.raiseTrigInc * blkvar.nBlocks)/100;
-      }
-      else /* (!gotIntoSync && !failed) */ {
-        gcvar.nextCollectionType =  _recommendCollectionMethod();
-      }
-    }
-    else /*(gcvar.collectionType == GCT_RCING)*/ {
-      if (gotIntoSync && failed) {
-        gcvar.nextCollectionType =  GCT_TRACING;
-      }
-      else if (gotIntoSync && !failed) {
-        gcvar.nextCollectionType =  GCT_TRACING;
-      }
-      else if (!gotIntoSync && failed) {
-        gcvar.nextCollectionType =  GCT_TRACING;
-      }
-      else /* (!gotIntoSync && !failed) */ {
-        gcvar.nextCollectionType =  _recommendCollectionMethod();
-      }
-    }
-      
-    jio_printf("**** prevTrig=%d currTrig=%d curCycle=%s nextCycle=%s\n",
-               prevTrig,
-               gcvar.gcTrigHigh,
-               gcvar.collectionType == GCT_RCING ? "RC" : "TRACING",
-               gcvar.nextCollectionType == GCT_RCING ? "RC" : "TRACING"
-               );
-    fflush( stdout );
+  if (!chunkvar.lazySweepActive) {
+    _adjustTriggers();
+    blkTrim();
+    blkZeroFree();
   }
 
-
 #ifdef RCDEBUG
   _printStats();
 #endif
@@ -3116,12 +3518,149 @@ static void _gc(void)
 #endif
 }
 
+/*************************************************/
+/**************** WORKER THREADS *****************/
+/*************************************************/
+
+static DWORD WINAPI _gcWorkerThreadFunc( void *param )
+{
+  GCWORKER *w = (GCWORKER*)param;
+
+  for (;;) {
+    WaitForSingleObject( w->hGo, INFINITE );
+    gcvar.workFunc( w->iWorker, gcvar.workArg );
+    SetEvent( w->hDone );
+  }
+  return 0;
+}
+
+/*
+ * Start the helper threads.  The collector thread is worker zero so
+ * nWorkers-1 threads are created; with nWorkers<=1 nothing is.
+ */
+GCFUNC void gcWorkInit( int nWorkers )
+{
+  int i;
+
+  if (nWorkers < 1) 
+    nWorkers = 1;
+  if (nWorkers > MAX_GC_WORKERS)
+    nWorkers = MAX_GC_WORKERS;
+  gcvar.nWorkers = nWorkers;
+
+  for (i=1; i<nWorkers; i++) {
+    GCWORKER *w = &gcvar.workers[i];
+    w->iWorker = i;
+    w->hGo   = CreateEvent( NULL, FALSE, FALSE, NULL );
+    w->hDone = CreateEvent( NULL, FALSE, FALSE, NULL );
+    w->hThread = mokThreadCreate( _gcWorkerThreadFunc, w );
+  }
+}
+
+/* win32 priorities of the Java ones, as in threads_md.c */
+static int _win32Priority[] = {
+  THREAD_PRIORITY_LOWEST,         /* 0 unused */
+  THREAD_PRIORITY_LOWEST,         /* 1 MIN_PRIORITY */
+  THREAD_PRIORITY_LOWEST,         /* 2 */
+  THREAD_PRIORITY_BELOW_NORMAL,   /* 3 */
+  THREAD_PRIORITY_BELOW_NORMAL,   /* 4 */
+  THREAD_PRIORITY_NORMAL,         /* 5 NORM_PRIORITY */
+  THREAD_PRIORITY_ABOVE_NORMAL,   /* 6 */
+  THREAD_PRIORITY_ABOVE_NORMAL,   /* 7 */
+  THREAD_PRIORITY_HIGHEST,        /* 8 */
+  THREAD_PRIORITY_HIGHEST,        /* 9 */
+  THREAD_PRIORITY_TIME_CRITICAL   /* 10 MAX_PRIORITY */
+};
+
+/*
+ * The CPUs worker "i" may run on: all of gcCpuMask, or the i-th of them
+ * round robin with gcCpuDedicated.  Without a mask, the process's.
+ */
+static DWORD_PTR _workerCpuMask( int i )
+{
+  DWORD_PTR procMask, sysMask, mask = (DWORD)gcvar.opt.gcCpuMask;
+  int nCpus, bit;
+
+  GetProcessAffinityMask( GetCurrentProcess(), &procMask, &sysMask );
+  mask &= procMask;
+  if (!mask)
+    return procMask;
+  if (!gcvar.opt.gcCpuDedicated)
+    return mask;
+
+  nCpus = _popCount( (uint)mask );
+  i %= nCpus;
+  for (bit=0; ; bit++)
+    if ((mask & ((DWORD_PTR)1 << bit)) && i-- == 0)
+      return (DWORD_PTR)1 << bit;
+}
+
+/*
+ * Apply the affinity and priority options to the collector, which is
+ * the calling thread, and to its workers.  The collector's priority is
+ * set when it is created, through the HPI.
+ */
+GCFUNC void gcWorkPlace( void )
+{
+  int i, prio;
+
+  prio = gcvar.opt.workerPrio ? gcvar.opt.workerPrio : GC_THREAD_PRIO();
+  if (prio < 1 || prio > 10)
+    prio = 9;
+
+  SetThreadAffinityMask( GetCurrentThread(), _workerCpuMask(0) );
+  for (i=1; i<gcvar.nWorkers; i++) {
+    SetThreadAffinityMask( gcvar.workers[i].hThread, _workerCpuMask(i) );
+    SetThreadPriority( gcvar.workers[i].hThread, _win32Priority[ prio ] );
+  }
+}
+
+/*
+ * Hand out the items 0..n-1 of a parallel phase to the workers in
+ * batches of "batch", through the shared counter "*pNext", which
+ * starts at zero.  Returns the first item of the caller's batch, -1
+ * once all are taken.  A worker's loop goes
+ *
+ *   while ((first = gcWorkClaim( &next, n, batch )) >= 0)
+ *     for (i=first; i<first+batch && i<n; i++)
+ *       ...
+ */
+GCFUNC int gcWorkClaim( volatile long *pNext, int n, int batch )
+{
+  long first = InterlockedExchangeAdd( (long*)pNext, batch );
+
+  return first < n ? first : -1;
+}
+
+/*
+ * Run "func" on all the workers, the calling collector thread included,
+ * and return when all of them are done.
+ */
+GCFUNC void gcWorkParallel( GCWORKFUNC func, void *arg )
+{
+  HANDLE hDone[ MAX_GC_WORKERS ];
+  int i;
+
+  gcvar.workFunc = func;
+  gcvar.workArg = arg;
+  for (i=1; i<gcvar.nWorkers; i++) {
+    hDone[i-1] = gcvar.workers[i].hDone;
+    SetEvent( gcvar.workers[i].hGo );
+  }
+
+  func( 0, arg );
+
+  if (gcvar.nWorkers > 1)
+    WaitForMultipleObjects( gcvar.nWorkers-1, hDone, TRUE, INFINITE );
+}
+
 HANDLE hGCEvent, hMutEvent;
 
 void gcThreadFunc(void *param)
 {
   gcvar.ee = EE();
   gcvar.sys_thread = EE2SysThread ( gcvar.ee );
+  gcWorkPlace();
 
 #ifdef RCDEBUG
   dbgprn( 
@@ -3142,12 +3681,30 @@ void gcThreadFunc(void *param)
     jio_printf( " *************** GC -- wokeup (%d)\n", gcvar.iCollection );
     fflush( stdout );
 #endif
+    _applyPendingOptions();
+    _pacerCycleStart();
+    gcvar.cost.nBuffs = gcvar.nChunksAllocatedRecentlyByUser;
+    gcvar.cost.nStuck = 0;
     gcvar.nChunksAllocatedRecentlyByUser = 0;
     _gc();
 #ifdef RCDEBUG
     dbgprn( 0, " *************** GC -- done (%d)\n", gcvar.iCollection );
 #endif
     gcvar.iCollection++;
+    _wakeStalled( true );
+
+    if (chunkvar.lazySweepActive) {
+      /* let sync requesters go and allocate, they sweep as they go */
+      uint sweepStart = GetTickCount();
+
+      PulseEvent( hMutEvent );
+      blkSweepPending();
+      /* the sweep is part of the tracing cost */
+      gcvar.cost.typeMs += GetTickCount() - sweepStart;
+      _adjustTriggers();
+      blkTrim();
+      blkZeroFree();
+    }
   }
 }
 
@@ -3187,19 +3744,373 @@ GCEXPORT void gcRequestSyncGC(void)
 
 GCEXPORT void gcRequestAsyncGC(void)
 {
-  if (!gcvar.gcActive) {
+  if (!gcvar.gcActive && !chunkvar.lazySweepActive) {
     SetEvent( hGCEvent );
   }
 }
 
-/*------------------------ Init ----------------------------*/
+/*
+ * Wake the stalled allocators, in the order they stalled, as long as
+ * the blocks which can be allocated cover what they need between them,
+ * and at the end of a cycle wake all the others too.  The blocks are
+ * not reserved, the woken threads race for them with the running ones.
+ * The states are set under the lock, so a thread which times out
+ * meanwhile sees its new state, and the woken threads all go with a
+ * single broadcast.
+ */
+static void _wakeStalled( bool cycleDone )
+{
+  STALLREQ *r;
+  int avail;
+  bool woke = false;
 
-static void gcInit(int __nMegs)
+  gcvar.nFreedSinceWake = 0;
+  if (!gcvar.stallHead)
+    return;
+  EnterCriticalSection( &gcvar.stallLock );
+  avail = ALLOCATABLE_BLOCKS();
+  while ((r = gcvar.stallHead) != NULL) {
+    if ((int)r->nBlocks <= avail) {
+      avail -= r->nBlocks;
+      r->state = STALL_SATISFIED;
+    }
+    else if (cycleDone)
+      r->state = STALL_CYCLE_DONE;
+    else
+      break;
+    gcvar.stallHead = r->next;
+    if (!gcvar.stallHead)
+      gcvar.stallTail = NULL;
+    woke = true;
+  }
+  if (woke)
+    WakeAllConditionVariable( &gcvar.stallCond );
+  LeaveCriticalSection( &gcvar.stallLock );
+}
+
+/*
+ * Called by the block manager whenever the reclaim or the sweep have
+ * freed some blocks.  The stalled allocators are looked at every
+ * STALL_WAKE_BATCH blocks rather than on each one.
+ */
+GCFUNC void gcNoteFreedBlocks( int nBlocks )
 {
-  DWORD HEAP_SIZE = __nMegs << 20;
-  DWORD  ZCT_SIZE = HEAP_SIZE/0x100;
+  if (!gcvar.stallHead)
+    return;
+  if (InterlockedExchangeAdd( &gcvar.nFreedSinceWake, nBlocks ) + nBlocks 
+      >= STALL_WAKE_BATCH)
+    _wakeStalled( false );
+}
+
+/*
+ * Called by an allocator which is out of memory: it waits until the
+ * collector has "nBlocks" free blocks for it or has finished a cycle.
+ * Returns false if it can't wait or waited for stallTimeoutMs in vain,
+ * in which case the allocation fails.
+ */
+GCEXPORT bool gcStallForMemory( ExecEnv *ee, uint nBlocks )
+{
+  STALLREQ *r = &ee->gcblk.stall, **pr;
+  DWORD timeout, start, waited;
+  bool res;
+
+  if (!gcvar.initialized || ee == gcvar.ee)
+    return false;
+  timeout = gcvar.opt.stallTimeoutMs ? gcvar.opt.stallTimeoutMs : INFINITE;
+
+  r->next = NULL;
+  r->nBlocks = nBlocks;
+  r->state = STALL_WAITING;
+  EnterCriticalSection( &gcvar.stallLock );
+  if (gcvar.stallTail)
+    gcvar.stallTail->next = r;
+  else
+    gcvar.stallHead = r;
+  gcvar.stallTail = r;
+  LeaveCriticalSection( &gcvar.stallLock );
+
+#ifdef RCVERBOSE
+  jio_printf("STALL thread=%x blocks=%d (iCollection=%d)\n", 
+             EE2SysThread( ee ), 
+             nBlocks,
+             gcvar.iCollection );
+  fflush( stdout );
+#endif
+  gcvar.memStress = true;
+  SetEvent( hGCEvent );
+
+  start = GetTickCount();
+  EnterCriticalSection( &gcvar.stallLock );
+  while (r->state == STALL_WAITING) {
+    waited = GetTickCount() - start;
+    if (timeout != INFINITE && waited >= timeout) {
+      STALLREQ *prev = NULL;
+      for (pr = &gcvar.stallHead; *pr != r; pr = &(*pr)->next)
+        prev = *pr;
+      *pr = r->next;
+      if (gcvar.stallTail == r)
+        gcvar.stallTail = prev;
+      r->state = STALL_TIMEDOUT;
+      break;
+    }
+    SleepConditionVariableCS( &gcvar.stallCond, &gcvar.stallLock, 
+                              timeout == INFINITE ? INFINITE : timeout - waited );
+  }
+  res = r->state != STALL_TIMEDOUT;
+  LeaveCriticalSection( &gcvar.stallLock );
+  return res;
+}
+
+/*------------------------ Options -------------------------*/
+
+typedef struct GCOPTDESC {
+  const char *name;
+  int         offset;   /* in struct GCOPTS */
+  int         def;
+  int         min;
+  int         max;
+  bool        live;     /* may change once the collector is up */
+} GCOPTDESC;
+
+#define GCOPTDEF( name, def, min, max, live ) \
+  { #name, offsetof(struct GCOPTS, name), def, min, max, live }
+
+#define GCOPT_MAXINT  0x7fffffff
+#define GCOPT_MININT  (-GCOPT_MAXINT-1)
+
+static GCOPTDESC _optDescs[] = {
+  GCOPTDEF( recommendOnlyRCGC,   0,   0, 1,             true  ),
+  GCOPTDEF( useOnlyRCGC,         0,   0, 1,             true  ),
+  GCOPTDEF( useOnlyTracingGC,    0,   0, 1,             true  ),
+  GCOPTDEF( listBlkWorth,        100, 0, 100,           true  ),
+  GCOPTDEF( userBuffTrig,        500, 1, GCOPT_MAXINT,  true  ),
+  GCOPTDEF( initialHighTrigMark, 20,  0, 100,           true  ),
+  GCOPTDEF( lowTrigDelta,        5,   0, 100,           true  ),
+  GCOPTDEF( raiseTrigInc,        5,   0, 100,           true  ),
+  GCOPTDEF( lowerTrigDec,        2,   0, 100,           true  ),
+  GCOPTDEF( uniPrio,             9,   1, 10,            true  ),
+  GCOPTDEF( multiPrio,           10,  1, 10,            true  ),
+  GCOPTDEF( lazySweep,           0,   0, 1,             true  ),
+  GCOPTDEF( nSweepWorkers,       0,   0, MAX_GC_WORKERS, false ),
+  GCOPTDEF( numaAware,           0,   0, 1,             false ),
+  GCOPTDEF( nBins,               0,   0, MAX_BINS,      false ),
+  GCOPTDEF( binProfile,          0,   0, 1,             false ),
+  GCOPTDEF( trimTargetMB,        0,   0, GCOPT_MAXINT,  true  ),
+  GCOPTDEF( trimMinBlocks,       0,   0, GCOPT_MAXINT,  true  ),
+  GCOPTDEF( largePages,          0,   0, 1,             false ),
+  GCOPTDEF( zeroAheadMB,         0,   0, GCOPT_MAXINT,  true  ),
+  GCOPTDEF( parkAllocLists,      0,   0, 1,             true  ),
+  GCOPTDEF( allocSampleKB,       0,   0, 0x100000,      false ),
+  GCOPTDEF( pacer,               0,   0, 1,             true  ),
+  GCOPTDEF( pacerHeadroom,       5,   0, 100,           true  ),
+  GCOPTDEF( pacerBudget,         0,   0, 99,            true  ),
+  GCOPTDEF( nGCWorkers,          0,   0, MAX_GC_WORKERS, false ),
+  GCOPTDEF( gcCpuMask,           0,   GCOPT_MININT, GCOPT_MAXINT, true ),
+  GCOPTDEF( gcCpuDedicated,      0,   0, 1,             true  ),
+  GCOPTDEF( workerPrio,          0,   0, 10,            true  ),
+  GCOPTDEF( stallTimeoutMs,      0,   0, GCOPT_MAXINT,  true  ),
+};
+
+#define N_GCOPTS  (sizeof(_optDescs)/sizeof(_optDescs[0]))
+
+/* where an option's value came from, a source doesn't override a later one */
+enum GCOPTSRC { OPTSRC_DEFAULT=0, OPTSRC_FILE, OPTSRC_ENV, OPTSRC_ARG };
+
+static char _optSource[ N_GCOPTS ];
+static bool _optInited;
+
+#define _optField( opts, d )  ((int*)((char*)(opts) + (d)->offset))
+
+static void _initOptions(void)
+{
+  int i;
+
+  if (_optInited)
+    return;
+  for (i=0; i<N_GCOPTS; i++) {
+    *_optField( &gcvar.opt, &_optDescs[i] ) = _optDescs[i].def;
+    _optSource[i] = OPTSRC_DEFAULT;
+  }
+  _optInited = true;
+}
+
+static GCOPTDESC *_findOption( const char *name )
+{
+  int i;
+
+  for (i=0; i<N_GCOPTS; i++)
+    if (strcmp( name, _optDescs[i].name ) == 0)
+      return &_optDescs[i];
+  return NULL;
+}
+
+static int _setOption( const char *name, int val, int source )
+{
+  GCOPTDESC *d = _findOption( name );
+  int i;
+
+  if (!d) {
+    jio_printf("GCOPT unknown option %s\n", name );
+    return GCOPT_UNKNOWN;
+  }
+  if (val < d->min || val > d->max) {
+    jio_printf("GCOPT %s = %d out of range [%d,%d]\n", 
+               name, val, d->min, d->max );
+    return GCOPT_RANGE;
+  }
+  i = d - _optDescs;
+
+  if (!gcvar.optFrozen) {
+    if (source < _optSource[i])
+      return GCOPT_OK;
+    _optSource[i] = source;
+    *_optField( &gcvar.opt, d ) = val;
+    jio_printf("GCOPT set: %s = %d\n", name, val);
+    return GCOPT_OK;
+  }
 
+  if (!d->live) {
+    jio_printf("GCOPT %s can't be changed while running\n", name );
+    return GCOPT_FIXED;
+  }
+  gcSpinLockEnter( &gcvar.optLock, (unsigned)sysThreadSelf() );
+  if (!gcvar.optPending)
+    gcvar.pendingOpt = gcvar.opt;
+  *_optField( &gcvar.pendingOpt, d ) = val;
+  gcvar.optPending = true;
+  gcSpinLockExit( &gcvar.optLock, (unsigned)sysThreadSelf() );
+  jio_printf("GCOPT set: %s = %d (next cycle)\n", name, val);
+  return GCOPT_OK;
+}
+
+/*
+ * Parse "name=val" or "name val" pairs, separated by commas, semicolons
+ * or white space.  All are set that can be, the first error is returned.
+ * A value may be given in hex, so that a mask can have all 32 bits.
+ */
+static int _setOptionString( const char *spec, int source )
+{
+  char opt[100], valStr[32], *end;
+  int  val, n, err, res = GCOPT_OK;
+
+  for (;;) {
+    while (*spec && strchr( ",; \t\r\n", *spec ))
+      spec++;
+    if (!*spec)
+      break;
+    if (2 != sscanf( spec, "%99[^=, \t\r\n] %*[=] %31[^,; \t\r\n]%n", 
+                     opt, valStr, &n ) &&
+        2 != sscanf( spec, "%99[^=, \t\r\n] %31[^,; \t\r\n]%n", 
+                     opt, valStr, &n )) {
+      jio_printf("GCOPT syntax error at \"%s\"\n", spec );
+      return res ? res : GCOPT_SYNTAX;
+    }
+    val = (int)strtoul( valStr, &end, 0 );
+    if (*end) {
+      jio_printf("GCOPT syntax error at \"%s\"\n", spec );
+      return res ? res : GCOPT_SYNTAX;
+    }
+    spec += n;
+    err = _setOption( opt, val, source );
+    if (err && !res)
+      res = err;
+  }
+  return res;
+}
+
+static void _readOptionFile(void)
+{
   FILE *f;
+  char buff[200];
+
+  f = fopen( GCOPT_FILE, "r" );
+  if (!f)
+    return;
+  while (fgets( buff, sizeof(buff), f )) {
+    if (buff[0]=='#') continue; /* remark line */
+    _setOptionString( buff, OPTSRC_FILE );
+  }
+  fclose( f );
+}
+
+static void _readOptionEnv(void)
+{
+  char *spec = getenv( GCOPT_ENV );
+
+  if (spec)
+    _setOptionString( spec, OPTSRC_ENV );
+}
+
+/*
+ * Called by the collector between cycles: the options set while it
+ * was running take effect.
+ */
+static void _applyPendingOptions(void)
+{
+  struct GCOPTS old;
+
+  if (!gcvar.optPending)
+    return;
+  gcSpinLockEnter( &gcvar.optLock, (unsigned)gcvar.sys_thread );
+  old = gcvar.opt;
+  gcvar.opt = gcvar.pendingOpt;
+  gcvar.optPending = false;
+  gcSpinLockExit( &gcvar.optLock, (unsigned)gcvar.sys_thread );
+
+  /* the pacer's triggers don't outlive it, nor its budget */
+  if (gcvar.opt.initialHighTrigMark != old.initialHighTrigMark ||
+      (old.pacer && !gcvar.opt.pacer))
+    gcvar.gcTrigHigh = (gcvar.opt.initialHighTrigMark * blkvar.nBlocks)/100;
+  if (gcvar.opt.userBuffTrig != old.userBuffTrig ||
+      (old.pacer && !gcvar.opt.pacer) ||
+      (old.pacerBudget && !gcvar.opt.pacerBudget))
+    gcvar.buffTrig = gcvar.opt.userBuffTrig;
+  if (gcvar.opt.uniPrio != old.uniPrio || gcvar.opt.multiPrio != old.multiPrio)
+    sysThreadSetPriority( gcvar.sys_thread, GC_THREAD_PRIO() );
+  if (gcvar.opt.uniPrio != old.uniPrio || 
+      gcvar.opt.multiPrio != old.multiPrio ||
+      gcvar.opt.workerPrio != old.workerPrio ||
+      gcvar.opt.gcCpuMask != old.gcCpuMask ||
+      gcvar.opt.gcCpuDedicated != old.gcCpuDedicated)
+    gcWorkPlace();
+}
+
+/*
+ * Set an option, from the command line before gcInit(), or while
+ * running.
+ */
+GCEXPORT int gcSetOption( const char *name, int val )
+{
+  _initOptions();
+  return _setOption( name, val, OPTSRC_ARG );
+}
+
+GCEXPORT int gcSetOptions( const char *spec )
+{
+  _initOptions();
+  return _setOptionString( spec, OPTSRC_ARG );
+}
+
+/*
+ * The value in effect, not one which waits for the next cycle.
+ */
+GCEXPORT int gcGetOption( const char *name, int *pVal )
+{
+  GCOPTDESC *d = _findOption( name );
+
+  if (!d)
+    return GCOPT_UNKNOWN;
+  _initOptions();
+  *pVal = *_optField( &gcvar.opt, d );
+  return GCOPT_OK;
+}
+
+/*------------------------ Init ----------------------------*/
+
+static void gcInit(int __nMegs)
+{
+  size_t HEAP_SIZE = (size_t)__nMegs << 20;
+  size_t ZCT_SIZE = HEAP_SIZE/0x100;
 
   DWORD TimeAdjustment;       // size of time adjustment
   DWORD TimeIncrement;        // time between adjustments
@@ -3207,6 +4118,8 @@ static void gcInit(int __nMegs)
 
   hGCEvent  = CreateEvent( NULL, FALSE, FALSE, NULL );
   hMutEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+  InitializeCriticalSection( &gcvar.stallLock );
+  InitializeConditionVariable( &gcvar.stallCond );
 
   GetSystemTimeAdjustment(
                           &TimeAdjustment,       // size of time adjustment
@@ -3221,49 +4134,40 @@ static void gcInit(int __nMegs)
           );
 #endif
 
-  f = fopen( "gcopt.txt", "r" );
-  if (!f) {
-    jio_printf( "GCOPT.txt could not be opened\n");
-    exit(-1);
-  }
-  for (;;) {
-    char buff[200];
-    char opt[100];
-    int  val;
-    
-    if (! fgets( buff, sizeof(buff), f) ) break;
-    if (buff[0]=='#') continue; /* remark line */
-    if (2 != sscanf( buff, "%s %d", opt, &val )) {
-      jio_printf("Error reading GCOPT.TXT\n");
-      exit(-1);
-    }
-#define CHECKGCOPT(optname) if (strcmp(opt, #optname)==0) {\
-                               gcvar.opt. optname = val;\
-                               jio_printf("GCOPT set: %s = %d\n", #optname, val);\
-                               continue;\
-                            } else do {} while(0)
-    CHECKGCOPT(recommendOnlyRCGC);
-    CHECKGCOPT(useOnlyTracingGC);
-    CHECKGCOPT(useOnlyRCGC);
-    CHECKGCOPT(listBlkWorth);
-    CHECKGCOPT(userBuffTrig);
-    CHECKGCOPT(initialHighTrigMark);
-    CHECKGCOPT(lowTrigDelta);
-    CHECKGCOPT(raiseTrigInc);
-    CHECKGCOPT(lowerTrigDec);
-    CHECKGCOPT(uniPrio);
-    CHECKGCOPT(multiPrio);
-    jio_printf("GCOPT unknown option %s\n", opt );
-    exit(-1);
+  _initOptions();
+  _readOptionFile();
+  _readOptionEnv();
+
+#ifdef RCBMPTEST
+  /* self-test the bitmaps before the collector relies on them */
+  test2BitBmp();
+  testAtomicBmp();
+#endif
+
+  if (gcvar.opt.largePages) {
+    unsigned lpsz = mokMemEnableLargePages();
+    if (lpsz)
+      jio_printf("GC large pages of %dKB enabled\n", lpsz >> 10 );
+    else
+      jio_printf("GC large pages not available, using default pages\n");
   }
-  fclose( f );
 
   /* Init blocks manager */
   blkInit( HEAP_SIZE >> 20 );
+
+#ifdef RCLP64
+  /* Log entry encoding bases, see BUFF */
+  gcvar.logHandleBase = blkvar.heapStart - OBJGRAIN;
+  gcvar.buffArenaTop = (byte*)mokMemReserve( NULL, BUFF_ARENA_SIZE );
+  gcvar.logBuffBase = gcvar.buffArenaTop - sizeof(uint);
+#endif
   
   /* Init chunks manager */
   chkInit( HEAP_SIZE >> 20 );
 
+  /* Start sweep helpers, if any */
+  gcWorkInit( GC_POOL_SIZE() );
+
   gcvar.stage = GCHS4;
   gcvar.createBuffList = NULL;
   gcvar.updateBuffList = NULL;
@@ -3281,11 +4185,24 @@ static void gcInit(int __nMegs)
   gcvar.zctStackTop = (GCHandle**)(ZCT_SIZE + (char*)gcvar.zctStack);
   gcvar.zctStackSp = gcvar.zctStack;
 
+#ifdef RCCOMBINEDMETA
+  HMETA_Init( &gcvar.metaBmp, (uint*)blkvar.heapStart, HEAP_SIZE );
+#else
   H1BIT_Init( &gcvar.localsBmp, (uint*)blkvar.heapStart, HEAP_SIZE );
   H2BIT_Init( &gcvar.rcBmp, (uint*)blkvar.heapStart, HEAP_SIZE );
   H1BIT_Init( &gcvar.zctBmp, (uint*)blkvar.heapStart, HEAP_SIZE );
+#endif
+
+  if (gcvar.opt.largePages) {
+    size_t wanted, obtained;
+    mokMemLargeStats( &wanted, &obtained );
+    jio_printf("GC large pages: %dMB of %dMB obtained, heap %s\n",
+               (int)(obtained >> 20), (int)(wanted >> 20), 
+               blkvar.largePages ? "on large pages" : "on default pages" );
+  }
 
   buffInit( gcvar.ee, &gcvar.zctBuff );
+  buffInit( gcvar.ee, &gcvar.rangeBuff );
 
   gcvar.gcMon = (sys_mon_t*)sysMalloc(sysMonitorSizeof());        
   gcvar.requesterMon = (sys_mon_t*)sysMalloc(sysMonitorSizeof());        
@@ -3296,6 +4213,21 @@ static void gcInit(int __nMegs)
   gcvar.collectionType = GCT_RCING;
 
   gcvar.gcTrigHigh = (gcvar.opt.initialHighTrigMark * blkvar.nBlocks)/100;
+  gcvar.buffTrig = gcvar.opt.userBuffTrig;
+  gcvar.cost.reason = "none";
+  gcvar.pacer.cycleStart = gcvar.pacer.lastEnd = GetTickCount();
+
+  /* 
+   * Written when the VM exits in order, while its threads are still
+   * around; a CRT exit handler would run after they were killed.
+   */
+  if (gcvar.opt.allocSampleKB)
+    JVM_OnExit( gcWriteAllocProfile );
+  if (gcvar.opt.binProfile)
+    JVM_OnExit( chkWriteSizeHistogram );
+
+  /* from now on options are changed between cycles */
+  gcvar.optFrozen = true;
 }
 
 GCEXPORT void gcStartGCThread(void)
@@ -3311,11 +4243,12 @@ GCEXPORT void gcStartGCThread(void)
    * Otherwise, we choose priority==9 which translates into win32
    * "highest priority"
    */
-  if (sysGetSysInfo()->isMP)
-    priority = gcvar.opt.multiPrio;
-  else
-    priority = gcvar.opt.uniPrio;
-  createSystemThread("YLRC Garbage Collector (YEH!)", 9, 10*1024, gcThreadFunc, NULL);
+  priority = GC_THREAD_PRIO();
+  createSystemThread("YLRC Garbage Collector (YEH!)", 
+                     priority, 
+                     GC_THREAD_STACK, 
+                     gcThreadFunc, 
+                     NULL);
 }
 
 GCEXPORT void gcThreadCooperate(ExecEnv *ee)
@@ -3352,6 +4285,216 @@ GCEXPORT void gcThreadCooperate(ExecEnv *ee)
   ee->gcblk.cantCoop = false;
 }
 
+/*************************************************/
+/************** ALLOCATION SAMPLING **************/
+/*************************************************/
+
+/*
+ * Bytes to allocate before the next sample, drawn from an exponential
+ * distribution with a mean of allocSampleKB.
+ */
+static int _nextSampleInterval( ExecEnv *ee )
+{
+  uint x = ee->gcblk.sampleSeed;
+  double u, d;
+
+  /* xorshift, the seed is never 0 */
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  ee->gcblk.sampleSeed = x;
+
+  u = ((x >> 8) + 1) / 16777217.0;   /* in (0,1) */
+  d = -log( u ) * gcvar.opt.allocSampleKB * 1024.0;
+  if (d >= SAMPLE_OFF)
+    return SAMPLE_OFF;
+  return (int)d;
+}
+
+static void _initThreadSamples( ExecEnv *ee )
+{
+  ee->gcblk.nSamples = 0;
+  ee->gcblk.sampleSeed = (GetTickCount() ^ (uint)ee) | 1;
+  ee->gcblk.samples = NULL;
+  if (gcvar.opt.allocSampleKB)
+    ee->gcblk.samples =
+      (ALLOCSAMPLE*)sysMalloc( SAMPLE_RING*sizeof(ALLOCSAMPLE) );
+  if (ee->gcblk.samples)
+    ee->gcblk.sampleCountdown = _nextSampleInterval( ee );
+  else
+    ee->gcblk.sampleCountdown = SAMPLE_OFF;
+}
+
+/*
+ * Called by a dying thread, holding the queue lock: its samples are
+ * moved into the ring of the dead threads.
+ */
+static void _keepDeadThreadSamples( ExecEnv *ee )
+{
+  uint i, n = ee->gcblk.nSamples;
+
+  if (!ee->gcblk.samples)
+    return;
+  if (!gcvar.deadSamples)
+    gcvar.deadSamples =
+      (ALLOCSAMPLE*)sysMalloc( SAMPLE_RING*sizeof(ALLOCSAMPLE) );
+  if (gcvar.deadSamples) {
+    i = n > SAMPLE_RING ? n - SAMPLE_RING : 0;
+    for (; i<n; i++)
+      gcvar.deadSamples[ gcvar.nDeadSamples++ % SAMPLE_RING ] =
+        ee->gcblk.samples[ i % SAMPLE_RING ];
+  }
+  sysFree( ee->gcblk.samples );
+  ee->gcblk.samples = NULL;
+  ee->gcblk.sampleCountdown = SAMPLE_OFF;
+}
+
+/*
+ * The slow path of gcSampleAlloc(): the countdown ran out.
+ */
+GCEXPORT void gcRecordAllocSample(ExecEnv *ee, GCHandle *h,
+                                  uint nbytes, int bin)
+{
+  ALLOCSAMPLE *s;
+  JavaFrame *frame;
+  int depth = 0;
+
+  if (!ee->gcblk.samples) {
+    ee->gcblk.sampleCountdown = SAMPLE_OFF;
+    return;
+  }
+  ee->gcblk.sampleCountdown = _nextSampleInterval( ee );
+
+  s = &ee->gcblk.samples[ ee->gcblk.nSamples % SAMPLE_RING ];
+  s->size = nbytes;
+  s->bin = bin;
+  s->type = obj_flags(h);
+  s->cb = s->type == T_NORMAL_OBJECT ? obj_classblock(h) : NULL;
+  for (frame = ee->current_frame;
+       frame && depth < SAMPLE_DEPTH;
+       frame = frame->prev)
+    if (frame->current_method)
+      s->stack[ depth++ ] = frame->current_method;
+  s->depth = depth;
+  ee->gcblk.nSamples++;
+}
+
+#define SAMPLE_SYMBOLS  4096
+
+typedef struct SAMPLEDUMP {
+  FILE *prof;
+  void *symbols[ SAMPLE_SYMBOLS ];
+  bool  isMethod[ SAMPLE_SYMBOLS ];
+} SAMPLEDUMP;
+
+/*
+ * Remember an address of the profile, once, to name it at the end.
+ */
+static void _addSampleSymbol( SAMPLEDUMP *sd, void *p, bool isMethod )
+{
+  int i, j;
+
+  for (i=0; i<SAMPLE_SYMBOLS; i++) {
+    j = (int)((((haddr)p >> 2) + i) % SAMPLE_SYMBOLS);
+    if (sd->symbols[j] == p)
+      return;
+    if (!sd->symbols[j]) {
+      sd->symbols[j] = p;
+      sd->isMethod[j] = isMethod;
+      return;
+    }
+  }
+}
+
+/*
+ * Name the addresses of the profile.  An array type takes the place of
+ * the class of an array, its address is the type.
+ */
+static void _writeSampleSymbols( SAMPLEDUMP *sd )
+{
+  int i;
+
+  for (i=0; i<SAMPLE_SYMBOLS; i++) {
+    void *p = sd->symbols[i];
+    if (!p)
+      continue;
+    if (sd->isMethod[i]) {
+      struct methodblock *mb = (struct methodblock*)p;
+      fprintf( sd->prof, "0x%Ix %s.%s\n",
+               (haddr)p, cbName( fieldclass(&mb->fb) ), mb->fb.name );
+    }
+    else if ((haddr)p <= T_MAXNUMERIC)
+      fprintf( sd->prof, "0x%Ix new array of type %d\n", (haddr)p, (int)(haddr)p );
+    else
+      fprintf( sd->prof, "0x%Ix new %s\n", (haddr)p, cbName( (ClassClass*)p ) );
+  }
+}
+
+static void _writeSamples( SAMPLEDUMP *sd, ALLOCSAMPLE *ring, uint n )
+{
+  uint i = n > SAMPLE_RING ? n - SAMPLE_RING : 0;
+  int d;
+
+  for (; i<n; i++) {
+    ALLOCSAMPLE *s = &ring[ i % SAMPLE_RING ];
+    void *leaf = s->cb ? (void*)s->cb : (void*)(haddr)s->type;
+
+    fprintf( sd->prof, "%u 1 @ 0x%Ix", s->size, (haddr)leaf );
+    _addSampleSymbol( sd, leaf, false );
+    for (d=0; d<s->depth; d++) {
+      fprintf( sd->prof, " 0x%Ix", (haddr)s->stack[d] );
+      _addSampleSymbol( sd, s->stack[d], true );
+    }
+    fprintf( sd->prof, "\n" );
+  }
+}
+
+static int _writeThreadSamplesHelper( sys_thread_t *thrd, SAMPLEDUMP *sd )
+{
+  ExecEnv *ee = SysThread2EE( thrd );
+
+  if (ee->gcblk.gcInited && ee->gcblk.samples)
+    _writeSamples( sd, ee->gcblk.samples, ee->gcblk.nSamples );
+  return SYS_OK;
+}
+
+/*
+ * Write the samples of the live and dead threads into SAMPLE_PROFILE_FILE:
+ * a sample per line, "bytes count @ addresses", followed by the names of
+ * the addresses.  The threads keep allocating meanwhile, a sample which
+ * is being overwritten may come out torn.
+ */
+GCEXPORT void gcWriteAllocProfile(void)
+{
+  SAMPLEDUMP *sd;
+
+  if (!gcvar.opt.allocSampleKB)
+    return;
+  sd = (SAMPLEDUMP*)sysMalloc( sizeof(SAMPLEDUMP) );
+  if (!sd)
+    return;
+  memset( sd, 0, sizeof(SAMPLEDUMP) );
+  sd->prof = fopen( SAMPLE_PROFILE_FILE, "w" );
+  if (!sd->prof) {
+    jio_printf("%s could not be written\n", SAMPLE_PROFILE_FILE );
+    sysFree( sd );
+    return;
+  }
+
+  fprintf( sd->prof, "--- heapz 1 ---\n" );
+  fprintf( sd->prof, "format = java\n" );
+  fprintf( sd->prof, "resolution = bytes\n" );
+  QUEUE_LOCK( gcvar.sys_thread );
+  if (gcvar.deadSamples)
+    _writeSamples( sd, gcvar.deadSamples, gcvar.nDeadSamples );
+  mokThreadEnumerateOver( _writeThreadSamplesHelper, sd );
+  QUEUE_UNLOCK( gcvar.sys_thread );
+  _writeSampleSymbols( sd );
+
+  fclose( sd->prof );
+  sysFree( sd );
+}
+
 
 GCEXPORT void gcThreadAttach(ExecEnv* ee)
 {
@@ -3388,10 +4531,21 @@ GCEXPORT void gcThreadAttach(ExecEnv* ee)
       for (i=0; i<N_BINS; i++) {
         ee->gcblk.allocLists[i].binIdx = i;
         ee->gcblk.allocLists[i].head = ALLOC_LIST_NULL;
+        ee->gcblk.allocLists[i].cursor = NULL;
+        ee->gcblk.allocLists[i].limit = NULL;
+        ee->gcblk.allocLists[i].createStart = NULL;
+        ee->gcblk.allocLists[i].createTop = NULL;
+#ifdef RCFREEBMP
+        ee->gcblk.allocLists[i].freeBits = 0;
+#endif
       }
     }
   }
 
+  ee->gcblk.nBlkCache = 0;
+  _initThreadSamples( ee );
+  ee->gcblk.stall.state = STALL_NONE;
+
   stage = gcvar.stage;
   ee->gcblk.stageCooperated = GCHSNONE;
   ee->gcblk.stage = stage;
@@ -3410,19 +4564,44 @@ GCEXPORT void gcThreadAttach(ExecEnv* ee)
 GCEXPORT void gcThreadDetach(ExecEnv* ee)
 {
   sys_thread_t *self = EE2SysThread( ee );
+  BUFFHDR *bh = &ee->gcblk.createBuffer;
   SAVEDALLOCLISTS *sal;
+  int i;
 
-  sal = (SAVEDALLOCLISTS*)sysMalloc(  sizeof(SAVEDALLOCLISTS) );
+  blkReleaseThreadCache( ee );
 
-  mokAssert( sizeof(sal->allocLists) == sizeof(ee->gcblk.allocLists) );
-  mokAssert( sizeof(sal->allocLists) == sizeof(ALLOCLIST)*N_BINS );
+  /* log the ranges in progress before the lists are given up */
+  for (i=0; i<N_BINS; i++) {
+    if (bh->limit - bh->pos < 2)
+      gcBuffAllocAndLink( ee, bh );
+    ee->gcblk.cantCoop = true;
+    _logCreateRange( bh, &ee->gcblk.allocLists[i] );
+    ee->gcblk.cantCoop = false;
+  }
+
+  if (gcvar.opt.parkAllocLists) {
+    /* the lists are resumed by the next thread to attach */
+    sal = (SAVEDALLOCLISTS*)sysMalloc(  sizeof(SAVEDALLOCLISTS) );
 
-  memcpy( sal->allocLists, ee->gcblk.allocLists, sizeof( ee->gcblk.allocLists) );
+    mokAssert( sizeof(sal->allocLists) == sizeof(ee->gcblk.allocLists) );
+    mokAssert( sizeof(sal->allocLists) == sizeof(ALLOCLIST)*MAX_BINS );
+
+    memcpy( sal->allocLists, ee->gcblk.allocLists, sizeof( ee->gcblk.allocLists) );
+  }
+  else {
+    /* return the blocks, so they don't wait for a thread to attach */
+    for (i=0; i<N_BINS; i++)
+      chkRetireAllocList( ee, &ee->gcblk.allocLists[i] );
+    sal = NULL;
+  }
 
   QUEUE_LOCK( self );
 
-  sal->pNext = gcvar.pListOfSavedAllocLists;
-  gcvar.pListOfSavedAllocLists = sal;
+  if (sal) {
+    sal->pNext = gcvar.pListOfSavedAllocLists;
+    gcvar.pListOfSavedAllocLists = sal;
+  }
+  _keepDeadThreadSamples( ee );
   
 #ifdef RCDEBUG
   gcvar.dbgpersist.nDeadUpdateObjects += 
@@ -3437,22 +4616,22 @@ GCEXPORT void gcThreadDetach(ExecEnv* ee)
 
   /* link the create buffer into a list for dead threads */
   *ee->gcblk.createBuffer.pos = 0;
-  ee->gcblk.createBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.createBuffer.pos;
+  ee->gcblk.createBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.createBuffer.pos);
   ee->gcblk.createBuffer.start[LINKED_LIST_IDX] = 
-    (uint)gcvar.deadThreadsCreateBuffList;
+    LOG_LINK(gcvar.deadThreadsCreateBuffList);
   gcvar.deadThreadsCreateBuffList = ee->gcblk.createBuffer.start;
 
   /* do the same for the update buffer */
   *ee->gcblk.updateBuffer.pos = 0;
-  ee->gcblk.updateBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.updateBuffer.pos;
+  ee->gcblk.updateBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.updateBuffer.pos);
   ee->gcblk.updateBuffer.start[LINKED_LIST_IDX] = 
-    (uint)gcvar.deadThreadsUpdateBuffList;
+    LOG_LINK(gcvar.deadThreadsUpdateBuffList);
   gcvar.deadThreadsUpdateBuffList = ee->gcblk.updateBuffer.start;
 
   /* do the same for the snoop buffer */
   *ee->gcblk.snoopBuffer.pos = 0;
-  ee->gcblk.snoopBuffer.start[LAST_POS_IDX] = (uint)ee->gcblk.snoopBuffer.pos;
-  ee->gcblk.snoopBuffer.start[LINKED_LIST_IDX] = (uint)gcvar.deadThreadsSnoopBuffList;
+  ee->gcblk.snoopBuffer.start[LAST_POS_IDX] = LOG_LINK(ee->gcblk.snoopBuffer.pos);
+  ee->gcblk.snoopBuffer.start[LINKED_LIST_IDX] = LOG_LINK(gcvar.deadThreadsSnoopBuffList);
   gcvar.deadThreadsSnoopBuffList = ee->gcblk.snoopBuffer.start;
 
 
@@ -3467,7 +4646,7 @@ GCEXPORT void gcThreadDetach(ExecEnv* ee)
       ee->gcblk.updateBuffer.start[LOG_CHILDS_IDX];
 #endif
     ee->gcblk.updateBuffer.start[REINFORCE_LINKED_LIST_IDX] = 
-      (uint)gcvar.deadThreadsReinforceBuffList;
+      LOG_LINK(gcvar.deadThreadsReinforceBuffList);
     gcvar.deadThreadsReinforceBuffList = ee->gcblk.updateBuffer.start;
   }
 
@@ -3496,10 +4675,13 @@ void gcDo_gcupdate(ExecEnv *ee, void *_h, void *_slot, void *_newval )
 
   {
     uint *p = h->logPos;
-    if (p) {
+    if (p == LOG_IMPLICIT_POS) { // bumped, not logged yet
+      ee->gcblk.dbg.nNewObjectUpdatesInCycle++;
+    }
+    else if (p) {
       uint val = *p;
       uint type = val&3;
-      sysAssert( (val&~3) == (uint)h );
+      sysAssert( LOG_TO_HANDLE(val) == (GCHandle*)h );
       if (type==0) { // create log
         ee->gcblk.dbg.nNewObjectUpdatesInCycle++;
       }
@@ -3517,7 +4699,7 @@ void gcDo_gcupdate(ExecEnv *ee, void *_h, void *_slot, void *_newval )
   *slot = newval;
   if (newval && ee->gcblk.snoop) {
     BUFFHDR *bh = &ee->gcblk.snoopBuffer;
-    gcBuffLogWordUnchecked( ee, bh, (uint)newval );
+    gcBuffLogWordUnchecked( ee, bh, LOG_HANDLE(newval) );
     ee->gcblk.cantCoop = false;
     gcBuffReserveWord( ee, bh );
   }
@@ -3554,7 +4736,7 @@ void gcDo_gcupdate_jvmglobal(ExecEnv* ee, void* _global, void *_newval )
   *slot = newval;
   if (newval && ee->gcblk.snoop) {
     BUFFHDR *bh = &ee->gcblk.snoopBuffer;
-    gcBuffLogWordUnchecked( ee, bh, (uint)newval );
+    gcBuffLogWordUnchecked( ee, bh, LOG_HANDLE(newval) );
     ee->gcblk.cantCoop = false;
     gcBuffReserveWord( ee, bh );
   }
@@ -8,10 +8,26 @@
 #define __RCGC__
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <math.h>
+
+/*
+ * Windows Vista or later: the heap is committed per NUMA node with
+ * VirtualAllocExNuma, and stalled allocators wait on a condition
+ * variable.  Neither is declared for an older target.
+ */
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
 #include <windows.h>
+/* bit scans, byte atomics and __debugbreak(), on x86 and x64 alike */
+#include <intrin.h>
+/* SSE2, for the sweep by RC bitmap words (see _sweepBlockByWords) */
+#include <emmintrin.h>
 
 #include "monitor.h"
+#include "jvm.h"
 
 //#ifdef DEBUG
 #define RCDEBUG
@@ -21,6 +37,21 @@
 
 #define RCNOINLINE
 
+/* RC, ZCT and local marks share a nibble per handle (see rcbmp.c) */
+//#define RCCOMBINEDMETA
+
+/* Update the bitmaps atomically; needed once several threads do */
+//#define RCATOMICBMP
+
+/* Free chunks are kept in a bitmap per block rather than in BLKOBJ lists */
+//#define RCFREEBMP
+
+/* 64-bit build: logs hold compressed handles, heaps up to 16GB (see BUFF) */
+//#define RCLP64
+
+/* Self-test the bitmaps in gcInit; takes seconds, for bitmap work only */
+//#define RCBMPTEST
+
 #define GCEXPORT
 #define GCFUNC static
 
@@ -71,6 +102,9 @@ typedef unsigned char    byte;
 typedef unsigned short   PAGEID;
 typedef unsigned short   PAGECNT;
 
+/* a handle's address as an integer, pointer sized */
+typedef size_t           haddr;
+
 /*******************************************************************
 *
 * An object (chunk of memory) as the chunk manager sees it.
@@ -79,11 +113,23 @@ typedef unsigned short   PAGECNT;
 typedef struct BLKOBJtag BLKOBJ;
 
 struct BLKOBJtag {
+#ifdef RCLP64
+  ptrdiff_t count;
+  ptrdiff_t unused;
+#else
   int      count;
   int      unused;
+#endif
   BLKOBJ   *next;
 };
 
+/*
+ * A chunk keeps next where a handle keeps logPos: the sweep takes a
+ * chunk whose next is set (ALLOC_LIST_NULL) for a logged object.
+ */
+typedef char _blkobjNextIsLogPos[ 
+  offsetof(BLKOBJ,next) == offsetof(GCHandle,logPos) ? 1 : -1 ];
+
 /*******************************************************************
 *
 * Object and page sizes.
@@ -95,9 +141,15 @@ struct BLKOBJtag {
 * words overhead per object: class pointer and log pointer.  In the
 * "handled" JVM we have a third extra poiner.
 */
+#ifdef RCLP64
+#define OBJGRAIN  16
+#define OBJBITS   4
+#define MINOBJ    32
+#else
 #define OBJGRAIN  8
 #define OBJBITS   3
 #define MINOBJ    16
+#endif
 #define OBJMASK   (~(OBJGRAIN-1))
 /*
  * Minimal size of a page for the design to work: 256 bytes.
@@ -135,13 +187,13 @@ struct BLKOBJtag {
 #define MAX_CHUNK_ALLOC     (BLOCKSIZE/2)
 
 /* address of first object on the block */
-#define OBJPAGE(o)       ((OBJECT*)(((unsigned)o) & (~BLOCKMASK)))
+#define OBJPAGE(o)       ((OBJECT*)(((haddr)o) & (~(haddr)BLOCKMASK)))
 
 /* offset of object in the block */
-#define OBJOFFSET(o)     (((unsigned)(o)) & BLOCKMASK)
+#define OBJOFFSET(o)     ((unsigned)(((haddr)(o)) & BLOCKMASK))
 
 /* number of block relative to address 0 */
-#define OBJBLOCKID(o)    (((unsigned)(o))>>BLOCKBITS)
+#define OBJBLOCKID(o)    (((haddr)(o))>>BLOCKBITS)
 
 /* Object's block header */
 #define OBJBLOCKHDR(o)   (&blkvar.blockHeaders[ OBJBLOCKID(o)])
@@ -165,7 +217,6 @@ struct BLKOBJtag {
 */
 
 #define   BLK           1 /* In the block manager */
-#define   BLKLIST       2 /* ---   " " -----------*/
 #define   CHUNKING      3 /* Just out of the block manager, going to be OWNED */
 #define   ALLOCBIG      4 /* Multiple-blocks object */
 #define   INTERNALBIG   5 /* In the middle of ALLOCBIG, only in DEBUG */
@@ -173,8 +224,9 @@ struct BLKOBJtag {
 #define   VOIDBLK       7 /* Chunked block, allocation exhausted. */
 #define   PARTIAL       8 /* Chunked block, sitting in a partial blocks list */
 #define   DUMMYBLK      9 /* Temporary state */
+#define   BLKCACHED    10 /* Free block, held in a NUMA node's block cache */
 
-#define   LASTMGRSTATE  BLKLIST
+#define   LASTMGRSTATE  BLK
 
 /*
 Page header format for: OWNED, VOIDPG, PARTIAL.
@@ -182,13 +234,27 @@ Page header format for: OWNED, VOIDPG, PARTIAL.
 Word 0:  <-------------------- nextPartial(32) ------------------------->
 Word 1:  <-------------------- prevPartal(32) -------------------------->
 Word 2:  <-------------------- freeList(32) ---------------------------->
-Word 3:  <-- status(8) --><-- lock(8) --><-------- binidx(16)  --------->
+Word 3:  <-- status(8) --><-- lock(8) --><s(1)><------ binidx(15) ----->
 
 In this case, the second word in the object pointed by "freeList"
-contains the number of objects in the list.  recycledList is cached
+contains the number of objects in the list.  With RCFREEBMP, word 2
+holds instead the number of bits set in the block's free bitmap (see
+BLKFREEBMP).  recycledList is cached
 (see below), the number of elements is held in the same manner at the
 second word of the first element of the list.
 
+"s" is the sweep-pending mark.  When sweeping is lazy it is set on every
+chunked block at the end of a tracing cycle and is cleared, by CAS, by
+whoever sweeps the block first: an allocating mutator or the collector.
+While a VOIDBLK block is sweep-pending, nextPartial and prevPartial link
+it into the sweep list of its bin.
+
+An OWNED block fresh from the block manager is handed out by bumping a
+cursor (see ALLOCLIST).  Meanwhile prevPartial holds the cursor: the
+objects at or above it have never been allocated and contain junk, so
+the sweep and _isHandle() must not look at them.  Otherwise prevPartial
+is NULL in an OWNED block.
+
 
 &&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
 
@@ -233,28 +299,9 @@ Word 3:  <-- status(8) --><--------------unused(24) -------------------->
 
 
 Next and prev are linked list pointers.  size is the size in pages of the
-regions.
-
-
-&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&&
-
-
-  Page header format for BLKLIST:
+regions.  The last block of a region of more than one block has its size
+set to -size so that a region can be found from its right neighbour.
 
-Word 0:  <---------------------- firstRegion --------------------------->
-Word 1:  <---------------------- nextList (32) ------------------------->
-Word 2:  <---------------------- size (32) ----------------------------->
-Word 3:  <-- status(8) --><------------ prevListIDX (24)  -------------->
-
-
-"firstRegion" is a pointer to a BLK block, the first on a linked list
-of regions with the same size.
-
-"nextList" points to the next list header (of type BLKLIST).  The pointer
-to the previous list is encoded in the field "prevListIDX" as an index
-into the allocatedPageHeaders array.
-
-"size" is the size of the region.  Each element in the list has this size.
 
 *************************************************************************/
 
@@ -264,15 +311,14 @@ into the allocatedPageHeaders array.
 */
 #define STATUSMAK     0xff000000
 #define LOCKMASK      0x00ff0000
-#define BINIDXMASK    0x0000ffff
-#define PREVLISTMASK  0x00ffffff
+#define SWEEPMASK     0x00008000
+#define BINIDXMASK    0x00007fff
 
 
 typedef struct BlkAllocHdrTAG          BlkAllocHdr;
 typedef struct BlkAllocBigHdrTAG       BlkAllocBigHdr;
 typedef struct BlkAllocInternalHdrTAG  BlkAllocInternalHdr;
 typedef struct BlkRegionHdrTAG         BlkRegionHdr;
-typedef struct BlkListHdrTAG           BlkListHdr;
 typedef struct BlkAnyHdrTAG            BlkAnyHdr;
 
 
@@ -298,13 +344,6 @@ struct BlkAllocInternalHdrTAG {
   volatile  word             StatusUnused;
 };
 
-struct BlkListHdrTAG {
-  BlkRegionHdr    *nextRegion;
-  BlkListHdr      *nextList;
-  volatile  int             listRegionSize;
-  volatile  word            StatusPrevListID;
-};
-
 struct BlkRegionHdrTAG {
   BlkRegionHdr   *nextRegion;
   BlkRegionHdr   *prevRegion;
@@ -312,6 +351,9 @@ struct BlkRegionHdrTAG {
   volatile  word           StatusUnused;
 };
 
+#define bhBumpTop(ph)  (*(byte *volatile *)&(ph)->prevPartial)
+#define bhFreeCount(ph) (*(volatile int*)&(ph)->freeList)
+
 struct BlkAnyHdrTAG {
   volatile word w0;
   volatile word w1;
@@ -342,26 +384,6 @@ struct BlkAnyHdrTAG {
 } while(0)
 
 
-/*
- * p is a pointer to BlkRegionHdr. Set and get the previous list IS.
- */
-#define bhGet_prev_region_list(p)  \
-    ((BlkListHdr*)&blkvar.allocatedBlockHeaders[(p)->StatusPrevListID & PREVLISTMASK])
-
-#define bhSet_prev_region_list(p,pBlkListHeader)  \
-do {\
-  word idx; \
-  word v; \
-  idx = (pBlkListHeader) - (BlkListHdr*)blkvar.allocatedBlockHeaders; \
-  mokAssert (idx < (word)(blkvar.nBlocks+2)); \
-  v = p->StatusPrevListID; \
-  v = v & ~PREVLISTMASK; \
-  v = v | idx; \
-  (p)->StatusPrevListID = v; \
-} while(0)
-
-
-
 /*
  * Set and get the status of any page
  */
@@ -376,14 +398,124 @@ do {\
 */
 #define N_QUICK_BLK_MGR_LISTS    5
 
+/*
+ * Regions of N_QUICK_BLK_MGR_LISTS blocks or more are kept in a two
+ * level segregated fit index.  The first level splits sizes by their
+ * highest bit, the second level splits each power of two range into
+ * REGION_SL_COUNT equal classes.  A bit is set in regionFlBits for each
+ * first level with a non-empty class, and in regionSlBits[fl] for each
+ * non-empty class of that level, so finding a fitting class is two bit
+ * scans.
+ */
+#define REGION_SL_BITS           3
+#define REGION_SL_COUNT          (1<<REGION_SL_BITS)
+#define REGION_FL_COUNT          (32-REGION_SL_BITS+1)
+
+/*
+ * The heap is reserved up front but committed on demand, HEAP_COMMIT_GRAIN
+ * bytes at a time, as the wilderness advances.  After each collection the
+ * trimmer may decommit free regions of at least trimMinBlocks blocks to
+ * bring the committed footprint down towards trimTargetMB.
+ */
+#define HEAP_COMMIT_GRAIN        (1<<20)
+
+/*
+ * Zeroed blocks.  blkvar.zeroed has a flag per block which is set while
+ * the block is free and known to hold only zeros: blocks never handed
+ * out, and blocks given back to the OS, which come back zeroed.  The
+ * flags of a block are cleared when it is handed out.  With zeroAheadMB
+ * set, chunked blocks are zeroed as they are freed and, after each
+ * collection, up to zeroAheadMB of the free regions are zeroed by the
+ * collector, so allocation need not clear memory which is known zero.
+ */
+#define ZERO_BATCH               16
+#define BLKZEROED(ph) \
+  blkvar.zeroed[ (BlkAllocHdr*)(ph) - blkvar.allocatedBlockHeaders ]
+
+/*
+ * Parallel sweeping.
+ *
+ * The block headers are split into SWEEP_RANGES_PER_WORKER ranges per
+ * worker.  The workers claim them one at a time (gcWorkClaim), so one
+ * which is done early takes on ranges another would be left with, and
+ * each walks the block headers of its ranges.  Whatever
+ * would touch a shared list (partial lists, observed-full buffers, the
+ * block manager) is recorded as a block header pointer tagged with one
+ * of the SWEEP_REC_* codes and carried out by the collector once all the
+ * workers are done.  A block yields at most one record so the records of
+ * a range are kept in blkvar.sweepRecords at the indices of the range.
+ */
+#define SWEEP_REC_TO_PARTIAL     0  /* VOIDBLK block to enter its partial list */
+#define SWEEP_REC_FREE_BLOCK     1  /* VOIDBLK block which is now all free */
+#define SWEEP_REC_FULL           2  /* PARTIAL block observed to be full */
+#define SWEEP_REC_FREE_BIG       3  /* dead big object */
+#define SWEEP_REC_MASK           3
+
+#define SWEEP_RECORD(w,ph,rec) \
+  ((w)->records[ (w)->nRecords++ ] = (word)(ph) | (rec))
+
+#define SWEEP_RANGES_PER_WORKER  8
+
+typedef struct SWEEPWORKER SWEEPWORKER;
+struct SWEEPWORKER {
+  BlkRegionHdr*  start;
+  BlkRegionHdr*  limit;
+  word*          records;
+  int            nRecords;
+#ifdef RCDEBUG
+  uint           nFreed;
+  uint           nBytesFreed;
+#endif
+  byte           pad[32];    /* workers write here, keep them apart */
+};
+
+/*
+ * NUMA.
+ *
+ * The heap is split into nNodes stripes of blocksPerNode blocks, each
+ * committed on its node, so a block's node follows from its index.
+ *
+ * Each node keeps a small cache of free single blocks.  Chunked blocks
+ * which become free go to the cache of the node owning their memory
+ * and blocks are allocated from the cache of the node the caller runs
+ * on.  The cache is padded to 256 bytes, like the partial lists.
+ */
+#define MAX_NUMA_NODES    4
+#define BLK_CACHE_SIZE    16
+
+/*
+ * Each thread also holds up to THREAD_BLK_BATCH BLKCACHED blocks of its
+ * own, taken from a node cache or the block manager a batch at a time
+ * (see blkAllocBlock).  They count in nThreadBlocks, and HS1 takes them
+ * back from each thread it suspends (see blkDrainThreadCache), so an
+ * idle thread doesn't hold on to them.
+ */
+#define THREAD_BLK_BATCH  8
+
+typedef struct BLKCACHE BLKCACHE;
+struct BLKCACHE {
+  word           lock;
+  int            n;
+  BlkAllocHdr*   blocks[ BLK_CACHE_SIZE ];
+  word           pad[64 - (BLK_CACHE_SIZE + 2)];
+};
+
+#define BLKNODE(ph) \
+  ((int)(((BlkAllocHdr*)(ph) - blkvar.allocatedBlockHeaders) / blkvar.blocksPerNode))
+
+#define BLKCURRENTNODE() \
+  (blkvar.nNodes > 1 ? mokCurrentNumaNode() % blkvar.nNodes : 0)
+
 struct BLKVAR {
-  BlkListHdr*    pRegionLists;
   BlkRegionHdr*  quickLists[ N_QUICK_BLK_MGR_LISTS ];
+  uint           regionFlBits;
+  uint           regionSlBits[ REGION_FL_COUNT ];
+  BlkRegionHdr*  regionLists[ REGION_FL_COUNT ][ REGION_SL_COUNT ];
   byte*          heapStart;
   byte*          heapTop;
   BlkRegionHdr*  heapTopRegion;
   BlkRegionHdr*  wildernessRegion;
-  word           heapSz;
+  size_t         heapSz;
   word           nBlocks;
   BlkAllocHdr    *blockHeaders;
   BlkAllocHdr*   allocatedBlockHeaders;
@@ -391,11 +523,53 @@ struct BLKVAR {
   int            nWildernessBlocks;
   int            nListsBlocks;
   int            nAllocatedBlocks;
+  bool           largePages;
+  byte*          commitTop;
+  int            nCommittedBlocks;
+  int            nDecommittedBlocks;
+  int            idleTrend;
+  byte*          decommitted;
+  byte*          zeroed;
+  word*          sweepRecords;
+  SWEEPWORKER*   sweepRanges;
+  int            nSweepRanges;
+  volatile long  nextSweepRange;
+  int            nNodes;
+  word           blocksPerNode;
+  volatile long  nCachedBlocks;     /* in the node caches */
+  volatile long  nThreadBlocks;     /* in the threads' caches */
+  BlkAllocHdr*   drainedBlocks;     /* taken back at HS1, via nextPartial */
+  volatile long  nBlocksHandedOut;   /* to threads, for the pacer */
+  BLKCACHE       nodeCaches[ MAX_NUMA_NODES ];
+#ifdef RCFREEBMP
+  uint*          freeBmps;
+#endif
 };
 
+#ifdef RCFREEBMP
+/*
+ * Free bitmaps.  A block's bitmap has a bit per object grain, which is
+ * set at the start of each free object held by the block.  Objects
+ * taken by an allocation list are no longer in it.  Updated under the
+ * block lock.
+ */
+#define FREEBMP_WORDS     ((BLOCKSIZE >> OBJBITS) / 32)
+#define BLKFREEBMP(ph) \
+  (blkvar.freeBmps + ((ph) - blkvar.allocatedBlockHeaders)*FREEBMP_WORDS)
+#endif /* RCFREEBMP */
+
 
 #define FREE_BLOCKS() \
-  (((blkvar.nListsBlocks*gcvar.opt.listBlkWorth)/100)+blkvar.nWildernessBlocks)
+  ((((blkvar.nListsBlocks+blkvar.nCachedBlocks+blkvar.nThreadBlocks)* \
+     gcvar.opt.listBlkWorth)/100)+ \
+   blkvar.nWildernessBlocks)
+
+/* 
+ * The free blocks any thread can allocate right now, unweighted.  Those
+ * in the threads' caches join them at the next HS1.
+ */
+#define ALLOCATABLE_BLOCKS() \
+  (blkvar.nListsBlocks+blkvar.nCachedBlocks+blkvar.nWildernessBlocks)
 
 /***************************************************************************
  * Block manager exports 
@@ -416,19 +590,18 @@ GCEXPORT  BlkAllocBigHdr*   blkAllocRegion( unsigned nBytes, ExecEnv *ee );
 * 
 * Recycled lists cache.
 *
-* The cache is simply an array of pointers to blocks.  The blocks are
-* linked in a circular list with the first element holding the number
-* of elements in the list.
+* The cache is simply an array of pointers to objects, an entry per
+* block, indexed like the block headers.  The objects which are freed
+* in a block are linked in a circular list with the first element
+* holding the number of elements in the list.
 *
-* Collisions are treated by flushing an entry.  Meaning: adding the
-* list to the block's free list.
-*/
-
-/* 
-* this ration defines the number of blocks per recycled lists cache
-* entry.
+* The entries which are in use are pushed on a stack when they are
+* first used, and flushed, meaning: their list is added to the block's
+* free list, all at once by chkFlushRecycledListsCache() at the end of
+* a reclamation pass.  So each block is locked once per pass.
 */
-#define RLCACHE_RATIO               10
+#define RLCENTRY_OF(o) \
+  (&chunkvar.rlCache[ OBJBLOCKHDR(o) - blkvar.allocatedBlockHeaders ])
 
 typedef struct RLCacheEnteryTAG RLCENTRY;
 
@@ -441,8 +614,8 @@ struct RLCacheEnteryTAG {
 * Partial Lists to Block Manager evacuation thresholds.
 *
 */
-#define MAX_OBSERVED_FULL_PER_LIST  2
-#define MAX_OBSERVED_FULL           4
+#define MAX_OBSERVED_FULL_PER_LIST  16
+#define MAX_OBSERVED_FULL           64
 
 /**************************************************************************
 *
@@ -451,6 +624,26 @@ struct RLCacheEnteryTAG {
 * These structures are embedded in the threads EE for fast allocation.
 * Each thread has an allocation list per bin size.
 *
+* A block taken from the block manager is not chunked up front.  Its
+* objects are handed out from "cursor" up to "limit", objSize at a time,
+* and the cursor is published in the block header as it moves (see
+* bhBumpTop).  Blocks taken from partial lists are allocated from "head".
+*
+* "bumpZero" tells whether the block was all zero when it was taken, in
+* which case objects handed out from the cursor are zero as well.
+* "lastBumped" tells whether the object last handed out came from the
+* cursor.
+*
+* Objects handed out from the cursor are not logged one by one in the
+* create buffer.  Once initialized they are counted in by moving
+* "createTop" past them, and the objects from "createStart" up to
+* "createTop" are logged as a range when the block is used up or when
+* the collector takes the create buffers (see gcBuffLogBumpedHandle).
+*
+* With RCFREEBMP there are no lists: the allocation list takes one word
+* of its block's free bitmap at a time, "freeWord" is its index and the
+* bits not yet allocated are in "freeBits".
+*
 */
 
 typedef struct AllocListTAG ALLOCLIST;
@@ -461,10 +654,20 @@ struct AllocListTAG {
   BLKOBJ*        head;
   BlkAllocHdr*   allocBlock;
   int            binIdx;
+  byte*          cursor;
+  byte*          limit;
+  int            objSize;
+  bool           bumpZero;
+  bool           lastBumped;
+  byte*          createStart;
+  byte*          createTop;
+#ifdef RCFREEBMP
+  uint           freeBits;
+  int            freeWord;
+#endif
 };
 
 
-#define OutOfMemory()   mokAssert(0)
 #define ALLOC_RETRY     (20)
 
 
@@ -472,14 +675,63 @@ struct AllocListTAG {
 *
 * Bins conversion tables.
 *
+* The bin sizes are set up at startup, either the built-in ones or ones
+* fitted to an allocation size histogram (see _initChunkConv()), so the
+* number of bins is only known then.  Arrays are sized by MAX_BINS.
+*
+* sizeHist counts allocations per size, in OBJGRAIN units, when the
+* binProfile option is on.  It is written out by chkWriteSizeHistogram(),
+* from the VM's exit procedures.
 */
-#define N_BINS  (27)
+#define MAX_BINS  (64)
+#define N_BINS    (chkconv.nBins)
+
+#define BIN_HIST_ENTRIES  ((MAX_CHUNK_ALLOC >> OBJBITS) + 1)
+#define BIN_HIST_FILE     "gcbins.txt"
+
+#define chkProfileSize(nbytes) \
+do { \
+  if (gcvar.opt.binProfile) \
+    chkconv.sizeHist[ ((nbytes) + OBJGRAIN-1) >> OBJBITS ]++; \
+} while (0)
+
+/*
+ * A word of the RC bitmap holds the counts of RC_HANDLES_PER_WORD
+ * handles, in fields of RC_FIELD_BITS, so a block's counts take
+ * RC_WORDS_PER_BLOCK words.  binStartMask has the low bit of the field
+ * of each object start in a block of the bin set.
+ *
+ * RC_ZERO_FIELDS(w) has the low bit of a field set iff the handle has
+ * a zero count (and, with the combined layout, is not in the ZCT).
+ * RC_ZERO_FIELDS4(w,s) does the same for four words at once and masks
+ * the result with "s".
+ */
+#ifdef RCCOMBINEDMETA
+#define RC_HANDLES_PER_WORD    8
+#define RC_FIELD_BITS          4
+#define RC_BMP_WORD(h)         ((uint*)HMETA_BYTE( gcvar.metaBmp.entry, (haddr)(h) ))
+#define RC_ZERO_FIELDS(w)      (~((w) | ((w)>>1) | ((w)>>2)))
+#define RC_ZERO_FIELDS4(w,s) \
+  _mm_andnot_si128( _mm_or_si128( _mm_or_si128( (w), _mm_srli_epi32( (w), 1 ) ), \
+                                  _mm_srli_epi32( (w), 2 ) ), (s) )
+#else
+#define RC_HANDLES_PER_WORD    16
+#define RC_FIELD_BITS          2
+#define RC_BMP_WORD(h)         ((uint*)H2BIT_BYTE( gcvar.rcBmp.entry, (haddr)(h) ))
+#define RC_ZERO_FIELDS(w)      (~((w) | ((w)>>1)))
+#define RC_ZERO_FIELDS4(w,s) \
+  _mm_andnot_si128( _mm_or_si128( (w), _mm_srli_epi32( (w), 1 ) ), (s) )
+#endif
+#define RC_WORDS_PER_BLOCK     ((BLOCKSIZE >> OBJBITS) / RC_HANDLES_PER_WORD)
 
 struct CHKCONV {
+  int nBins;
   int szToBinIdx[ BLOCKSIZE ];
   int szToBinSize[ BLOCKSIZE ];
-  int binSize[ N_BINS ];
-  int binToObjectsPerBlock[ N_BINS ];
+  int binSize[ MAX_BINS ];
+  int binToObjectsPerBlock[ MAX_BINS ];
+  uint binStartMask[ MAX_BINS ][ RC_WORDS_PER_BLOCK ];
+  uint sizeHist[ BIN_HIST_ENTRIES ];
 };
 
 
@@ -487,24 +739,29 @@ struct CHKCONV {
 *
 * Partial lists.
 *
-* A partial list is a list of blocks which have some free chunks on them.  The
-* pages are linked in a doubly linked list whose head is in this structure.
+* A partial list is a list of blocks which have some free chunks on them.  It
+* is a lock-free stack: the blocks are linked through nextPartial and "top"
+* packs the index of the first one with a 32 bit tag (see rcchunkmgr.c).
 *
-* There is a list per each bin size.
+* There is a list per each bin size and NUMA node.  A block enters the
+* list of the node owning its memory.
 *
-* The list also contains a remembered set of blocks which have been observed to
-* be full.
+* The list also counts the blocks which have been observed to be full since
+* it was last flushed.
 *
-* Finally the list contains a lock and therefore it is padded to a total size
+* Next to it sits the list of VOIDBLK blocks of the same bin which are waiting
+* to be lazily swept.  It has its own lock.
+*
+* The list is updated by CAS and therefore it is padded to a total size
 * of 256 bytes (assuming this is bigger or equal to the contention granule) 
 * in order to prevent false sharing with other partial lists.
 */
 struct PARTIALLISTtag {
-  BlkAllocHdr  *firstBlock;
-  word         lock;
+  volatile LONGLONG top;
   int          nObservedFull;
-  BlkAllocHdr  *observedFull[ MAX_OBSERVED_FULL_PER_LIST ];
-  word         pad[64 - (MAX_OBSERVED_FULL_PER_LIST +3) ];
+  BlkAllocHdr  *firstSweepBlock;
+  word         sweepLock;
+  word         pad[64 - 5];
 };
 
 
@@ -517,13 +774,18 @@ typedef struct PARTIALLISTtag PARTIALLIST;
 *
 */
 struct CHUNKVAR {
-  PARTIALLIST   partialLists[ N_BINS ];
-  int           nBlocksInPartialList[ N_BINS ];
-  int           nCacheEntries;
+  PARTIALLIST   partialLists[ MAX_NUMA_NODES ][ MAX_BINS ];
+  int           nBlocksInPartialList[ MAX_BINS ];
   RLCENTRY      *rlCache;
+  RLCENTRY      **rlDirty;
+  int           nDirty;
   int           nObservedFull;
   int           nTrulyFull;
   BlkAllocHdr*  trulyFull[ MAX_OBSERVED_FULL ];
+
+  /* lazy sweeping */
+  volatile bool lazySweepActive;
+  volatile long nLazySweepers;
 };
 
 
@@ -533,43 +795,72 @@ struct CHUNKVAR {
 *
 */
 GCEXPORT  int      chkCountPartialBlocks(void);
+GCEXPORT  void     chkWriteSizeHistogram(void);
 GCEXPORT  BLKOBJ*  chkAllocSmall(ExecEnv* ee, unsigned binIdx);
 GCEXPORT  void     chkReleaseAllocLists( ExecEnv *ee);
 
+/*
+ * Take the next object off an allocation list's own free objects: its
+ * BLKOBJ list, or its word of the free bitmap (see ALLOCLIST).
+ */
+#ifdef RCFREEBMP
+#define _allocListHasFree( allocList, head )  ((allocList)->freeBits)
+#define _allocListNext( allocList, head, __res )\
+do {\
+   uint __bits = (allocList)->freeBits;\
+   int  __grain = (allocList)->freeWord*32 + _lowestBit( __bits );\
+   (allocList)->freeBits = __bits & (__bits-1);\
+   (BLKOBJ*)__res = (BLKOBJ*)\
+     ((byte*)BLOCKHDROBJ( (allocList)->allocBlock ) + (__grain << OBJBITS));\
+} while (0)
+#else
+#define _allocListHasFree( allocList, head )  ((head) != ALLOC_LIST_NULL)
+#define _allocListNext( allocList, head, __res )\
+do {\
+   (allocList)->head = (head)->next;\
+   (BLKOBJ*)__res = (head);\
+} while (0)
+#endif /* RCFREEBMP */
+
 #ifndef RCDEBUG
 
 #define chkPreCollect(__o) \
 do{\
-  word blockid;\
   RLCENTRY *rlce;\
   BLKOBJ *head;\
   BLKOBJ *o = (BLKOBJ*)(__o);\
 \
-  blockid = OBJBLOCKID(o);\
-  rlce = &chunkvar.rlCache[blockid % chunkvar.nCacheEntries];\
+  rlce = RLCENTRY_OF(o);\
   head = rlce->recycledList;\
         \
-  if ((((word)head) ^ ((word)o)) < BLOCKSIZE) {\
+  if (head) {\
     o->next  = head->next;\
     head->next = o;\
     head->count ++;\
-    goto __chkPreCollect_done_;\
   }\
-  if (head) \
-    chkFlushRecycledListEntry( rlce );\
-        \
-  o->count = 1;\
-  o->next  = o;\
-  rlce->recycledList = o;\
-__chkPreCollect_done_:;\
+  else {\
+    o->count = 1;\
+    o->next  = o;\
+    rlce->recycledList = o;\
+    chunkvar.rlDirty[ chunkvar.nDirty++ ] = rlce;\
+  }\
 } while(0)
 
 #define _allocFromOwnedBlockInlined( allocList, __res )\
 do {\
    BLKOBJ *head = allocList->head;\
-   if (head != ALLOC_LIST_NULL) {\
-      allocList->head = head->next;\
-      (BLKOBJ*)__res = head;\
+   byte *cur = allocList->cursor;\
+   if (cur < allocList->limit) {\
+      ((BLKOBJ*)cur)->next = ALLOC_LIST_NULL;\
+      (BLKOBJ*)__res = (BLKOBJ*)cur;\
+      cur += allocList->objSize;\
+      allocList->cursor = cur;\
+      allocList->lastBumped = true;\
+      bhBumpTop( allocList->allocBlock ) = cur;\
+   }\
+   else if (_allocListHasFree( allocList, head )) {\
+      _allocListNext( allocList, head, __res );\
+      allocList->lastBumped = false;\
    }\
    else {\
       __res = NULL;\
@@ -615,7 +906,7 @@ struct H1BIT_BMP {
   byte *entry;
   byte *bmp;
   byte *rep_addr;
-  unsigned bmp_size;
+  size_t bmp_size;
 };
 
 /************************************************************************
@@ -627,27 +918,63 @@ struct H2BIT_BMP {
   byte *entry;
   byte *bmp;
   byte *rep_addr;
-  unsigned bmp_size;
+  size_t bmp_size;
+};
+
+/************************************************************************
+*
+* Combined metadata BMP, a nibble per handle
+*/
+typedef struct HMETA_BMP HMETA_BMP;
+struct HMETA_BMP {
+  byte *entry;
+  byte *bmp;
+  byte *rep_addr;
+  size_t bmp_size;
 };
 
+#define HMETA_RC          3U
+#define HMETA_ZCT         4U
+#define HMETA_LOCAL       8U
+
 /*
 * 
 * Include inline vertions of bmp functions:
 
-void H1BIT_Set(byte* entry, unsigned h);
-void H1BIT_Clear(byte* entry, unsigned h);
-void H1BIT_Put(byte* entry, unsigned h, unsigned val);
-byte H1BIT_Get(byte* entry, unsigned h);
-void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size );
-
-void H2BIT_Put(byte* entry, unsigned h, unsigned val);
-void H2BIT_Clear(byte* entry, unsigned h);
-void H2BIT_Stuck(byte* entry, unsigned h);
-byte H2BIT_Get(byte* entry, unsigned h);
-void H2BIT_Inc(byte* entry, unsigned h);
-byte H2BIT_IncRV(byte* entry, unsigned h);
-byte H2BIT_Dec(byte* entry, unsigned h);
-void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size );
+void H1BIT_Set(byte* entry, haddr h);
+void H1BIT_Clear(byte* entry, haddr h);
+void H1BIT_Put(byte* entry, haddr h, unsigned val);
+byte H1BIT_Get(byte* entry, haddr h);
+void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, size_t rep_size );
+
+void H2BIT_Put(byte* entry, haddr h, unsigned val);
+void H2BIT_Clear(byte* entry, haddr h);
+void H2BIT_Stuck(byte* entry, haddr h);
+byte H2BIT_Get(byte* entry, haddr h);
+void H2BIT_Inc(byte* entry, haddr h);
+byte H2BIT_IncRV(byte* entry, haddr h);
+byte H2BIT_Dec(byte* entry, haddr h);
+void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, size_t rep_size );
+
+void H1BIT_AtomicSet(byte* entry, haddr h);
+void H1BIT_AtomicClear(byte* entry, haddr h);
+void H2BIT_AtomicStuck(byte* entry, haddr h);
+void H2BIT_AtomicInc(byte* entry, haddr h);
+byte H2BIT_AtomicIncRV(byte* entry, haddr h);
+byte H2BIT_AtomicDec(byte* entry, haddr h);
+
+byte HMETA_GetRC(byte* entry, haddr h);
+void HMETA_Inc(byte* entry, haddr h);
+byte HMETA_IncRV(byte* entry, haddr h);
+byte HMETA_Dec(byte* entry, haddr h);
+byte HMETA_Get(byte* entry, haddr h, unsigned flag);
+void HMETA_Set(byte* entry, haddr h, unsigned flag);
+void HMETA_Clear(byte* entry, haddr h, unsigned flag);
+byte HMETA_AtomicIncRV(byte* entry, haddr h);
+byte HMETA_AtomicDec(byte* entry, haddr h);
+void HMETA_AtomicSet(byte* entry, haddr h, unsigned flag);
+void HMETA_AtomicClear(byte* entry, haddr h, unsigned flag);
+void HMETA_Init(HMETA_BMP* bmp, unsigned* rep_addr, size_t rep_size );
 
 Functions that have a return value have "Inlined" appended to their name
 e.g H1BIT_GetInlined( entry, h, __res_var) where __res_var is the *name*
@@ -676,6 +1003,46 @@ do {\
         __res_var = H2BIT_Dec(entry, h );\
 } while (0)
 
+#define H2BIT_AtomicIncRVInlined( entry, h, __res_var)\
+do {\
+        __res_var = H2BIT_AtomicIncRV(entry, h );\
+} while (0)
+
+#define H2BIT_AtomicDecInlined( entry, h, __res_var)\
+do {\
+        __res_var = H2BIT_AtomicDec(entry, h );\
+} while (0)
+
+#define HMETA_GetRCInlined( entry, h, __res_var)\
+do {\
+        __res_var = HMETA_GetRC(entry, h );\
+} while (0)
+
+#define HMETA_IncRVInlined( entry, h, __res_var)\
+do {\
+        __res_var = HMETA_IncRV(entry, h );\
+} while (0)
+
+#define HMETA_DecInlined( entry, h, __res_var)\
+do {\
+        __res_var = HMETA_Dec(entry, h );\
+} while (0)
+
+#define HMETA_GetInlined( entry, h, flag, __res_var)\
+do {\
+        __res_var = HMETA_Get(entry, h, flag );\
+} while (0)
+
+#define HMETA_AtomicIncRVInlined( entry, h, __res_var)\
+do {\
+        __res_var = HMETA_AtomicIncRV(entry, h );\
+} while (0)
+
+#define HMETA_AtomicDecInlined( entry, h, __res_var)\
+do {\
+        __res_var = HMETA_AtomicDec(entry, h );\
+} while (0)
+
 
 #else /* ! RCNOINLINE */
 
@@ -707,6 +1074,52 @@ do {\
 #define BUFF_LINK_MARK            1U
 #define BUFF_HANDLE_MARK          2U
 #define BUFF_DUP_HANDLE_MARK      3U
+
+/*
+ * Log entries are 32 bits wide, with the mark in the low two bits.
+ *
+ * In the 32-bit build an entry is the pointer itself.  With RCLP64 a
+ * handle is logged as its offset from logHandleBase in OBJGRAIN units,
+ * shifted left by two to make room for the mark, which allows heaps of
+ * up to 2^30 grains.  Buffers are carved out of one reserved arena so
+ * that links between them, and the buffer pointers kept in the
+ * reserved slots, are logged as offsets into it.  Both bases lie one
+ * unit below their area so that zero still stands for NULL.
+ */
+#ifdef RCLP64
+#define MAX_HEAP_MB               ((1<<(30+OBJBITS-20)) - 1)
+#define BUFF_ARENA_SIZE           ((size_t)1<<31)
+#define LOG_HANDLE(h)  \
+  ((h) ? (uint)(((byte*)(h) - gcvar.logHandleBase) >> (OBJBITS-2)) : 0U)
+#define LOG_TO_HANDLE(w)  \
+  (((w)&~3) ? (GCHandle*)(gcvar.logHandleBase + ((size_t)((w)&~3) << (OBJBITS-2))) : NULL)
+#define LOG_LINK(p)  \
+  ((p) ? (uint)((byte*)(p) - gcvar.logBuffBase) : 0U)
+#define LOG_TO_LINK(w)  \
+  (((w)&~3) ? (uint*)(gcvar.logBuffBase + ((w)&~3)) : NULL)
+#else
+#define MAX_HEAP_MB               ((1<<BLOCKBITS) - 1)
+#define LOG_HANDLE(h)             ((uint)(h))
+#define LOG_TO_HANDLE(w)          ((GCHandle*)((w)&~3))
+#define LOG_LINK(p)               ((uint)(p))
+#define LOG_TO_LINK(w)            ((uint*)((w)&~3))
+#endif /* RCLP64 */
+
+/*
+ * Objects bumped out of a block are logged in the create buffer as a
+ * range: the first object marked with BUFF_HANDLE_MARK, followed in the
+ * same buffer by the end of the range marked with BUFF_DUP_HANDLE_MARK.
+ * The objects are a bin size apart, the bin is the block's.  Until the
+ * collector has cleared them, the logPos of such objects is
+ * LOG_IMPLICIT_POS, a word which is always zero.
+ */
+#define LOG_IMPLICIT_POS          (&gcvar.implicitLogWord)
+#define LOG_RANGE_OBJSIZE(h) \
+  (chkconv.binSize[ bhGet_bin_idx( OBJBLOCKHDR( h ) ) ])
+
+/* decode an entry of any kind: a link, or a handle otherwise */
+#define LOG_TO_PTR(w)  \
+  (((w)&3)==BUFF_LINK_MARK ? LOG_TO_LINK(w) : (uint*)LOG_TO_HANDLE(w))
         
 #ifdef RCDEBUG
 #define N_RESERVED_SLOTS 8
@@ -736,7 +1149,90 @@ struct BUFFHDR {
 GCEXPORT void gcBuffConditionalLogHandle(ExecEnv *ee, GCHandle *h);
 GCEXPORT void gcBuffLogWord(ExecEnv *ee, BUFFHDR *bh, uint w);
 GCEXPORT void gcBuffLogNewHandle(ExecEnv *ee, GCHandle *h);
+GCEXPORT void gcBuffLogBumpedHandle(ExecEnv *ee, ALLOCLIST *allocList, 
+                                    GCHandle *h);
+
+
+/*******************************************************************************
+*
+* Allocation sampling
+*
+* With allocSampleKB set, about one allocation in every allocSampleKB
+* kilobytes is recorded: its size, bin (-1 for a big object), class (or
+* array type) and the methods of the innermost SAMPLE_DEPTH Java frames.  The distance
+* to the next sample is drawn from an exponential distribution, so an
+* object's chance to be sampled only depends on its size.
+*
+* Each thread counts down the bytes it allocates and keeps its samples
+* in a ring of SAMPLE_RING entries.  When sampling is off the countdown
+* starts at SAMPLE_OFF, so all cacheAlloc() pays is the subtraction.
+* gcWriteAllocProfile() writes the samples of all threads into
+* SAMPLE_PROFILE_FILE.  It is called from the VM's exit procedures when
+* sampling is on, and may be called on request at any other time.  The file is in the Java
+* heap profile format of pprof, which carries the names of the classes
+* and methods, so "pprof gcallocs.prof" needs no symbol lookup.  pprof
+* scales the samples of this format as if taken every 512KB, so the
+* estimated totals are right with allocSampleKB=512 and only the shares
+* are right with other values.
+*/
+#define SAMPLE_RING          1024
+#define SAMPLE_DEPTH         8
+#define SAMPLE_OFF           0x7fffffff
+#define SAMPLE_PROFILE_FILE  "gcallocs.prof"
+
+typedef struct ALLOCSAMPLE {
+  uint                 size;
+  int                  bin;
+  int                  type;
+  ClassClass*          cb;
+  int                  depth;
+  struct methodblock*  stack[ SAMPLE_DEPTH ];
+} ALLOCSAMPLE;
+
+#define gcSampleAlloc( ee, h, nbytes, bin ) \
+do { \
+  if (((ee)->gcblk.sampleCountdown -= (int)(nbytes)) < 0) \
+    gcRecordAllocSample( (ee), (h), (nbytes), (bin) ); \
+} while (0)
 
+GCEXPORT void gcRecordAllocSample(ExecEnv *ee, GCHandle *h,
+                                  uint nbytes, int bin);
+GCEXPORT void gcWriteAllocProfile(void);
+
+/*******************************************************************************
+*
+* Allocation stalls
+*
+* An allocator which finds no memory queues itself, with the number of
+* blocks it needs, and sleeps on the stall condition variable.  Every
+* STALL_WAKE_BATCH blocks the reclaim or the sweep frees, and once more
+* when either is done, the collector goes over the queue in order and
+* wakes the stalled threads for which enough blocks can be allocated,
+* counting the blocks each needs against those, and stops at the first
+* there aren't enough for.  Nothing is reserved for a woken thread: it
+* allocates like any other and may lose the blocks to a running one, in
+* which case it may stall again.  At the end of a cycle the rest are woken
+* to try again.  With stallTimeoutMs a thread gives up after waiting
+* that long and its allocation fails.
+*/
+#define STALL_WAKE_BATCH  16
+
+enum STALLSTATE { 
+  STALL_NONE=0, 
+  STALL_WAITING, 
+  STALL_SATISFIED, 
+  STALL_CYCLE_DONE, 
+  STALL_TIMEDOUT 
+};
+
+typedef struct STALLREQ STALLREQ;
+struct STALLREQ {
+  STALLREQ*     next;
+  uint          nBlocks;
+  volatile int  state;
+};
+
+GCEXPORT bool gcStallForMemory(ExecEnv *ee, uint nBlocks);
 
 /*******************************************************************************
 *
@@ -757,7 +1253,17 @@ struct GCTHREADBLK {
   BUFFHDR   createBuffer;
   BUFFHDR   snoopBuffer;
 
-  ALLOCLIST allocLists[ N_BINS ];
+  ALLOCLIST allocLists[ MAX_BINS ];
+  BlkAllocHdr *blkCache[ THREAD_BLK_BATCH ];
+  int       nBlkCache;
+
+  // allocation sampling
+  int       sampleCountdown;
+  uint      sampleSeed;
+  uint      nSamples;
+  ALLOCSAMPLE *samples;
+
+  STALLREQ  stall;
 #ifdef RCDEBUG
   struct {
     int nBytesAllocatedInCycle;
@@ -768,9 +1274,14 @@ struct GCTHREADBLK {
 #endif // RCDEBUG
 };
 
+/*
+ * The allocation lists of a dead thread, parked for the next thread
+ * that attaches.  Used only with the parkAllocLists option; otherwise
+ * a detaching thread gives its blocks back (chkRetireAllocList).
+ */
 typedef struct SAVEDALLOCLISTS {
   struct SAVEDALLOCLISTS *pNext;
-  ALLOCLIST allocLists[ N_BINS ];
+  ALLOCLIST allocLists[ MAX_BINS ];
 } SAVEDALLOCLISTS;
 
 /***********************************************************************************
@@ -786,7 +1297,36 @@ enum GCSTAGE { GCHS1=1, GCHS2=2, GCHS3=3, GCHS4=0, GCHSNONE=0x12345678};
 
 enum GCTYPE { GCT_TRACING=0, GCT_RCING=1 };
 
-#define N_SAMPLES 4
+/*
+ * Collector worker threads.  These are plain win32 threads which help the
+ * collector thread with parallel phases.  The collector itself is worker
+ * number zero.  There are nGCWorkers of them in all, or nSweepWorkers
+ * which was the option's name when only the sweep used them.
+ *
+ * With gcCpuMask the collector and its workers run on the CPUs in the
+ * mask, each pinned to one of them, round robin, with gcCpuDedicated.
+ * The mask takes all 32 bits, e.g. gcCpuMask=0x80000000 for CPU 31.
+ * Their priority is given on the Java scale: the collector's is uniPrio
+ * or multiPrio, the workers' is workerPrio or else the collector's.
+ */
+#define MAX_GC_WORKERS  16
+#define GC_THREAD_STACK (64*1024)
+
+#define GC_POOL_SIZE() \
+  (gcvar.opt.nGCWorkers ? gcvar.opt.nGCWorkers : gcvar.opt.nSweepWorkers)
+
+#define GC_THREAD_PRIO() \
+  (sysGetSysInfo()->isMP ? gcvar.opt.multiPrio : gcvar.opt.uniPrio)
+
+typedef void (*GCWORKFUNC)( int iWorker, void *arg );
+
+typedef struct GCWORKER GCWORKER;
+struct GCWORKER {
+  HANDLE   hThread;
+  HANDLE   hGo;
+  HANDLE   hDone;
+  int      iWorker;
+};
 
 struct GCVAR {
   bool           initialized;
@@ -799,8 +1339,40 @@ struct GCVAR {
   // triggering
   bool           memStress;
   bool           usrSyncGC;
+  STALLREQ*      stallHead;
+  STALLREQ*      stallTail;
+  CRITICAL_SECTION   stallLock;
+  CONDITION_VARIABLE stallCond;
+  volatile long  nFreedSinceWake;
   int            gcTrigHigh;
-  int            runHist[2][N_SAMPLES];
+  int            nFreeBlocksAtStart;
+  uint           buffTrig;
+
+  // pacer measures, see _pace()
+  struct {
+    uint  cycleStart;
+    uint  lastEnd;
+    long  handedAtLastEnd;
+    float allocRate;   /* blocks handed out per ms */
+    float buffRate;    /* log buffers per ms */
+    float cycleMs;
+  } pacer;
+
+  // cost model of the cycle types, see _recommendCollectionMethod()
+  struct {
+    int         nBuffs;           /* logged since the last cycle */
+    uint        typeMs;           /* of the type specific phases */
+    int         nUsedAfterTrace;
+    int         nUnrecovered;
+    volatile long nStuck;         /* counters stuck in this cycle */
+    int         nStuckSinceTrace;
+    float       stuckPerBuff;
+    float       rcMsPerBuff;
+    float       traceMsPerBlock;
+    float       estRC;
+    float       estTrace;
+    const char* reason;
+  } cost;
   
   ExecEnv*       ee;
   sys_thread_t*  sys_thread; 
@@ -809,14 +1381,20 @@ struct GCVAR {
   uint*          updateBuffList;
   uint*          snoopBuffList;
   uint*          deadThreadsCreateBuffList;
+  BUFFHDR        rangeBuff;
+  uint           implicitLogWord;
   uint*          deadThreadsUpdateBuffList;
   uint*          deadThreadsSnoopBuffList;
   uint*          deadThreadsReinforceBuffList;
   uint*          reinforceBuffList;
   GCHandle**     tempReplicaSpace;
+#ifdef RCCOMBINEDMETA
+  HMETA_BMP      metaBmp;
+#else
   H1BIT_BMP      localsBmp;
   H2BIT_BMP      rcBmp;
   H1BIT_BMP      zctBmp;
+#endif
   BUFFHDR        zctBuff;
   BUFFHDR        nextZctBuff;
   BUFFHDR        tmpZctBuff;
@@ -830,14 +1408,30 @@ struct GCVAR {
   sys_mon_t*     requesterMon;
   SAVEDALLOCLISTS *pListOfSavedAllocLists;
 
+  // allocation samples of dead threads
+  ALLOCSAMPLE*   deadSamples;
+  uint           nDeadSamples;
+
+  // worker threads
+  int            nWorkers;
+  GCWORKER       workers[ MAX_GC_WORKERS ];
+  GCWORKFUNC     workFunc;
+  void*          workArg;
+
   // chunk mgmt
   uint nAllocatedChunks;
   uint nChunksAllocatedRecentlyByUser;
   uint nUsedChunks;
   uint nFreeChunks;
+#ifdef RCLP64
+  // log entry encoding, see BUFF
+  byte *logHandleBase;
+  byte *logBuffBase;
+  byte *buffArenaTop;
+#endif
 
-  // settable options
-  struct {
+  // settable options, see gcSetOption()
+  struct GCOPTS {
     int recommendOnlyRCGC;
     int useOnlyRCGC;
     int useOnlyTracingGC;
@@ -849,7 +1443,30 @@ struct GCVAR {
     int lowerTrigDec;
     int uniPrio;
     int multiPrio;
+    int lazySweep;
+    int nSweepWorkers;
+    int numaAware;
+    int nBins;
+    int binProfile;
+    int trimTargetMB;
+    int trimMinBlocks;
+    int largePages;
+    int zeroAheadMB;
+    int parkAllocLists;
+    int allocSampleKB;
+    int pacer;
+    int pacerHeadroom;
+    int pacerBudget;
+    int nGCWorkers;
+    int gcCpuMask;
+    int gcCpuDedicated;
+    int workerPrio;
+    int stallTimeoutMs;
   } opt;
+  struct GCOPTS  pendingOpt;
+  bool           optPending;
+  bool           optFrozen;
+  volatile unsigned optLock;
 
 #ifdef RCDEBUG
 
@@ -969,6 +1586,29 @@ GCEXPORT bool  gcValidHandle( GCHandle *h);
 GCEXPORT void  gcThreadAttach(ExecEnv *ee);
 GCEXPORT void  gcThreadDetach(ExecEnv *ee);
 GCEXPORT void  gcThreadCooperate(ExecEnv *ee);
+GCEXPORT int   gcGetCollectionChoice(const char **pReason, 
+                                     float *pEstRC, float *pEstTrace);
+
+/*
+ * Options.  Set in order of precedence by gcSetOption() or gcSetOptions()
+ * (the command line), the YLRC_GCOPT environment variable, gcopt.txt if
+ * there is one, and the defaults.  Once the collector is up the options
+ * which can change take effect at the next cycle, the others are refused.
+ */
+enum GCOPTERR { 
+  GCOPT_OK=0, 
+  GCOPT_UNKNOWN=-1, 
+  GCOPT_RANGE=-2, 
+  GCOPT_FIXED=-3, 
+  GCOPT_SYNTAX=-4 
+};
+
+#define GCOPT_FILE  "gcopt.txt"
+#define GCOPT_ENV   "YLRC_GCOPT"
+
+GCEXPORT int   gcSetOption(const char *name, int val);
+GCEXPORT int   gcSetOptions(const char *spec);
+GCEXPORT int   gcGetOption(const char *name, int *pVal);
 
 extern struct BLKVAR     blkvar;
 extern struct CHKCONV    chkconv;
@@ -11,18 +11,36 @@ GCFUNC  bool     gcCompareAndSwap( unsigned *addr, unsigned oldv, unsigned newv)
 GCFUNC  void     gcSpinLockEnter(volatile unsigned *p, unsigned id);
 GCFUNC  void     gcSpinLockExit(volatile unsigned *p, unsigned id);
 GCFUNC  void     gcCheckGC(void);
+GCFUNC  void     gcWorkInit( int nWorkers );
+GCFUNC  void     gcWorkParallel( GCWORKFUNC func, void *arg );
+GCFUNC  int      gcWorkClaim( volatile long *pNext, int n, int batch );
+GCFUNC  void     gcWorkPlace( void );
+GCFUNC  void     gcNoteFreedBlocks( int nBlocks );
 
 GCFUNC  void              blkInit( unsigned nMB );
 GCFUNC  BlkAllocHdr*      blkAllocBlock( ExecEnv *ee );
+GCFUNC  void              blkReleaseThreadCache( ExecEnv *ee );
+GCFUNC  void              blkDrainThreadCache( ExecEnv *ee );
+GCFUNC  void              blkFreeDrainedBlocks( void );
 GCFUNC  void              blkFreeChunkedBlock( BlkAllocHdr *ph );
 GCFUNC  void              blkFreeSomeChunkedBlocks( BlkAllocHdr **pph, int nBlocks );
 GCFUNC  void              blkFreeRegion( BlkAllocBigHdr *ph );
 GCFUNC  void              blkSweep(void);
+GCFUNC  void              blkPrepareLazySweep(void);
+GCFUNC  void              blkSweepPending(void);
+GCFUNC  void              blkTrim(void);
+GCFUNC  void              blkZeroFree(void);
 
 
 GCFUNC    void     chkFlushRecycledListEntry( RLCENTRY *rlce );
 GCFUNC    void     chkFlushRecycledListsCache( void );
 GCFUNC    void     chkSweepChunkedBlock( BlkAllocHdr *ph, int status);
+GCFUNC    void     chkMarkForLazySweep( BlkAllocHdr *ph, int status);
+GCFUNC    void     chkSweepPendingBlock( BlkAllocHdr *ph );
+GCFUNC    void     chkWaitForLazySweepers( void );
+GCFUNC    void     chkSweepChunkedBlockDeferred( BlkAllocHdr *ph, SWEEPWORKER *w );
+GCFUNC    void     chkApplySweepRecords( SWEEPWORKER *w );
+GCFUNC    void     chkRetireAllocList( ExecEnv *ee, ALLOCLIST *allocList );
 GCFUNC    void     chkInit(unsigned nMB);
 
 #ifdef RCDEBUG
@@ -31,25 +49,46 @@ GCFUNC void chkPreCollect(BLKOBJ* o);
 
 #ifdef RCNOINLINE
 
-GCFUNC void H1BIT_Set(byte* entry, unsigned h);
-GCFUNC void H1BIT_Clear(byte* entry, unsigned h);
-GCFUNC void H1BIT_ClearByte(byte* entry, unsigned h);
-GCFUNC void H1BIT_Put(byte* entry, unsigned h, unsigned val);
-GCFUNC byte H1BIT_Get(byte* entry, unsigned h);
-GCFUNC void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size );
-
-GCFUNC void H2BIT_Put(byte* entry, unsigned h, unsigned val);
-GCFUNC void H2BIT_Clear(byte* entry, unsigned h);
-GCFUNC void H2BIT_Stuck(byte* entry, unsigned h);
-GCFUNC byte H2BIT_Get(byte* entry, unsigned h);
-GCFUNC void H2BIT_Inc(byte* entry, unsigned h);
-GCFUNC byte H2BIT_IncRV(byte* entry, unsigned h);
-GCFUNC byte H2BIT_Dec(byte* entry, unsigned h);
-GCFUNC void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, unsigned rep_size );
+GCFUNC void H1BIT_Set(byte* entry, haddr h);
+GCFUNC void H1BIT_Clear(byte* entry, haddr h);
+GCFUNC void H1BIT_ClearByte(byte* entry, haddr h);
+GCFUNC void H1BIT_Put(byte* entry, haddr h, unsigned val);
+GCFUNC byte H1BIT_Get(byte* entry, haddr h);
+GCFUNC void H1BIT_Init(H1BIT_BMP* bmp, unsigned* rep_addr, size_t rep_size );
+
+GCFUNC void H2BIT_Put(byte* entry, haddr h, unsigned val);
+GCFUNC void H2BIT_Clear(byte* entry, haddr h);
+GCFUNC void H2BIT_Stuck(byte* entry, haddr h);
+GCFUNC byte H2BIT_Get(byte* entry, haddr h);
+GCFUNC void H2BIT_Inc(byte* entry, haddr h);
+GCFUNC byte H2BIT_IncRV(byte* entry, haddr h);
+GCFUNC byte H2BIT_Dec(byte* entry, haddr h);
+GCFUNC void H2BIT_Init(H2BIT_BMP* bmp, unsigned* rep_addr, size_t rep_size );
+
+GCFUNC void H1BIT_AtomicSet(byte* entry, haddr h);
+GCFUNC void H1BIT_AtomicClear(byte* entry, haddr h);
+GCFUNC void H2BIT_AtomicStuck(byte* entry, haddr h);
+GCFUNC void H2BIT_AtomicInc(byte* entry, haddr h);
+GCFUNC byte H2BIT_AtomicIncRV(byte* entry, haddr h);
+GCFUNC byte H2BIT_AtomicDec(byte* entry, haddr h);
+
+GCFUNC byte HMETA_GetRC(byte* entry, haddr h);
+GCFUNC void HMETA_Inc(byte* entry, haddr h);
+GCFUNC byte HMETA_IncRV(byte* entry, haddr h);
+GCFUNC byte HMETA_Dec(byte* entry, haddr h);
+GCFUNC byte HMETA_Get(byte* entry, haddr h, unsigned flag);
+GCFUNC void HMETA_Set(byte* entry, haddr h, unsigned flag);
+GCFUNC void HMETA_Clear(byte* entry, haddr h, unsigned flag);
+GCFUNC byte HMETA_AtomicIncRV(byte* entry, haddr h);
+GCFUNC byte HMETA_AtomicDec(byte* entry, haddr h);
+GCFUNC void HMETA_AtomicSet(byte* entry, haddr h, unsigned flag);
+GCFUNC void HMETA_AtomicClear(byte* entry, haddr h, unsigned flag);
+GCFUNC void HMETA_Init(HMETA_BMP* bmp, unsigned* rep_addr, size_t rep_size );
 
 #endif /*  RCNOINLINE */
 
 GCFUNC   uint  gcGetHandleRC(GCHandle* h);
+GCFUNC   bool  gcIsHandleGarbage(GCHandle* h);
 
 /***********************************************************
  * System utilities layer (MOK)
@@ -61,17 +100,37 @@ GCFUNC   uint  gcGetHandleRC(GCHandle* h);
  * Memory 
  */
 /* Advanced */
-GCFUNC void* mokMemReserve(void *starting_at_hint, unsigned sz );
-GCFUNC void  mokMemUnreserve( void *start, unsigned sz );
-GCFUNC void* mokMemCommit( void *start, unsigned sz, bool zero_out );
-GCFUNC void  mokMemDecommit( void *start, unsigned sz );
+GCFUNC void* mokMemReserve(void *starting_at_hint, size_t sz );
+GCFUNC void  mokMemUnreserve( void *start, size_t sz );
+GCFUNC void* mokMemCommit( void *start, size_t sz, bool zero_out );
+GCFUNC void* mokMemTryCommit( void *start, size_t sz, bool zero_out );
+GCFUNC void  mokMemDecommit( void *start, size_t sz );
 
 /* C style */
 GCFUNC void* mokMalloc( unsigned sz, bool zero_out );
 GCFUNC void  mokFree( void *);
 
 /* zero out */
-GCFUNC void  mokMemZero( void *start, unsigned sz );
+GCFUNC void  mokMemZero( void *start, size_t sz );
+
+/* Large pages */
+GCFUNC unsigned mokMemEnableLargePages( void );
+GCFUNC void*    mokMemReserveLarge( size_t sz );
+GCFUNC void*    mokMemReserveCommitted( size_t sz );
+GCFUNC void     mokMemLargeStats( size_t *pWanted, size_t *pObtained );
+
+/*
+ * NUMA
+ */
+GCFUNC int   mokNumaNodeCount( void );
+GCFUNC int   mokCurrentNumaNode( void );
+GCFUNC void* mokMemCommitOnNode( void *start, size_t sz, int node );
+GCFUNC void* mokMemTryCommitOnNode( void *start, size_t sz, int node );
+
+/*
+ * Threads
+ */
+GCFUNC HANDLE mokThreadCreate( DWORD (WINAPI *f)(void*), void *param );
 
 #define mokAssert sysAssert
 #define gcAssert  sysAssert
@@ -81,10 +140,14 @@ GCFUNC void  mokMemZero( void *start, unsigned sz );
 #define Im_free   0x12344321
 #endif
 
-int x86CompareAndSwap(unsigned *addr, unsigned oldv, unsigned newv);
-
-#define ___compare_and_swap  x86CompareAndSwap
-#define gcCompareAndSwap     x86CompareAndSwap
+/* 
+ * InterlockedCompareExchange is the compiler's lock cmpxchg, inlined and
+ * a full barrier like the JVM's x86CompareAndSwap, which is x86 only
+ * and costs a call.
+ */
+#define ___compare_and_swap(addr,oldv,newv) \
+  (InterlockedCompareExchange( (volatile LONG*)(addr), (LONG)(newv), (LONG)(oldv) ) == (LONG)(oldv))
+#define gcCompareAndSwap     ___compare_and_swap
 
 
 /*
@@ -112,7 +175,7 @@ static bhUnlock(BlkAllocHdr* p)
     word oldv, newv;
     oldv =  *ptr;
     if (!(oldv & LOCKMASK )) {
-      __asm { int 3 }
+      __debugbreak();
     }
     newv = oldv & ~LOCKMASK;
     if (gcCompareAndSwap( (word*)ptr, oldv, newv))
@@ -120,6 +183,60 @@ static bhUnlock(BlkAllocHdr* p)
   }
  ___do_bh_unlock_end:;
 }
+
+/*
+ * p is a pointer to BlkAllocHdr.  Change its status from "from" to "to",
+ * leaving the rest of the header word alone.  Fails if the status is
+ * not "from".
+ */
+static bool bhCasStatus(BlkAllocHdr *p, unsigned from, unsigned to)
+{
+  volatile word *ptr = (volatile word*)&p->StatusLockBinidx;
+  for (;;) {
+    word oldv, newv;
+    oldv =  *ptr;
+    if ((oldv >> 24) != from)
+      return false;
+    newv = (oldv & ~STATUSMAK) | (to << 24);
+    if (gcCompareAndSwap( (word*)ptr, oldv, newv))
+      return true;
+  }
+}
+
+/*
+ * p is a pointer to BlkAllocHdr.  Set the sweep-pending mark.  The
+ * header word is shared with the lock so this must be a CAS.
+ */
+static void bhSetSweepPending(BlkAllocHdr *p)
+{
+  volatile word *ptr = (volatile word*)&p->StatusLockBinidx;
+  for (;;) {
+    word oldv, newv;
+    oldv =  *ptr;
+    newv = oldv | SWEEPMASK;
+    if (gcCompareAndSwap( (word*)ptr, oldv, newv))
+      return;
+  }
+}
+
+/*
+ * p is a pointer to BlkAllocHdr.  Clear the sweep-pending mark.  Returns
+ * true iff it was this call that cleared it, i.e., the caller now owns
+ * the job of sweeping the block.
+ */
+static bool bhClaimSweep(BlkAllocHdr *p)
+{
+  volatile word *ptr = (volatile word*)&p->StatusLockBinidx;
+  for (;;) {
+    word oldv, newv;
+    oldv =  *ptr;
+    if (!(oldv & SWEEPMASK))
+      return false;
+    newv = oldv & ~SWEEPMASK;
+    if (gcCompareAndSwap( (word*)ptr, oldv, newv))
+      return true;
+  }
+}
 #pragma optimize( "", on )
 
 